@@ -1,8 +1,26 @@
 
+#ifdef USE_DEFERRED_LIGHTING
+in VertexData {
+	vec2 texcoord;
+} screen;
+// Rebuilt from the G-buffer depth, stands in for the interpolated inputs
+struct SurfaceData {
+	vec3 position;
+	vec3 worldPosition;
+} input;
+#else
 VERTEX_DATA(in, input);
+#endif
 
+#ifdef USE_GBUFFER
+layout(location = 0) out vec4 gbufferAlbedo; // rgb: diffuse color, a: weight of lighting (1 - reflection)
+layout(location = 1) out vec4 gbufferNormal; // xyz: view space normal, a: shininess
+layout(location = 2) out vec4 gbufferSpecular; // rgb: specular color, a: receives shadows
+layout(location = 3) out vec4 gbufferUnlit; // rgb: ambient, emission and reflection, a: emissive
+#else
 layout(location = 0) out vec4 fragment;
 layout(location = 1) out vec4 brightFragment;
+#endif
 
 #if defined(USE_NORMAL_MAP) || defined(USE_PARALLAX_MAP)
 // http://www.thetenthplanet.de/archives/1180
@@ -42,10 +60,13 @@ vec3 perturb_normal(mat3 TBN, vec2 texcoord)
 vec2 parallax_mapping(vec2 texcoord, vec3 viewDir)
 {
 	const float heightScale = material.parallax;
-	// number of depth layers
+	// number of depth layers, fewer with distance where the offset covers only a few pixels
 	const float minLayers = 12;
 	const float maxLayers = 32;
+	const float fullDetailDistance = 10.0;
+	float distanceScale = clamp(fullDetailDistance / length(input.position), 0.25, 1.0);
 	float numLayers = mix(maxLayers, minLayers, abs(dot(vec3(0.0, 0.0, 1.0), viewDir)));
+	numLayers = max(numLayers * distanceScale * detailParams.x, 4.0);
 	// calculate the size of each layer
 	float layerDepth = 1.0 / numLayers;
 	// depth of current layer
@@ -106,14 +127,6 @@ const vec2 poissonDisk[SHADOW_TAPS] = vec2[](
 	vec2(0.14383161, -0.14100790)
 );
 
-const vec3 gridSamplingDisk[20] = vec3[](
-	vec3(1, 1, 1), vec3(1, -1, 1), vec3(-1, -1, 1), vec3(-1, 1, 1),
-	vec3(1, 1, -1), vec3(1, -1, -1), vec3(-1, -1, -1), vec3(-1, 1, -1),
-	vec3(1, 1, 0), vec3(1, -1, 0), vec3(-1, -1, 0), vec3(-1, 1, 0),
-	vec3(1, 0, 1), vec3(-1, 0, 1), vec3(1, 0, -1), vec3(-1, 0, -1),
-	vec3(0, 1, 1), vec3(0, -1, 1), vec3(0, -1, -1), vec3(0, 1, -1)
-);
-
 float random(vec3 seed, int i) {
 	vec4 seed4 = vec4(seed, i);
 	float dot_product = dot(seed4, vec4(12.9898, 78.233, 45.164, 94.673));
@@ -124,7 +137,13 @@ float random(vec3 seed, int i) {
 // http://www.opengl-tutorial.org/intermediate-tutorials/tutorial-16-shadow-mapping/
 float shadow_mapping()
 {
-	vec4 pos = input.shadowcoord;
+	// Pick the cascade by view depth
+	float depth = -input.position.z;
+	int cascade = 0;
+	for (int i = 0; i < numCascades - 1; ++i)
+		if (depth > cascadeSplits[i])
+			cascade = i + 1;
+	vec4 pos = cascadeMatrices[cascade] * vec4(input.worldPosition, 1.0);
 	vec3 projCoords = pos.xyz / pos.w;
 
 	if (projCoords.z > 1.0)
@@ -139,55 +158,160 @@ float shadow_mapping()
 #ifdef USE_PCF
 	float shadow = 0.0;
 	float pcfRadius = 0.75;
-	vec2 texelSize = 1.0 / textureSize(shadowMap, 0);
-	const int samples = 4;
+	vec2 texelSize = 1.0 / textureSize(shadowMap, 0).xy;
+	// Farther cascades have bigger texels and get fewer taps, a single tap samples the center
+	int samples = clamp(int(4.0 * detailParams.x / float(1 << cascade) + 0.5), 1, SHADOW_TAPS);
+	if (samples == 1)
+		pcfRadius = 0.0;
 	for (int i = 0; i < samples; ++i) {
 		//int index = i;
 		int index = int(16.0 * random(gl_FragCoord.xyy, i)) % 16;
 		//int index = int(16.0 * random(floor(input.worldPosition.xyz * 1000.0), i)) % 16;
-		float closestDepth = texture(shadowMap, projCoords.xy + poissonDisk[index] * texelSize * pcfRadius).r;
+		float closestDepth = texture(shadowMap, vec3(projCoords.xy + poissonDisk[index] * texelSize * pcfRadius, cascade)).r;
 		shadow += currentDepth > closestDepth ? 1.0 : 0.0;
 	}
 	return shadow / float(samples);
 #else
-	float closestDepth = texture(shadowMap, projCoords.xy).r;
+	float closestDepth = texture(shadowMap, vec3(projCoords.xy, cascade)).r;
 	return currentDepth > closestDepth ? 1.0 : 0.0;
 #endif
 }
 
 // http://learnopengl.com/#!Advanced-Lighting/Shadows/Point-Shadows
-// http://www.sunandblackcat.com/tipFullView.php?topicid=36
-float shadow_mapping_cube(in int lightIndex, in int shadowIndex)
+// Cube faces are tiles in the shadow atlas, laid out 3x2 in face order.
+// Face orientations must match RenderDevice::setupCubeMatrices().
+float shadow_mapping_atlas(in UniformLightData light)
 {
-	vec3 fragToLight = input.worldPosition - lights[lightIndex].position;
-	float far = lights[lightIndex].params.x;
+	if (light.shadowRect.z <= 0.0)
+		return 0.0;
+	vec3 fragToLight = input.worldPosition - light.shadowOrigin.xyz;
+	vec3 a = abs(fragToLight);
+	vec3 d = fragToLight;
+	int face;
+	float ma;
+	vec2 st;
+	if (a.x >= a.y && a.x >= a.z) {
+		face = d.x > 0.0 ? 0 : 1;
+		ma = a.x;
+		st = d.x > 0.0 ? vec2(-d.z, -d.y) : vec2(d.z, -d.y);
+	} else if (a.y >= a.z) {
+		face = d.y > 0.0 ? 2 : 3;
+		ma = a.y;
+		st = d.y > 0.0 ? vec2(d.x, d.z) : vec2(d.x, -d.z);
+	} else {
+		face = d.z > 0.0 ? 4 : 5;
+		ma = a.z;
+		st = d.z > 0.0 ? vec2(d.x, -d.y) : vec2(-d.x, -d.y);
+	}
+	// Keep bilinear taps inside the tile
+	float halfTexel = 0.5 / light.shadowRect.w;
+	vec2 uv = clamp(st / ma * 0.5 + 0.5, halfTexel, 1.0 - halfTexel);
+	uv = light.shadowRect.xy + (vec2(face % 3, face / 3) + uv) * light.shadowRect.z;
+
+	float far = light.shadowOrigin.w;
 	const float bias = 0.005;
 	float currentDepth = length(fragToLight) - bias;
-#if 0 && defined(USE_PCF)
-	float shadow = 0.0;
-	float viewDistance = length(cameraPosition - input.worldPosition);
-	float pcfRadius = (1.0 + (viewDistance / far)) / 100.0;
-	const int samples = 4;
-	for (int i = 0; i < samples; ++i) {
-		int index = i;
-		//int index = int(20.0 * random(gl_FragCoord.xyy, i)) % 20;
-		//int index = int(20.0 * random(floor(input.worldPosition.xyz * 1000.0), i)) % 20;
-		vec3 uvw = fragToLight + gridSamplingDisk[index] * pcfRadius;
-		float closestDepth = texture(shadowCube[shadowIndex], uvw).r;
-		closestDepth *= far;
-		shadow += currentDepth > closestDepth ? 1.0 : 0.0;
-	}
-	return shadow / float(samples);
-#else
-	float closestDepth = texture(shadowCube[shadowIndex], fragToLight).r;
-	closestDepth *= far;
+	float closestDepth = texture(shadowAtlas, uv).r * far;
 	return currentDepth > closestDepth ? 1.0 : 0.0;
-#endif
 }
 #endif // USE_SHADOW_MAP
 
+#if defined(USE_DIFFUSE) || defined(USE_SPECULAR)
+UniformLightData fetch_light(int index)
+{
+	UniformLightData light;
+	light.color = texelFetch(lightBuffer, index * 6).rgb;
+	light.position = texelFetch(lightBuffer, index * 6 + 1).xyz;
+	light.direction = texelFetch(lightBuffer, index * 6 + 2).xyz;
+	light.params = texelFetch(lightBuffer, index * 6 + 3);
+	light.shadowRect = texelFetch(lightBuffer, index * 6 + 4);
+	light.shadowOrigin = texelFetch(lightBuffer, index * 6 + 5);
+	return light;
+}
+
+#ifndef USE_CUBE_RENDER
+// Offset and count of the fragment's cluster in clusterIndices
+uvec2 cluster_lights()
+{
+	ivec2 tile = ivec2(gl_FragCoord.xy * clusterParams.xy);
+	int slice = int(max(log(-input.position.z) * clusterParams.z + clusterParams.w, 0.0));
+	tile = min(tile, ivec2(CLUSTER_TILES_X - 1, CLUSTER_TILES_Y - 1));
+	slice = min(slice, CLUSTER_SLICES - 1);
+	return texelFetch(clusterGrid, (slice * CLUSTER_TILES_Y + tile.y) * CLUSTER_TILES_X + tile.x).xy;
+}
+#endif
+#endif
+
+#ifdef USE_ENV_MAP
+// Moving objects near the dynamic probe use its cube, others blend the two nearest baked probes
+vec3 sample_reflection(vec3 dir)
+{
+	vec3 center = input.objectCenter;
+	if (numProbes == 0 || distance(center, dynamicProbe.xyz) < dynamicProbe.w)
+		return texture(envMap, dir).rgb;
+	int first = 0, second = 0;
+	float dist0 = 1e30, dist1 = 1e30;
+	for (int i = 0; i < numProbes; ++i) {
+		float dist = distance(center, probePositions[i].xyz);
+		if (dist < dist0) {
+			second = first; dist1 = dist0;
+			first = i; dist0 = dist;
+		} else if (dist < dist1) {
+			second = i; dist1 = dist;
+		}
+	}
+	vec3 refl = texture(probeArray, vec4(dir, first)).rgb;
+	if (numProbes == 1)
+		return refl;
+	return mix(refl, texture(probeArray, vec4(dir, second)).rgb, dist0 / (dist0 + dist1));
+}
+#endif
+
+#ifdef USE_LOD_FADE
+// 4x4 ordered dither threshold
+float bayer4(ivec2 p)
+{
+	const int pattern[16] = int[](0, 8, 2, 10, 12, 4, 14, 6, 3, 11, 1, 9, 15, 7, 13, 5);
+	return (float(pattern[(p.y & 3) * 4 + (p.x & 3)]) + 0.5) / 16.0;
+}
+#endif
+
 void main()
 {
+#ifdef USE_LOD_FADE
+	// Screen-door cross-fade: the outgoing LOD (positive fade) and the incoming one (negative)
+	// keep complementary pixels, so together they cover the object exactly once
+	if ((lodFade > 0.0) == (bayer4(ivec2(gl_FragCoord.xy)) < abs(lodFade)))
+		discard;
+#endif
+#ifdef USE_DEFERRED_LIGHTING
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+	float depthTex = texelFetch(gbufferDepthMap, pixel, 0).r;
+	if (depthTex >= 1.0)
+		discard; // Sky
+	// View space position from depth, projection is perspective
+	vec3 ndc = vec3(screen.texcoord, depthTex) * 2.0 - 1.0;
+	float viewZ = -projectionMatrix[3][2] / (ndc.z + projectionMatrix[2][2]);
+	vec2 viewXY = -viewZ * (ndc.xy + vec2(projectionMatrix[2][0], projectionMatrix[2][1]))
+		/ vec2(projectionMatrix[0][0], projectionMatrix[1][1]);
+	input.position = vec3(viewXY, viewZ);
+	input.worldPosition = transpose(mat3(viewMatrix)) * (input.position - viewMatrix[3].xyz);
+
+	vec4 albedoTex = texelFetch(gbufferAlbedoMap, pixel, 0);
+	vec4 normalTex = texelFetch(gbufferNormalMap, pixel, 0);
+	vec4 specularTex = texelFetch(gbufferSpecularMap, pixel, 0);
+	vec4 unlitTex = texelFetch(gbufferUnlitMap, pixel, 0);
+	vec3 diffuseComp = vec3(0);
+	vec3 specularComp = vec3(0);
+	vec3 emissionComp = vec3(unlitTex.a);
+
+	vec3 viewDir = normalize(-input.position);
+	vec3 normal = normalize(normalTex.xyz);
+	vec3 diffuseColor = albedoTex.rgb;
+	vec3 specularColor = specularTex.rgb;
+	float shininess = normalTex.a;
+	bool receiveShadows = specularTex.a > 0.5;
+#else
 	// Accumulators
 	vec3 ambientComp = globalAmbient * material.ambient;
 	vec3 diffuseComp = vec3(0);
@@ -243,15 +367,21 @@ void main()
 	emissionComp *= texture(emissionMap, texcoord).rgb;
 #endif
 
+	vec3 diffuseColor = material.diffuse * diffuseTex.rgb;
+	vec3 specularColor = material.specular * specularTex.rgb;
+	float shininess = material.shininess;
+	bool receiveShadows = true;
+#endif // USE_DEFERRED_LIGHTING
+
 	float sunAmount = 0.0;
-#if defined(USE_DIFFUSE) || defined(USE_SPECULAR)
+#if (defined(USE_DIFFUSE) || defined(USE_SPECULAR)) && !defined(USE_GBUFFER)
 
 	if (sunColor.r > 0 || sunColor.g > 0 || sunColor.b > 0) {
 		vec3 sunDir = normalize((viewMatrix * vec4(sunPosition, 0.0)).xyz);
 		sunAmount = max(dot(viewDir, -sunDir), 0.0);
 
 #ifdef USE_SHADOW_MAP
-		float visibility = max(1.0 - shadow_mapping(), shadowDarkness);
+		float visibility = receiveShadows ? max(1.0 - shadow_mapping(), shadowDarkness) : 1.0;
 #else
 		float visibility = 1.0;
 #endif
@@ -259,28 +389,36 @@ void main()
 		// Sun diffuse
 #ifdef USE_DIFFUSE
 		float diff = max(dot(normal, sunDir), 0.0);
-		diffuseComp += visibility * diff * material.diffuse * sunColor * diffuseTex.rgb;
+		diffuseComp += visibility * diff * diffuseColor * sunColor;
 #endif
 		// Sun specular
 #ifdef USE_SPECULAR
 #ifdef USE_PHONG
-		const float energy = (2.0 + material.shininess) / (2.0 * PI);
+		const float energy = (2.0 + shininess) / (2.0 * PI);
 		vec3 reflectDir = reflect(-sunDir, normal);
-		float spec = energy * pow(max(dot(viewDir, reflectDir), 0.0), material.shininess);
+		float spec = energy * pow(max(dot(viewDir, reflectDir), 0.0), shininess);
 #else // Blinn-Phong
-		const float energy = (8.0 + material.shininess) / (8.0 * PI);
+		const float energy = (8.0 + shininess) / (8.0 * PI);
 		vec3 halfDir = normalize(sunDir + viewDir);
-		float spec = energy * pow(max(dot(normal, halfDir), 0.0), material.shininess);
+		float spec = energy * pow(max(dot(normal, halfDir), 0.0), shininess);
 #endif
-		specularComp += visibility * spec * material.specular * sunColor * specularTex.rgb;
+		specularComp += visibility * spec * specularColor * sunColor;
 #endif
 	}
 
-	// Point lights
+	// Point lights, only the ones affecting this cluster
+#ifdef USE_CUBE_RENDER
 	const int count = min(numLights, MAX_LIGHTS);
-	for (int i = 0; i < count; ++i)
+	for (int j = 0; j < count; ++j)
+	{
+		int i = j;
+#else
+	uvec2 cluster = cluster_lights();
+	for (uint j = 0u; j < cluster.y; ++j)
 	{
-		UniformLightData light = lights[i];
+		int i = int(texelFetch(clusterIndices, int(cluster.x + j)).r);
+#endif
+		UniformLightData light = fetch_light(i);
 		vec3 lightPos = (viewMatrix * vec4(light.position, 1.0)).xyz;
 
 		// Attenuation
@@ -294,28 +432,28 @@ void main()
 		// Shadow
 		float visibility = 1.0;
 #ifdef USE_SHADOW_MAP
-		if (i < MAX_SHADOW_CUBES)
-			visibility = max(1.0 - shadow_mapping_cube(i, i), shadowDarkness);
+		if (receiveShadows)
+			visibility = max(1.0 - shadow_mapping_atlas(light), shadowDarkness);
 #endif
 
 		// Diffuse
 #ifdef USE_DIFFUSE
 		float diff = max(dot(normal, lightDir), 0.0);
-		diffuseComp += visibility * attenuation * diff * material.diffuse * light.color * diffuseTex.rgb;
+		diffuseComp += visibility * attenuation * diff * diffuseColor * light.color;
 #endif
 
 		// Specular
 #ifdef USE_SPECULAR
 #ifdef USE_PHONG
-		const float energy = (2.0 + material.shininess) / (2.0 * PI);
+		const float energy = (2.0 + shininess) / (2.0 * PI);
 		vec3 reflectDir = reflect(-lightDir, normal);
-		float spec = energy * pow(max(dot(viewDir, reflectDir), 0.0), material.shininess);
+		float spec = energy * pow(max(dot(viewDir, reflectDir), 0.0), shininess);
 #else // Blinn-Phong
-		const float energy = (8.0 + material.shininess) / (8.0 * PI);
+		const float energy = (8.0 + shininess) / (8.0 * PI);
 		vec3 halfDir = normalize(lightDir + viewDir);
-		float spec = energy * pow(max(dot(normal, halfDir), 0.0), material.shininess);
+		float spec = energy * pow(max(dot(normal, halfDir), 0.0), shininess);
 #endif
-		specularComp += visibility * attenuation * spec * material.specular * light.color * specularTex.rgb;
+		specularComp += visibility * attenuation * spec * specularColor * light.color;
 #endif
 	}
 #endif // defined(USE_DIFFUSE) || defined(USE_SPECULAR)
@@ -324,37 +462,77 @@ void main()
 	vec3 worldNormal = normalize((vec4(normal, 0.0) * viewMatrix).xyz);
 	vec3 worldView = normalize((vec4(viewDir, 0.0) * viewMatrix).xyz);
 	vec3 envRefl = reflect(-worldView, worldNormal);
-	vec4 envTex = texture(envMap, envRefl);
+	vec4 envTex = vec4(sample_reflection(envRefl), 1.0);
 	float reflStrength = material.reflectivity;
 #if defined(USE_REFLECTION_MAP)
 	reflStrength *= texture(reflectionMap, texcoord).r;
 #elif defined(USE_SPECULAR_MAP)
 	reflStrength *= texture(specularMap, texcoord).g;
 #endif
+#endif
+
+#if defined(USE_GBUFFER)
+	// Lighting is added by the deferred pass: unlit + (diffuse + specular) * weight
+#ifndef USE_DIFFUSE
+	diffuseColor = vec3(0.0);
+#endif
+#ifndef USE_SPECULAR
+	specularColor = vec3(0.0);
+#endif
+	vec3 unlit = ambientComp + emissionComp;
+	float litWeight = 1.0;
+#ifdef USE_ENV_MAP
+	unlit = mix(unlit, envTex.rgb, reflStrength);
+	litWeight = 1.0 - reflStrength;
+#endif
+#ifdef USE_VERTEX_COLOR
+	diffuseColor *= input.color.rgb;
+	specularColor *= input.color.rgb;
+	unlit *= input.color.rgb;
+#endif
+#ifdef USE_SHADOW_MAP
+	const float shadowed = 1.0;
+#else
+	const float shadowed = 0.0;
+#endif
+	gbufferAlbedo = vec4(diffuseColor, litWeight);
+	gbufferNormal = vec4(normal, shininess);
+	gbufferSpecular = vec4(specularColor, shadowed);
+	gbufferUnlit = vec4(unlit, dot(emissionComp, emissionComp) > 0.0 ? 1.0 : 0.0);
+	return;
+#elif defined(USE_DEFERRED_LIGHTING)
+	fragment = vec4(unlitTex.rgb + (diffuseComp + specularComp) * albedoTex.a, 1.0);
+#else
 	fragment = vec4(ambientComp + diffuseComp + specularComp + emissionComp, alpha);
+#ifdef USE_ENV_MAP
 	fragment.rgb = mix(fragment.rgb, envTex.rgb, reflStrength); // Mix
 	//fragment.rgb = mix(fragment.rgb, fragment.rgb * envTex.rgb, reflStrength); // Multiply
 	//fragment.rgb += envTex.rgb * reflStrength; // Add
-#else
-	fragment = vec4(ambientComp + diffuseComp + specularComp + emissionComp, alpha);
+#endif
 #endif
 
-#ifdef USE_VERTEX_COLOR
+#if defined(USE_VERTEX_COLOR) && !defined(USE_GBUFFER)
 	// May be useful with e.g. baking AO to vertex color, but needs different modes
 	fragment *= input.color;
 #endif
 
-#ifdef USE_FOG
+#if defined(USE_FOG) && !defined(USE_GBUFFER)
 	// http://iquilezles.org/www/articles/fog/fog.htm
+#ifdef USE_DEFERRED_LIGHTING
+	float depth = -input.position.z;
+#else
 	float depth = gl_FragCoord.z / gl_FragCoord.w;
+#endif
 	float fogAmount = 1.0 - exp(-depth * fogDensity);
 	vec3 sunAffectedFogColor = mix(fogColor, sunColor, pow(sunAmount, 8.0));
 	fragment.rgb = mix(fragment.rgb, sunAffectedFogColor, fogAmount);
 #endif
 
+#ifndef USE_GBUFFER
 	if (bloomThreshold > 0.f) {
 		float brightness = dot(fragment.rgb, vec3(0.2126, 0.7152, 0.0722));
 		brightFragment = (brightness > bloomThreshold || dot(emissionComp, emissionComp) > 0.0)
 			? vec4(fragment.rgb, 1.0) : vec4(0.0, 0.0, 0.0, 1.0);
 	} else brightFragment = vec4(0.0, 0.0, 0.0, 1.0);
+#endif
 }
@@ -12,8 +12,15 @@ layout(location = ATTR_COLOR) in vec4 color;
 layout(location = ATTR_BONE_INDEX) in vec4 boneIndices;
 layout(location = ATTR_BONE_WEIGHT) in vec4 boneWeights;
 #endif
+#ifdef USE_INSTANCING
+layout(location = ATTR_INSTANCE_MATRIX) in mat4 instanceMatrix;
+#endif
+#ifdef USE_VERTEX_LAYER
+layout(location = ATTR_INSTANCE_FACE) in uint instanceFace;
+#endif
 
 VERTEX_DATA(out, outData);
+invariant gl_Position;
 
 void main()
 {
@@ -28,13 +35,28 @@ void main()
 	n = (vec4(n, 0.0) * m).xyz;
 #endif // USE_SKINNING
 
+#ifdef USE_INSTANCING
+	mat4 modelMat = instanceMatrix;
+	mat4 modelViewMat = viewMatrix * modelMat;
+	mat4 modelViewProjMat = projectionMatrix * modelViewMat;
+	mat3 normalMat = transpose(inverse(mat3(modelViewMat)));
+#else
+	mat4 modelMat = modelMatrix;
+	mat4 modelViewMat = modelViewMatrix;
+	mat4 modelViewProjMat = modelViewProjMatrix;
+	mat3 normalMat = mat3(normalMatrix);
+#endif
+
 #if !defined(USE_TESSELLATION) && !defined(USE_CUBE_RENDER)
-	gl_Position = modelViewProjMatrix * pos;
+	gl_Position = modelViewProjMat * pos;
+#elif !defined(USE_TESSELLATION) && defined(USE_VERTEX_LAYER)
+	gl_Position = cubeMatrices[instanceFace] * (modelMat * pos);
+	gl_Layer = int(instanceFace);
 #elif !defined(USE_TESSELLATION) && defined(USE_CUBE_RENDER)
-	gl_Position = modelMatrix * pos;
+	gl_Position = modelMat * pos;
 #endif
-	outData.normal = mat3(normalMatrix) * n;
-	outData.position = (modelViewMatrix * pos).xyz;
+	outData.normal = normalMat * n;
+	outData.position = (modelViewMat * pos).xyz;
 	outData.texcoord = texcoord * material.uvRepeat + material.uvOffset;
 #ifdef USE_TANGENT
 	outData.tangent = tangent; // TODO
@@ -43,8 +65,10 @@ void main()
 	outData.color = color;
 #endif
 #ifdef USE_SHADOW_MAP
-	outData.worldPosition = (modelMatrix * pos).xyz;
-	outData.shadowcoord = shadowMatrix * pos;
+	outData.worldPosition = (modelMat * pos).xyz;
+#endif
+#ifdef USE_ENV_MAP
+	outData.objectCenter = modelMat[3].xyz;
 #endif
 }
 
@@ -7,6 +7,12 @@ layout(location = ATTR_TEXCOORD) in vec2 texcoord;
 layout(location = ATTR_BONE_INDEX) in vec4 boneIndices;
 layout(location = ATTR_BONE_WEIGHT) in vec4 boneWeights;
 #endif
+#ifdef USE_INSTANCING
+layout(location = ATTR_INSTANCE_MATRIX) in mat4 instanceMatrix;
+#endif
+#ifdef USE_VERTEX_LAYER
+layout(location = ATTR_INSTANCE_FACE) in uint instanceFace;
+#endif
 
 #if defined(USE_ALPHA_TEST) || defined(USE_DEPTH_CUBE)
 out VertexData {
@@ -19,6 +25,8 @@ out VertexData {
 } outData;
 #endif
 
+invariant gl_Position;
+
 void main()
 {
 	vec4 pos = vec4(position, 1.0);
@@ -29,7 +37,16 @@ void main()
 	m += boneMatrices[int(boneIndices.w)] * boneWeights.w;
 	pos = vec4(pos * m, 1.0);
 #endif // USE_SKINNING
-#ifdef USE_DEPTH_CUBE
+#if defined(USE_VERTEX_LAYER)
+	outData.position = (instanceMatrix * pos).xyz;
+	gl_Position = cubeMatrices[instanceFace] * vec4(outData.position, 1.0);
+	gl_ViewportIndex = int(instanceFace); // Tiles of the shadow atlas
+#elif defined(USE_INSTANCING) && defined(USE_DEPTH_CUBE)
+	gl_Position = instanceMatrix * pos;
+#elif defined(USE_INSTANCING)
+	// Same operations as core.vert, the depth pre-pass needs identical results
+	gl_Position = (projectionMatrix * (viewMatrix * instanceMatrix)) * pos;
+#elif defined(USE_DEPTH_CUBE)
 	gl_Position = modelMatrix * pos;
 #else
 	gl_Position = modelViewProjMatrix * pos;
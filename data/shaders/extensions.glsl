@@ -1,3 +1,4 @@
 #extension GL_ARB_shading_language_420pack : enable
 #extension GL_ARB_explicit_uniform_location : enable
+#extension GL_ARB_viewport_array : enable
 
@@ -0,0 +1,66 @@
+// Impostor atlases have the G-buffer layout, so deferred scenes get the baked surface as is.
+// Forward scenes only get sun and ambient light on it.
+
+in VertexData {
+	vec2 texcoord0;
+	vec2 texcoord1;
+	float blend;
+	vec3 right;
+	vec3 up;
+	vec3 forward;
+} inData;
+
+// Atlases use the G-buffer units
+layout(binding = BINDING_GBUFFER_ALBEDO) uniform sampler2D albedoAtlas;
+layout(binding = BINDING_GBUFFER_NORMAL) uniform sampler2D normalAtlas;
+layout(binding = BINDING_GBUFFER_SPECULAR) uniform sampler2D specularAtlas;
+layout(binding = BINDING_GBUFFER_UNLIT) uniform sampler2D unlitAtlas;
+layout(binding = BINDING_GBUFFER_DEPTH) uniform sampler2D depthAtlas;
+
+#ifdef USE_GBUFFER
+layout(location = 0) out vec4 gbufferAlbedo;
+layout(location = 1) out vec4 gbufferNormal;
+layout(location = 2) out vec4 gbufferSpecular;
+layout(location = 3) out vec4 gbufferUnlit;
+#else
+layout(location = 0) out vec4 fragment;
+layout(location = 1) out vec4 brightFragment;
+#endif
+
+// Blend of the two views, each weighted by whether it covers the pixel
+vec4 sampleViews(sampler2D atlas, float weight0, float weight1)
+{
+	return (texture(atlas, inData.texcoord0) * weight0 + texture(atlas, inData.texcoord1) * weight1)
+		/ max(weight0 + weight1, 1e-4);
+}
+
+void main()
+{
+	float weight0 = (1.0 - inData.blend) * step(texture(depthAtlas, inData.texcoord0).r, 0.999);
+	float weight1 = inData.blend * step(texture(depthAtlas, inData.texcoord1).r, 0.999);
+	if (weight0 + weight1 < 0.5)
+		discard;
+
+	vec4 albedo = sampleViews(albedoAtlas, weight0, weight1);
+	vec4 normalTex = sampleViews(normalAtlas, weight0, weight1);
+	vec4 specular = sampleViews(specularAtlas, weight0, weight1);
+	vec4 unlit = sampleViews(unlitAtlas, weight0, weight1);
+	// Baked in the view space of the bake camera, which faced the object like the billboard does
+	vec3 normal = normalize(inData.right * normalTex.x + inData.up * normalTex.y + inData.forward * normalTex.z);
+
+#ifdef USE_GBUFFER
+	gbufferAlbedo = albedo;
+	gbufferNormal = vec4(normal, normalTex.a);
+	gbufferSpecular = specular;
+	gbufferUnlit = unlit;
+#else
+	vec3 sunDir = normalize((viewMatrix * vec4(sunPosition, 0.0)).xyz);
+	vec3 color = unlit.rgb + albedo.rgb * sunColor * max(dot(normal, sunDir), 0.0) * albedo.a;
+	float depth = gl_FragCoord.z / gl_FragCoord.w;
+	float fogAmount = 1.0 - exp(-depth * fogDensity);
+	fragment = vec4(mix(color, fogColor, fogAmount), 1.0);
+	brightFragment = vec4(0.0, 0.0, 0.0, 1.0);
+	if (bloomThreshold > 0.0 && dot(fragment.rgb, vec3(0.2126, 0.7152, 0.0722)) > bloomThreshold)
+		brightFragment = vec4(fragment.rgb, 1.0);
+#endif
+}
@@ -0,0 +1,49 @@
+// Camera facing billboard per instance, textured with the two baked views around the object
+// closest to the view direction. See RenderDevice::bakeImpostor().
+
+layout(location = ATTR_INSTANCE_MATRIX) in mat4 instanceMatrix;
+
+layout(location = 0) uniform vec4 bounds; // Object space center and radius the views were framed on
+
+out VertexData {
+	vec2 texcoord0;
+	vec2 texcoord1;
+	float blend;
+	// View space axes of the billboard, turn baked normals into view space
+	vec3 right;
+	vec3 up;
+	vec3 forward;
+} outData;
+
+void main()
+{
+	vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+	mat3 rotation = mat3(instanceMatrix);
+	vec3 center = (instanceMatrix * vec4(bounds.xyz, 1.0)).xyz;
+	vec3 toCamera = normalize(cameraPosition - center);
+
+	// Views are spread around the object's y axis at a few elevations
+	vec3 objectDir = normalize(transpose(rotation) * toCamera);
+	float around = mod(atan(objectDir.z, objectDir.x) / (2.0 * PI) * IMPOSTOR_VIEWS_AROUND, IMPOSTOR_VIEWS_AROUND);
+	float view0 = floor(around);
+	float view1 = mod(view0 + 1.0, IMPOSTOR_VIEWS_AROUND);
+	float elevation = min(floor(asin(saturate(objectDir.y)) / (0.5 * PI) * IMPOSTOR_VIEW_ELEVATIONS + 0.5),
+		IMPOSTOR_VIEW_ELEVATIONS - 1);
+	vec2 tileUV = corner * 0.5 + 0.5;
+	vec2 tiles = vec2(IMPOSTOR_VIEWS_AROUND, IMPOSTOR_VIEW_ELEVATIONS);
+	outData.texcoord0 = (vec2(view0, elevation) + tileUV) / tiles;
+	outData.texcoord1 = (vec2(view1, elevation) + tileUV) / tiles;
+	outData.blend = around - view0;
+
+	// Same basis as the look-at of the bake cameras
+	vec3 right = cross(normalize(rotation[1]), toCamera);
+	right = dot(right, right) > 1e-6 ? normalize(right) : normalize(rotation[0]); // Straight above
+	vec3 up = cross(toCamera, right);
+	float radius = bounds.w * length(rotation[0]);
+	vec3 position = center + (right * corner.x + up * corner.y) * radius;
+	mat3 viewRotation = mat3(viewMatrix);
+	outData.right = viewRotation * right;
+	outData.up = viewRotation * up;
+	outData.forward = viewRotation * toCamera;
+	gl_Position = projectionMatrix * viewMatrix * vec4(position, 1.0);
+}
@@ -11,6 +11,10 @@ layout(location = 0) out vec4 fragment;
 
 #define gamma(x) pow((x), vec3(1.0 / 2.2));
 
+#ifndef TONEMAP
+#define TONEMAP 0
+#endif
+
 // http://filmicgames.com/archives/75
 vec3 Uncharted2Tonemap(vec3 x)
 {
@@ -97,63 +101,66 @@ vec3 fxaa(vec2 uv, vec2 step)
 	return ((lumaB < lumaMin) || (lumaB > lumaMax)) ? rgbA : rgbB;
 }
 
-
-
+// Effects are compiled in only when active, see RenderDevice::generatePostShader()
 void main()
 {
 	vec2 uv = inData.texcoord;
+	vec2 sceneUV = uv * sceneScale; // Scene may cover only part of its target
 	vec2 screenSize = textureSize(sceneMap, 0);
 	vec2 pixelSize = 1.0 / screenSize;
 	vec3 hdrColor;
-	// Chromatic Aberration
-	if (chromaticAberration > 0) {
-		float d = distance(uv, vec2(0.5, 0.5));
-		const vec3 chromaticOffsets = vec3(-0.1, 0.0, 0.1) * chromaticAberration * d;
-		hdrColor = vec3(
-			texture(sceneMap, vec2(uv.x + chromaticOffsets.r, uv.y)).r,
-			texture(sceneMap, vec2(uv.x + chromaticOffsets.g, uv.y)).g,
-			texture(sceneMap, vec2(uv.x + chromaticOffsets.b, uv.y)).b
-		);
-	}
-	else if (postAA == 1) hdrColor = fxaa(uv, pixelSize);
-	else hdrColor = texture(sceneMap, uv).rgb;
-
-	// Bloom
-	if (bloomThreshold > 0)
-		hdrColor += texture(bloomMap, uv).rgb; // Bloom
-
-	// Vignette
-	if (vignette.z > 0) {
-		float d = distance(uv, vec2(0.5, 0.5));
-		float vig = smoothstep(vignette.x, vignette.x - vignette.y, d);
-		hdrColor = mix(hdrColor, hdrColor * vig, vignette.z);
-	}
+#if defined(USE_CHROMATIC_ABERRATION)
+	float d = distance(uv, vec2(0.5, 0.5));
+	vec3 chromaticOffsets = vec3(-0.1, 0.0, 0.1) * chromaticAberration * d;
+	hdrColor = vec3(
+		texture(sceneMap, vec2(sceneUV.x + chromaticOffsets.r, sceneUV.y)).r,
+		texture(sceneMap, vec2(sceneUV.x + chromaticOffsets.g, sceneUV.y)).g,
+		texture(sceneMap, vec2(sceneUV.x + chromaticOffsets.b, sceneUV.y)).b
+	);
+#elif defined(USE_FXAA)
+	hdrColor = fxaa(sceneUV, pixelSize);
+#else
+	hdrColor = texture(sceneMap, sceneUV).rgb;
+#endif
+
+#ifdef USE_BLOOM
+	hdrColor += textureLod(bloomMap, uv, 0.0).rgb * bloomIntensity;
+#endif
+
+#ifdef USE_VIGNETTE
+	float dist = distance(uv, vec2(0.5, 0.5));
+	float vig = smoothstep(vignette.x, vignette.x - vignette.y, dist);
+	hdrColor = mix(hdrColor, hdrColor * vig, vignette.z);
+#endif
 
-	// Saturation
+#if defined(USE_SATURATION) || defined(USE_SCANLINES)
 	float luminance = dot(hdrColor, vec3(0.3086, 0.6094, 0.0820));
+#endif
+
+#ifdef USE_SATURATION
 	if (saturation > 0.0) {
 		hdrColor.rgb += (luminance - hdrColor.rgb) * (1.0 - 1.0 / (1.001 - saturation));
 	} else {
 		hdrColor.rgb += (luminance - hdrColor.rgb) * (-saturation);
 	}
+#endif
 
-	// Sepia
-	if (sepia > 0) {
-		vec3 sepiaColor = vec3(
-			dot(hdrColor, vec3(0.393, 0.769, 0.189)),
-			dot(hdrColor, vec3(0.349, 0.686, 0.168)),
-			dot(hdrColor, vec3(0.272, 0.534, 0.131)));
-		hdrColor = mix(hdrColor, sepiaColor, sepia);
-	}
+#ifdef USE_SEPIA
+	vec3 sepiaColor = vec3(
+		dot(hdrColor, vec3(0.393, 0.769, 0.189)),
+		dot(hdrColor, vec3(0.349, 0.686, 0.168)),
+		dot(hdrColor, vec3(0.272, 0.534, 0.131)));
+	hdrColor = mix(hdrColor, sepiaColor, sepia);
+#endif
 
-	// Scanlines
-	if (scanlines > 0)
-		if (mod(floor(uv.y * screenSize.y), scanlines + 1.0) < 1.0)
-			hdrColor *= luminance;
+#ifdef USE_SCANLINES
+	if (mod(floor(uv.y * screenSize.y), scanlines + 1.0) < 1.0)
+		hdrColor *= luminance;
+#endif
 
 	// Debug
 #if 0 // Visualize depth
-	hdrColor = vec3(linearizeDepth(texture(depthMap, uv).r));
+	hdrColor = vec3(linearizeDepth(texture(depthMap, sceneUV).r));
 #endif
 #if 0 // Visualize bloom
 	hdrColor = texture(bloomMap, uv).rgb;
@@ -162,28 +169,28 @@ void main()
 	// Tone mapping & gamma
 	hdrColor *= exposure;
 	vec3 result;
-	if (tonemap == 0) { // Reinhard
-		result = hdrColor / (hdrColor + vec3(1.0));
-		result = gamma(result);
-	} else if (tonemap == 1) { // Exposure
-		result = vec3(1.0) - exp(-hdrColor);
-		result = gamma(result);
-	} else if (tonemap == 2) { // Filmic
-		vec3 x = max(vec3(0.0), hdrColor - vec3(0.004));
-		result = (x * (6.2 * x + 0.5)) / (x * (6.2 * x + 1.7) + 0.06);
-		// No gamma needed
-	} else if (tonemap == 3) { // Uncharted 2
-		const float exposureBias = 2.0;
-		result = Uncharted2Tonemap(exposureBias * hdrColor);
-		vec3 whiteScale = 1.0 / Uncharted2Tonemap(vec3(11.2));
-		result *= whiteScale;
-		result = gamma(result);
-	} else if (tonemap == 4) { // ACES
-		result = ACESFilmicTonemap(hdrColor);
-		result = gamma(result);
-	} else {
-		result = vec3(1.0, 0.0, 1.0);
-	}
+#if TONEMAP == 0 // Reinhard
+	result = hdrColor / (hdrColor + vec3(1.0));
+	result = gamma(result);
+#elif TONEMAP == 1 // Exposure
+	result = vec3(1.0) - exp(-hdrColor);
+	result = gamma(result);
+#elif TONEMAP == 2 // Filmic
+	vec3 x = max(vec3(0.0), hdrColor - vec3(0.004));
+	result = (x * (6.2 * x + 0.5)) / (x * (6.2 * x + 1.7) + 0.06);
+	// No gamma needed
+#elif TONEMAP == 3 // Uncharted 2
+	const float exposureBias = 2.0;
+	result = Uncharted2Tonemap(exposureBias * hdrColor);
+	vec3 whiteScale = 1.0 / Uncharted2Tonemap(vec3(11.2));
+	result *= whiteScale;
+	result = gamma(result);
+#elif TONEMAP == 4 // ACES
+	result = ACESFilmicTonemap(hdrColor);
+	result = gamma(result);
+#else
+	result = vec3(1.0, 0.0, 1.0);
+#endif
 
 	fragment = vec4(result, 1.0);
 }
@@ -0,0 +1,41 @@
+// Temporal resolve: the jittered scene is upscaled to output resolution and blended with
+// the previous output reprojected through depth. History is clamped to the current 3x3
+// neighbourhood so disoccluded and moving areas don't ghost.
+
+in VertexData {
+	vec2 texcoord;
+} inData;
+
+layout(binding = 20) uniform sampler2D sceneMap;
+layout(binding = 21) uniform sampler2D historyMap;
+layout(binding = 22) uniform sampler2D depthMap;
+
+layout(location = 0) out vec4 fragment;
+
+void main()
+{
+	vec2 uv = inData.texcoord;
+	vec2 texel = 1.0 / vec2(textureSize(sceneMap, 0));
+	// Undo this frame's jitter and stay inside the rendered part of the target
+	vec2 sceneUV = min(uv * sceneScale + jitter, sceneScale - 0.5 * texel);
+	vec3 current = texture(sceneMap, sceneUV).rgb;
+
+	vec3 minColor = current, maxColor = current;
+	for (int y = -1; y <= 1; ++y) {
+		for (int x = -1; x <= 1; ++x) {
+			vec3 color = texture(sceneMap, sceneUV + vec2(x, y) * texel).rgb;
+			minColor = min(minColor, color);
+			maxColor = max(maxColor, color);
+		}
+	}
+
+	float depth = texture(depthMap, sceneUV).r;
+	vec4 prevClip = reprojectionMatrix * vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+	vec2 prevUV = prevClip.xy / prevClip.w * 0.5 + 0.5;
+	if (historyWeight <= 0.0 || any(lessThan(prevUV, vec2(0.0))) || any(greaterThan(prevUV, vec2(1.0)))) {
+		fragment = vec4(current, 1.0);
+		return;
+	}
+	vec3 history = clamp(texture(historyMap, prevUV).rgb, minColor, maxColor);
+	fragment = vec4(mix(current, history, historyWeight), 1.0);
+}
@@ -1,9 +1,14 @@
 
-#define MAX_LIGHTS 4
-#define MAX_SHADOW_MAPS 1
-#define MAX_SHADOW_CUBES 3
-#define MAX_SHADOWS (MAX_SHADOW_MAPS + MAX_SHADOW_CUBES)
+#define MAX_LIGHTS 4 // Without clustering (cube map rendering)
+#define MAX_CLUSTERED_LIGHTS 1024
+#define CLUSTER_TILES_X 16
+#define CLUSTER_TILES_Y 9
+#define CLUSTER_SLICES 24
+#define MAX_CASCADES 4 // Sun shadow map layers
+#define MAX_PROBES 8 // Baked reflection probes
 #define MAX_BONES 80
+#define IMPOSTOR_VIEWS_AROUND 8 // Baked impostor views around the y axis
+#define IMPOSTOR_VIEW_ELEVATIONS 3 // Rows of views from the horizon up, 90 / n degrees apart
 
 #ifdef __cplusplus
 #define UBO_PREFIX(name, bindpoint) struct name { static const uint binding = bindpoint;
@@ -21,15 +26,21 @@ UBO_PREFIX(UniformCommonBlock, 0)
 	vec3 sunPosition; int skyType;
 	vec3 sunColor; float bloomThreshold;
 	vec3 fogColor; float fogDensity;
-	float near; float far; float pad1;
+	float near; float far; int numCascades; int numProbes;
+	mat4 cascadeMatrices[MAX_CASCADES]; // World to sun shadow map texture space
+	vec4 cascadeSplits; // View space far distance of each cascade
+	vec4 clusterParams; // xy: tiles per pixel, z: slice scale, w: slice bias
+	vec4 dynamicProbe; // Objects centered within w of xyz reflect the dynamic cube instead of baked probes
+	vec4 detailParams; // x: quality scale for tessellation, parallax and shadow filtering, yz: viewport size in pixels
+	vec4 probePositions[MAX_PROBES];
 };
 
 UBO_PREFIX(UniformObjectBlock, 1)
 	mat4 modelMatrix;
 	mat4 modelViewMatrix;
 	mat4 modelViewProjMatrix;
-	mat4 shadowMatrix;
 	mat4 normalMatrix; // Problems with alignment if sent as mat3
+	float lodFade; float objectPad1; float objectPad2; float objectPad3; // LOD cross-fade, see core.frag
 };
 
 UBO_PREFIX(UniformMaterialBlock, 2)
@@ -45,14 +56,13 @@ struct UniformLightData {
 	vec3 position; float pad2;
 	vec3 direction; float pad3;
 	vec4 params;
-};
-
-UBO_PREFIX(UniformLightBlock, 3)
-	UniformLightData lights[MAX_LIGHTS];
+	vec4 shadowRect; // Atlas uv of the 3x2 face tiles: xy corner, z tile size, w tile texels. Zero if unshadowed
+	vec4 shadowOrigin; // xyz: light position the shadow was rendered from, w: its range
 };
 
 UBO_PREFIX(UniformCubeMatrixBlock, 4)
 	mat4 cubeMatrices[6];
+	int cubeFaceMask; float cubePad1; float cubePad2; float cubePad3; // Bit per face drawn in this pass
 };
 
 UBO_PREFIX(UniformSkinningBlock, 5)
@@ -62,7 +72,10 @@ UBO_PREFIX(UniformSkinningBlock, 5)
 UBO_PREFIX(UniformPostProcessBlock, 6)
 	int tonemap; float exposure; float saturation; int postAA;
 	vec3 vignette; float sepia;
-	float scanlines; float chromaticAberration; float padding1; float padding2;
+	float scanlines; float chromaticAberration; float bloomIntensity; float padding2;
+	mat4 reprojectionMatrix; // Unjittered clip space of this frame to the previous frame's
+	vec2 sceneScale; vec2 jitter; // Rendered part of the scene targets, this frame's offset in their uv
+	float historyWeight; float padding3; float padding4; float padding5; // Zero when there is no history
 };
 
 
@@ -78,7 +91,24 @@ UBO_PREFIX(UniformPostProcessBlock, 6)
 #define BINDING_REFLECTION_MAP 14
 #define BINDING_ENV_MAP 15
 #define BINDING_SHADOW_MAP 16
-#define BINDING_SHADOW_CUBE 17
+#define BINDING_SHADOW_ATLAS 17
+#define BINDING_HIZ_MAP 18
+#define BINDING_LIGHT_BUFFER 22 // Buffer textures, 6 texels per light
+#define BINDING_PROBE_ARRAY 20
+#define BINDING_CLUSTER_GRID 23 // Offset and count per cluster
+#define BINDING_CLUSTER_INDICES 24
+#define BINDING_GBUFFER_START 25 // Albedo, normal, specular, unlit, depth
+#define BINDING_GBUFFER_ALBEDO 25
+#define BINDING_GBUFFER_NORMAL 26
+#define BINDING_GBUFFER_SPECULAR 27
+#define BINDING_GBUFFER_UNLIT 28
+#define BINDING_GBUFFER_DEPTH 29
+#define BINDING_BLOOM_MAP 30
+
+// Shader storage buffers for GPU culling
+#define BINDING_CULL_INSTANCES 0
+#define BINDING_CULL_COMMANDS 1
+#define BINDING_CULL_MATRICES 2
 
 
 #ifndef __cplusplus
@@ -94,9 +124,11 @@ UBO_PREFIX(UniformPostProcessBlock, 6)
 #define ATTR_COLOR 4
 #define ATTR_BONE_INDEX 5
 #define ATTR_BONE_WEIGHT 6
+#define ATTR_INSTANCE_MATRIX 7 // Uses 4 locations
+#define ATTR_INSTANCE_FACE 11
 
 #ifdef USE_SHADOW_MAP
-#define SHADOW_VARYINGS vec4 shadowcoord; vec3 worldPosition;
+#define SHADOW_VARYINGS vec3 worldPosition;
 #else
 #define SHADOW_VARYINGS
 #endif
@@ -113,6 +145,12 @@ UBO_PREFIX(UniformPostProcessBlock, 6)
 #define VERTEX_COLOR_VARYINGS
 #endif
 
+#ifdef USE_ENV_MAP
+#define PROBE_VARYINGS flat vec3 objectCenter;
+#else
+#define PROBE_VARYINGS
+#endif
+
 #define VERTEX_DATA(inout, name) \
 	inout VertexData { \
 		vec3 position; \
@@ -121,6 +159,7 @@ UBO_PREFIX(UniformPostProcessBlock, 6)
 		TANGENT_VARYINGS \
 		VERTEX_COLOR_VARYINGS \
 		SHADOW_VARYINGS \
+		PROBE_VARYINGS \
 	} name;
 
 #ifdef USE_ANIMATION
@@ -150,10 +189,23 @@ layout(binding = BINDING_REFLECTION_MAP) uniform sampler2D reflectionMap;
 #endif
 #ifdef USE_ENV_MAP
 layout(binding = BINDING_ENV_MAP) uniform samplerCube envMap;
+layout(binding = BINDING_PROBE_ARRAY) uniform samplerCubeArray probeArray;
+#endif
+#if defined(USE_DIFFUSE) || defined(USE_SPECULAR)
+layout(binding = BINDING_LIGHT_BUFFER) uniform samplerBuffer lightBuffer;
+layout(binding = BINDING_CLUSTER_GRID) uniform usamplerBuffer clusterGrid;
+layout(binding = BINDING_CLUSTER_INDICES) uniform usamplerBuffer clusterIndices;
+#endif
+#ifdef USE_DEFERRED_LIGHTING
+layout(binding = BINDING_GBUFFER_ALBEDO) uniform sampler2D gbufferAlbedoMap;
+layout(binding = BINDING_GBUFFER_NORMAL) uniform sampler2D gbufferNormalMap;
+layout(binding = BINDING_GBUFFER_SPECULAR) uniform sampler2D gbufferSpecularMap;
+layout(binding = BINDING_GBUFFER_UNLIT) uniform sampler2D gbufferUnlitMap;
+layout(binding = BINDING_GBUFFER_DEPTH) uniform sampler2D gbufferDepthMap;
 #endif
 #ifdef USE_SHADOW_MAP
-layout(binding = BINDING_SHADOW_MAP) uniform sampler2D shadowMap;
-layout(binding = BINDING_SHADOW_CUBE) uniform samplerCube shadowCube[MAX_SHADOW_CUBES];
+layout(binding = BINDING_SHADOW_MAP) uniform sampler2DArray shadowMap;
+layout(binding = BINDING_SHADOW_ATLAS) uniform sampler2D shadowAtlas;
 #endif
 
 #endif // __cplusplus
@@ -70,6 +70,12 @@ struct id
 	static uint hash(const std::string& str) {
 		return hash(str.c_str());
 	}
+	static uint64 hash64(const void* data, uint size, uint64 h = 14695981039346656037ull) {
+		const uint8* bytes = (const uint8*)data;
+		for (uint i = 0; i < size; ++i)
+			h = (h ^ bytes[i]) * 1099511628211ull;
+		return h;
+	}
 };
 #define $id(...) id::fnv1a(#__VA_ARGS__)
 
@@ -44,28 +44,36 @@ struct Geometry;
 struct Model
 {
 	struct Lod {
-		float distSq = FLT_MAX;
+		float distance = 0.f; // Furthest distance at the reference view, 0 picks by screen size alone
 		Geometry* geometry = nullptr;
 	};
-	static const int MAX_LODS = 3;
+	static const int MAX_LODS = 6;
 	Lod lods[MAX_LODS] = {};
 
-	Geometry* getLod(float distance) {
-		return getLod2(distance * distance);
-	}
-
-	Geometry* getLod2(float distanceSq) {
-		for (int i = 0; i < MAX_LODS; ++i)
-			if (distanceSq < lods[i].distSq)
-				return lods[i].geometry;
-		return nullptr;
+	int numLods() const {
+		int count = 0;
+		while (count < MAX_LODS && lods[count].geometry)
+			++count;
+		return count;
 	}
 
 	Bounds bounds;
 	Geometry* geometry = nullptr; // Current LOD
+	int lod = 0; // Selected by the renderer, numLods() when too small to draw
+	int prevLod = -1; // LOD being faded out, -1 if none
+	float lodFade = 0.f; // Cross-fade progress from prevLod to lod
+	Geometry* occluder = nullptr; // Optional geometry for occlusion culling
+	uint staticFrames = 0; // Frames without transform changes, maintained by the renderer
 	std::vector<Material> materials;
 };
 
+// Static reflection capture point, baked by the renderer when it first sees it
+struct ReflectionProbe
+{
+	vec3 position = vec3();
+	int index = -1; // Layer in the baked probe array, -1 until baked
+};
+
 struct GroundTracker
 {
 	bool onGround = false;
@@ -110,6 +118,7 @@ struct Light
 	float distance = 1.0f;
 	float decay = 1.0f;
 	float priority = 0.f;
+	uint id = 0; // Entity id, set by the renderer to track the light between frames
 };
 
 
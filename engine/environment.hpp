@@ -9,7 +9,7 @@ struct Environment
 	float shadowDarkness = 0.01f;
 	float exposure = 1.f;
 	float bloomThreshold = 0.4f;
-	float bloomIntensity = 5.f;
+	float bloomIntensity = 1.f; // Blend weight
 	enum Tonemap {
 		TONEMAP_REINHARD,
 		TONEMAP_EXPOSURE,
@@ -31,6 +31,9 @@ struct Environment
 	vec3 fogColor = vec3(0.5, 0.5, 0.5);
 	float fogDensity = 0.f;
 
+	bool depthPrepass = false; // Lay down depth first so expensive fragments are shaded once
+	bool deferred = false; // Light opaque materials from a G-buffer instead of the forward shaders
+
 	// TODO: Probably put to some other "PostEffects" class?
 	vec3 vignette = vec3(0.5, 0.5, 0.0); // Radius, smoothness, strength
 	float saturation = 0.f;
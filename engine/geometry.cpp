@@ -1,6 +1,8 @@
 #include "geometry.hpp"
 #include "image.hpp"
 #include "physics.hpp"
+#include "meshsimplify.hpp"
+#include "meshoptimize.hpp"
 #include "iqm/iqm.h"
 #include "glrenderer/glutil.hpp"
 #include <glm/gtc/matrix_inverse.hpp>
@@ -109,6 +111,26 @@ Geometry::Geometry(const Image& heightmap)
 	batch.setupAttributes();
 }
 
+Geometry::Geometry(const Geometry& source, float ratio)
+{
+	START_MEASURE(simplifyTimeMs);
+	uint before = 0, after = 0;
+	for (auto& src : source.batches) {
+		if (src.positions.empty()) {
+			batches.push_back(src);
+			batches.back().renderId = -1;
+			continue;
+		}
+		batches.emplace_back();
+		before += (src.indices.empty() ? src.positions.size() : src.indices.size()) / 3;
+		after += simplifyBatch(src, batches.back(), ratio);
+	}
+	// Same bounds so the LODs of a model agree on its size
+	bounds = source.bounds;
+	END_MEASURE(simplifyTimeMs)
+	logDebug("Simplified mesh to %.2f in %.1fms, %d -> %d triangles", ratio, simplifyTimeMs, before, after);
+}
+
 Geometry::~Geometry()
 {
 	if (collisionMesh)
@@ -525,6 +547,26 @@ void Geometry::generateCollisionTriMesh(bool deduplicateVertices)
 	}
 }
 
+void Geometry::optimize()
+{
+	START_MEASURE(optimizeTimeMs);
+	uint missesBefore = 0, missesAfter = 0, trianglesBefore = 0;
+	numTriangles = 0;
+	for (auto& batch : batches) {
+		if (batch.positions.empty())
+			continue;
+		trianglesBefore += (batch.indices.empty() ? batch.numVertices : batch.indices.size()) / 3;
+		missesBefore += vertexCacheMisses(batch);
+		optimizeBatch(batch);
+		numTriangles += batch.indices.size() / 3;
+		missesAfter += vertexCacheMisses(batch);
+	}
+	acmrBefore = trianglesBefore ? (float)missesBefore / trianglesBefore : 0.f;
+	acmrAfter = numTriangles ? (float)missesAfter / numTriangles : 0.f;
+	END_MEASURE(optimizeTimeMs)
+	logDebug("Optimized mesh in %.1fms, %d triangles, ACMR %.2f -> %.2f", optimizeTimeMs, numTriangles, acmrBefore, acmrAfter);
+}
+
 void Geometry::merge(const Geometry& geometry, vec3 offset, int materialIndexOffset)
 {
 	for (auto& b : geometry.batches) {
@@ -13,7 +13,9 @@ enum GeometryAttributeIndex {
 	ATTR_COLOR,
 	ATTR_BONE_INDEX,
 	ATTR_BONE_WEIGHT,
-	ATTR_MAX
+	ATTR_MAX,
+	ATTR_INSTANCE_MATRIX = ATTR_MAX, // Per instance mat4, not part of Batch
+	ATTR_INSTANCE_FACE = ATTR_INSTANCE_MATRIX + 4 // Per instance cube face for layered draws
 };
 
 struct Batch
@@ -53,6 +55,8 @@ struct Geometry
 	Geometry() {}
 	Geometry(const string& path);
 	Geometry(const Image& heightmap);
+	// Simplified copy with about ratio of the triangles, for LODs. Bones and animations stay in the source.
+	Geometry(const Geometry& source, float ratio);
 	~Geometry();
 
 	void calculateBoundingSphere();
@@ -63,6 +67,8 @@ struct Geometry
 	void applyMatrix(mat4 transform);
 	void generateCollisionTriMesh(bool deduplicateVertices = true);
 	void merge(const Geometry& geometry, vec3 offset, int materialIndexOffset = 0);
+	// Welds and reorders the batches for the vertex cache, overdraw and vertex fetch, see meshoptimize.hpp
+	void optimize();
 
 	std::vector<Batch> batches;
 
@@ -79,6 +85,9 @@ struct Geometry
 	std::vector<Animation> animations;
 
 	Bounds bounds;
+	uint numTriangles = 0; // Set by optimize()
+	float acmrBefore = 0.f; // Vertex cache misses per triangle before and after optimize()
+	float acmrAfter = 0.f;
 
 	class btTriangleMesh* collisionMesh = nullptr;
 
@@ -10,43 +10,56 @@ FBO::~FBO()
 
 void FBO::create()
 {
-	ASSERT(width && height);
+	ASSERT(external || (width && height));
 	ASSERT(!cube || samples <= 1);
+	ASSERT(!layers || (!cube && samples <= 1));
 	uint texType = GL_TEXTURE_2D;
 	if (cube) texType = GL_TEXTURE_CUBE_MAP;
+	else if (layers) texType = GL_TEXTURE_2D_ARRAY;
 	else if (samples > 1) texType = GL_TEXTURE_2D_MULTISAMPLE;
 	glGenFramebuffers(1, &fbo);
 	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-	glGenTextures(numTextures, tex);
-	for (uint i = 0; i < numTextures; ++i) {
-		glBindTexture(texType, tex[i]);
-		bool depth = i == depthAttachment;
-		uint internalFormat = depth ? GL_DEPTH_COMPONENT : GL_RGB16F;
-		if (samples > 1)
-			glTexImage2DMultisample(texType, samples, internalFormat, width, height, GL_TRUE);
-		else {
-			if (cube) {
-				for (uint j = 0; j < 6; ++j)
-					glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + j, 0, internalFormat, width, height, 0,
-						depth ? GL_DEPTH_COMPONENT : GL_RGB, GL_FLOAT, NULL);
-			} else {
-				glTexImage2D(texType, 0, internalFormat, width, height, 0, depth ? GL_DEPTH_COMPONENT : GL_RGB, GL_FLOAT, NULL);
+	if (!external) {
+		glGenTextures(numTextures, tex);
+		for (uint i = 0; i < numTextures; ++i) {
+			glBindTexture(texType, tex[i]);
+			bool depth = i == depthAttachment;
+			// Sized depth, so blits from the frame graph's depth textures match formats
+			uint internalFormat = depth ? GL_DEPTH_COMPONENT32F : (alpha ? GL_RGBA16F : GL_RGB16F);
+			uint format = depth ? GL_DEPTH_COMPONENT : (alpha ? GL_RGBA : GL_RGB);
+			if (samples > 1)
+				glTexImage2DMultisample(texType, samples, internalFormat, width, height, GL_TRUE);
+			else {
+				if (cube) {
+					for (uint j = 0; j < 6; ++j)
+						glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + j, 0, internalFormat, width, height, 0,
+							format, GL_FLOAT, NULL);
+				} else if (layers) {
+					glTexImage3D(texType, 0, internalFormat, width, height, layers, 0,
+						format, GL_FLOAT, NULL);
+				} else {
+					glTexImage2D(texType, 0, internalFormat, width, height, 0, format, GL_FLOAT, NULL);
+				}
+				glTexParameteri(texType, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+				glTexParameteri(texType, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+				glTexParameteri(texType, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+				glTexParameteri(texType, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+				if (cube)
+					glTexParameteri(texType, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
 			}
-			glTexParameteri(texType, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-			glTexParameteri(texType, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glTexParameteri(texType, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-			glTexParameteri(texType, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-			if (cube)
-				glTexParameteri(texType, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+			uint attach = depth ? GL_DEPTH_ATTACHMENT : (GL_COLOR_ATTACHMENT0 + i);
+			if (layers) glFramebufferTextureLayer(GL_FRAMEBUFFER, attach, tex[i], 0, 0);
+			else glFramebufferTexture(GL_FRAMEBUFFER, attach, tex[i], 0);
 		}
-		uint attach = depth ? GL_DEPTH_ATTACHMENT : (GL_COLOR_ATTACHMENT0 + i);
-		glFramebufferTexture(GL_FRAMEBUFFER, attach, tex[i], 0);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			logError("Framebuffer not complete!");
 	}
-	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-		logError("Framebuffer not complete!");
-	if (numTextures >= 3) {
-		GLuint attachments[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
-		glDrawBuffers(2, attachments);
+	uint numColors = depthAttachment < numTextures ? numTextures - 1 : numTextures;
+	if (numColors >= 2) {
+		GLuint attachments[MAX_TEXTURES];
+		for (uint i = 0; i < numColors; ++i)
+			attachments[i] = GL_COLOR_ATTACHMENT0 + i;
+		glDrawBuffers(numColors, attachments);
 	} else if (numTextures == 1 && depthAttachment == 0) {
 		glDrawBuffer(GL_NONE);
 		glReadBuffer(GL_NONE);
@@ -59,9 +72,59 @@ void FBO::bind()
 	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
 }
 
+void FBO::bindLayer(uint layer)
+{
+	ASSERT(layer < layers);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	for (uint i = 0; i < numTextures; ++i) {
+		uint attach = i == depthAttachment ? GL_DEPTH_ATTACHMENT : (GL_COLOR_ATTACHMENT0 + i);
+		glFramebufferTextureLayer(GL_FRAMEBUFFER, attach, tex[i], 0, layer);
+	}
+}
+
+void FBO::attach(uint index, uint texture)
+{
+	ASSERT(external && index < numTextures);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	uint attach = index == depthAttachment ? GL_DEPTH_ATTACHMENT : (GL_COLOR_ATTACHMENT0 + index);
+	glFramebufferTexture(GL_FRAMEBUFFER, attach, texture, 0);
+	tex[index] = texture;
+}
+
+void FBO::clearFaces(uint faceMask)
+{
+	ASSERT(cube);
+	for (uint face = 0; face < 6; ++face) {
+		if (!(faceMask & (1 << face)))
+			continue;
+		for (uint i = 0; i < numTextures; ++i) {
+			uint attach = i == depthAttachment ? GL_DEPTH_ATTACHMENT : (GL_COLOR_ATTACHMENT0 + i);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, attach, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, tex[i], 0);
+		}
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	}
+	for (uint i = 0; i < numTextures; ++i) {
+		uint attach = i == depthAttachment ? GL_DEPTH_ATTACHMENT : (GL_COLOR_ATTACHMENT0 + i);
+		glFramebufferTexture(GL_FRAMEBUFFER, attach, tex[i], 0);
+	}
+}
+
+uint FBO::bytes() const
+{
+	if (!valid() || external)
+		return 0;
+	uint texels = width * height * glm::max(samples, 1u) * (cube ? 6 : glm::max(layers, 1u));
+	uint colorSize = alpha ? 8 : 6;
+	uint bytes = 0;
+	for (uint i = 0; i < numTextures; ++i)
+		bytes += texels * (i == depthAttachment ? 4 : colorSize);
+	return bytes;
+}
+
 void FBO::destroy()
 {
-	glDeleteTextures(numTextures, tex);
+	if (!external)
+		glDeleteTextures(numTextures, tex);
 	glDeleteFramebuffers(1, &fbo);
 	fbo = 0;
 	for (uint i = 0; i < MAX_TEXTURES; ++i)
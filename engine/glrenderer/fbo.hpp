@@ -10,17 +10,24 @@ struct FBO
 
 	void create();
 	void bind();
+	void bindLayer(uint layer); // For layered (array) targets
+	void clearFaces(uint faceMask); // Clears some faces of a bound cube target
+	void attach(uint index, uint texture); // For external textures
 	void destroy();
 	bool valid() const { return fbo > 0; }
+	uint bytes() const; // Estimated GPU memory of the textures
 
-	static const uint MAX_TEXTURES = 3;
+	static const uint MAX_TEXTURES = 5;
 
 	uint fbo = 0;
-	uint tex[MAX_TEXTURES] = {0, 0, 0};
+	uint tex[MAX_TEXTURES] = {0, 0, 0, 0, 0};
 	uint numTextures = 1;
 	uint width = 0;
 	uint height = 0;
 	uint samples = 0;
 	uint depthAttachment = -1;
+	uint layers = 0; // Creates a texture array if non-zero
 	bool cube = false;
+	bool alpha = false; // RGBA color textures instead of RGB
+	bool external = false; // Framebuffer only, textures are owned elsewhere and set with attach()
 };
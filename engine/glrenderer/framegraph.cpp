@@ -0,0 +1,217 @@
+#include "framegraph.hpp"
+#include "glutil.hpp"
+
+FrameGraph::~FrameGraph()
+{
+	destroy();
+}
+
+void FrameGraph::reset()
+{
+	m_resources.clear();
+	m_passes.clear();
+	// Free what the last frames didn't use before this frame takes pool indices, held ones stay
+	for (uint i = 0; i < m_pool.size(); ) {
+		if (!m_pool[i].busy && m_frame - m_pool[i].lastUsed > POOL_LIFETIME) {
+			glDeleteTextures(1, &m_pool[i].texture);
+			m_pool[i] = m_pool.back();
+			m_pool.pop_back();
+		} else ++i;
+	}
+}
+
+int FrameGraph::createTexture(const char* name, const FrameGraph::TextureDesc& desc)
+{
+	ASSERT(desc.width && desc.height && desc.levels && desc.format);
+	m_resources.push_back({ name, desc, 0, 0, -1, -1, -1, TRANSIENT, false, false });
+	return m_resources.size() - 1;
+}
+
+int FrameGraph::acquireTexture(const char* name, const FrameGraph::TextureDesc& desc)
+{
+	int resource = createTexture(name, desc);
+	Resource& res = m_resources[resource];
+	res.origin = ACQUIRED;
+	res.physical = acquire(desc);
+	res.texture = m_pool[res.physical].texture;
+	return resource;
+}
+
+void FrameGraph::releaseTexture(int resource)
+{
+	ASSERT(m_resources[resource].origin == ACQUIRED);
+	m_pool[m_resources[resource].physical].busy = false;
+}
+
+void FrameGraph::retain(int resource)
+{
+	ASSERT(m_resources[resource].origin == TRANSIENT);
+	m_resources[resource].retained = true;
+	m_resources[resource].needed = true;
+}
+
+int FrameGraph::reclaim(const char* name, uint texture)
+{
+	for (uint i = 0; i < m_pool.size(); ++i) {
+		PoolTexture& tex = m_pool[i];
+		if (tex.texture == texture && tex.busy) {
+			tex.lastUsed = m_frame;
+			m_resources.push_back({ name, tex.desc, texture, 0, (int)i, -1, -1, RECLAIMED, false, false });
+			return m_resources.size() - 1;
+		}
+	}
+	ASSERT(!"Reclaimed texture isn't retained");
+	return -1;
+}
+
+int FrameGraph::importTexture(const char* name, uint texture, uint bytes)
+{
+	m_resources.push_back({ name, TextureDesc(), texture, bytes, -1, -1, -1, IMPORTED, false, false });
+	return m_resources.size() - 1;
+}
+
+int FrameGraph::addPass(const char* name, std::function<void()> run)
+{
+	m_passes.push_back({ name, run, {}, {}, false });
+	return m_passes.size() - 1;
+}
+
+void FrameGraph::read(int pass, int resource)
+{
+	ASSERT(resource >= 0 && resource < (int)m_resources.size());
+	m_passes[pass].reads.push_back(resource);
+}
+
+void FrameGraph::write(int pass, int resource)
+{
+	ASSERT(resource >= 0 && resource < (int)m_resources.size());
+	m_passes[pass].writes.push_back(resource);
+}
+
+void FrameGraph::output(int resource)
+{
+	m_resources[resource].needed = true;
+}
+
+void FrameGraph::execute()
+{
+	// Readers come after writers, so one backwards sweep from the outputs finds the live passes
+	m_numCulled = 0;
+	for (int p = (int)m_passes.size() - 1; p >= 0; --p) {
+		Pass& pass = m_passes[p];
+		pass.alive = false;
+		for (int r : pass.writes)
+			pass.alive |= m_resources[r].needed;
+		if (!pass.alive) {
+			++m_numCulled;
+			continue;
+		}
+		for (int r : pass.reads)
+			m_resources[r].needed = true;
+	}
+
+	for (int p = 0; p < (int)m_passes.size(); ++p) {
+		if (!m_passes[p].alive)
+			continue;
+		for (auto list : { &m_passes[p].reads, &m_passes[p].writes }) {
+			for (int r : *list) {
+				Resource& res = m_resources[r];
+				if (res.first < 0)
+					res.first = p;
+				res.last = p;
+			}
+		}
+	}
+
+	for (int p = 0; p < (int)m_passes.size(); ++p) {
+		Pass& pass = m_passes[p];
+		if (!pass.alive)
+			continue;
+		for (auto list : { &pass.reads, &pass.writes }) {
+			for (int r : *list) {
+				Resource& res = m_resources[r];
+				if (res.origin == TRANSIENT && res.first == p && res.physical < 0) {
+					res.physical = acquire(res.desc);
+					res.texture = m_pool[res.physical].texture;
+				}
+			}
+		}
+		pass.run();
+		for (auto list : { &pass.reads, &pass.writes }) {
+			for (int r : *list) {
+				const Resource& res = m_resources[r];
+				if ((res.origin == TRANSIENT || res.origin == RECLAIMED) && !res.retained && res.last == p)
+					m_pool[res.physical].busy = false;
+			}
+		}
+	}
+
+	m_info.clear();
+	for (const Resource& res : m_resources) {
+		if (res.origin == RECLAIMED && res.first < 0)
+			m_pool[res.physical].busy = false;
+		bool imported = res.origin == IMPORTED;
+		bool used = res.first >= 0 || res.origin == ACQUIRED;
+		m_info.push_back({ res.name, imported ? res.bytes : textureBytes(res.desc), res.physical, !imported, used });
+	}
+	++m_frame;
+}
+
+int FrameGraph::acquire(const FrameGraph::TextureDesc& desc)
+{
+	for (uint i = 0; i < m_pool.size(); ++i) {
+		PoolTexture& tex = m_pool[i];
+		if (!tex.busy && tex.desc == desc) {
+			tex.busy = true;
+			tex.lastUsed = m_frame;
+			return i;
+		}
+	}
+	PoolTexture tex;
+	tex.desc = desc;
+	tex.lastUsed = m_frame;
+	tex.busy = true;
+	glGenTextures(1, &tex.texture);
+	glBindTexture(GL_TEXTURE_2D, tex.texture);
+	glTexStorage2D(GL_TEXTURE_2D, desc.levels, desc.format, desc.width, desc.height);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, desc.levels > 1 ? GL_LINEAR_MIPMAP_NEAREST : GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	m_pool.push_back(tex);
+	return m_pool.size() - 1;
+}
+
+void FrameGraph::destroy()
+{
+	for (PoolTexture& tex : m_pool)
+		glDeleteTextures(1, &tex.texture);
+	m_pool.clear();
+	reset();
+	m_info.clear();
+}
+
+uint FrameGraph::poolBytes() const
+{
+	uint bytes = 0;
+	for (const PoolTexture& tex : m_pool)
+		bytes += textureBytes(tex.desc);
+	return bytes;
+}
+
+uint FrameGraph::textureBytes(const FrameGraph::TextureDesc& desc)
+{
+	uint texelSize = 4;
+	switch (desc.format) {
+		case GL_RGBA32F: texelSize = 16; break;
+		case GL_RGBA16F: texelSize = 8; break;
+		case GL_RGB16F: texelSize = 6; break;
+		case GL_RG16F: texelSize = 4; break;
+		case GL_R16F: texelSize = 2; break;
+		case GL_R8: texelSize = 1; break;
+	}
+	uint bytes = 0;
+	for (uint level = 0; level < desc.levels; ++level)
+		bytes += glm::max(desc.width >> level, 1u) * glm::max(desc.height >> level, 1u) * texelSize;
+	return bytes;
+}
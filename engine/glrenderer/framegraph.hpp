@@ -0,0 +1,108 @@
+#pragma once
+#include "common.hpp"
+#include <functional>
+
+// Passes of a frame with the textures they read and write, declared up front and run in
+// declaration order by execute(). Passes that don't lead to an output are culled. Transient
+// textures only exist from their first to their last use and are taken from a pool, so
+// transients with disjoint lifetimes and the same description share one texture. Pool
+// textures that go unused for a few frames (e.g. after a resize) are freed. Targets of the
+// scene pass and ones kept for the next frame can come from the same pool, so e.g. the
+// G-buffer reuses the TAA history the previous frame let go of.
+class FrameGraph
+{
+public:
+	FrameGraph() {}
+	~FrameGraph();
+
+	NONCOPYABLE(FrameGraph);
+
+	struct TextureDesc
+	{
+		uint width = 0;
+		uint height = 0;
+		uint levels = 1;
+		uint format = 0; // Sized internal format
+		bool operator==(const TextureDesc& other) const {
+			return width == other.width && height == other.height && levels == other.levels && format == other.format;
+		}
+	};
+	struct ResourceInfo
+	{
+		const char* name;
+		uint bytes;
+		int physical; // Pool texture, -1 if imported or culled
+		bool transient;
+		bool used; // Accessed by a pass that wasn't culled
+	};
+
+	// Starts declaring a new frame, names must outlive it
+	void reset();
+	int createTexture(const char* name, const TextureDesc& desc);
+	// Pool texture for a target used before execute(), e.g. the G-buffer. Held until released,
+	// transients that come later reuse it.
+	int acquireTexture(const char* name, const TextureDesc& desc);
+	void releaseTexture(int resource);
+	// Keeps a transient's texture past the frame, e.g. TAA history; implies output()
+	void retain(int resource);
+	// Texture retained last frame, back to the pool after its last use (or now if unused)
+	int reclaim(const char* name, uint texture);
+	// Texture owned elsewhere, bytes is only used for the memory report
+	int importTexture(const char* name, uint texture, uint bytes);
+	int addPass(const char* name, std::function<void()> run);
+	void read(int pass, int resource);
+	void write(int pass, int resource);
+	// Must be produced this frame, e.g. the back buffer or data kept for the next frame
+	void output(int resource);
+	void execute();
+	// Transient textures are only valid while the passes using them run
+	uint texture(int resource) const { return m_resources[resource].texture; }
+	bool culled(int pass) const { return !m_passes[pass].alive; }
+	void destroy();
+
+	// Of the last executed frame
+	const std::vector<ResourceInfo>& resources() const { return m_info; }
+	uint numCulled() const { return m_numCulled; }
+	uint poolBytes() const;
+	static uint textureBytes(const TextureDesc& desc);
+
+private:
+	enum Origin { TRANSIENT, IMPORTED, ACQUIRED, RECLAIMED };
+	struct Resource
+	{
+		const char* name;
+		TextureDesc desc;
+		uint texture;
+		uint bytes; // Imported ones only
+		int physical;
+		int first;
+		int last;
+		Origin origin;
+		bool retained;
+		bool needed;
+	};
+	struct Pass
+	{
+		const char* name;
+		std::function<void()> run;
+		std::vector<int> reads;
+		std::vector<int> writes;
+		bool alive;
+	};
+	struct PoolTexture
+	{
+		TextureDesc desc;
+		uint texture;
+		uint lastUsed; // Frame
+		bool busy;
+	};
+	static const uint POOL_LIFETIME = 8; // Frames before an idle pool texture is freed
+	int acquire(const TextureDesc& desc);
+
+	std::vector<Resource> m_resources;
+	std::vector<Pass> m_passes;
+	std::vector<PoolTexture> m_pool;
+	std::vector<ResourceInfo> m_info;
+	uint m_numCulled = 0;
+	uint m_frame = 0;
+};
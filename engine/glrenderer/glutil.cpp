@@ -1,4 +1,5 @@
 #include "glutil.hpp"
+#include <cstring>
 
 
 const char* glutil::getErrorString(uint error)
@@ -36,3 +37,20 @@ uint glutil::getTypeSize(GLenum type)
 	ASSERT(!"Unknown gl type queried for size");
 	return 0;
 }
+
+bool glutil::hasExtension(const char* name, int coreVersion)
+{
+	GLint major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	if (coreVersion && major * 10 + minor >= coreVersion)
+		return true;
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (GLint i = 0; i < count; ++i) {
+		const char* ext = (const char*)glGetStringi(GL_EXTENSIONS, i);
+		if (ext && !strcmp(ext, name))
+			return true;
+	}
+	return false;
+}
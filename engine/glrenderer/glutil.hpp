@@ -14,4 +14,7 @@ uint getTypeSize(GLenum type);
 
 const char* getErrorString(uint error);
 
+// Checks the extension list, or the core version (e.g. 44) that includes it
+bool hasExtension(const char* name, int coreVersion = 0);
+
 }
@@ -0,0 +1,186 @@
+#include "meshbuffer.hpp"
+#include "glutil.hpp"
+#include "geometry.hpp"
+
+static const uint s_initialVertices = 64 * 1024;
+static const uint s_initialIndices = 256 * 1024;
+
+bool RangeAllocator::allocate(uint size, uint& offset)
+{
+	for (uint i = 0; i < freeRanges.size(); ++i) {
+		Range& range = freeRanges[i];
+		if (range.size < size)
+			continue;
+		offset = range.offset;
+		range.offset += size;
+		range.size -= size;
+		if (!range.size)
+			freeRanges.erase(freeRanges.begin() + i);
+		used += size;
+		return true;
+	}
+	return false;
+}
+
+void RangeAllocator::free(uint offset, uint size)
+{
+	if (!size)
+		return;
+	ASSERT(used >= size);
+	used -= size;
+	auto it = freeRanges.begin();
+	while (it != freeRanges.end() && it->offset < offset)
+		++it;
+	it = freeRanges.insert(it, Range{ offset, size });
+	// Merge with the next and previous ranges
+	auto next = it + 1;
+	if (next != freeRanges.end() && it->offset + it->size == next->offset) {
+		it->size += next->size;
+		it = freeRanges.erase(next) - 1;
+	}
+	if (it != freeRanges.begin()) {
+		auto prev = it - 1;
+		if (prev->offset + prev->size == it->offset) {
+			prev->size += it->size;
+			freeRanges.erase(it);
+		}
+	}
+}
+
+void RangeAllocator::grow(uint newCapacity)
+{
+	ASSERT(newCapacity > capacity);
+	uint oldCapacity = capacity;
+	capacity = newCapacity;
+	// Push the new space as a free range and let free() merge it with the tail
+	used += newCapacity - oldCapacity;
+	free(oldCapacity, newCapacity - oldCapacity);
+}
+
+uint64 MeshBuffer::formatKey(const Batch& batch)
+{
+	uint64 key = 14695981039346656037ull;
+	auto mix = [&key](int value) { key = (key ^ (uint)value) * 1099511628211ull; };
+	mix(batch.vertexSize);
+	for (int i = 0; i < ATTR_MAX; ++i) {
+		const Batch::Attribute& attr = batch.attributes[i];
+		mix(attr.components);
+		mix(attr.type);
+		mix(attr.offset);
+		mix(attr.normalized);
+	}
+	return key;
+}
+
+void MeshBuffer::create(const Batch& format, uint instanceBuffer, uint faceBuffer)
+{
+	vertexSize = format.vertexSize;
+	glGenVertexArrays(1, &vao);
+	glGenBuffers(1, &vbo);
+	glGenBuffers(1, &ebo);
+	glBindVertexArray(vao);
+	for (int i = 0; i < ATTR_MAX; ++i) {
+		const Batch::Attribute& attr = format.attributes[i];
+		if (!attr.components)
+			continue;
+		glEnableVertexAttribArray(i);
+		glVertexAttribFormat(i, attr.components, attr.type, attr.normalized ? GL_TRUE : GL_FALSE, attr.offset);
+		glVertexAttribBinding(i, 0);
+	}
+	for (int i = 0; i < 4; ++i) {
+		glEnableVertexAttribArray(ATTR_INSTANCE_MATRIX + i);
+		glVertexAttribFormat(ATTR_INSTANCE_MATRIX + i, 4, GL_FLOAT, GL_FALSE, i * sizeof(vec4));
+		glVertexAttribBinding(ATTR_INSTANCE_MATRIX + i, 1);
+	}
+	glVertexBindingDivisor(1, 1);
+	glBindVertexBuffer(1, instanceBuffer, 0, sizeof(mat4));
+	glEnableVertexAttribArray(ATTR_INSTANCE_FACE);
+	glVertexAttribIFormat(ATTR_INSTANCE_FACE, 1, GL_UNSIGNED_INT, 0);
+	glVertexAttribBinding(ATTR_INSTANCE_FACE, 2);
+	glVertexBindingDivisor(2, 1);
+	glBindVertexBuffer(2, faceBuffer, 0, sizeof(uint));
+	glBindVertexArray(0);
+	growVertices(s_initialVertices);
+	growIndices(s_initialIndices);
+}
+
+void MeshBuffer::destroy()
+{
+	if (vao) glDeleteVertexArrays(1, &vao);
+	if (vbo) glDeleteBuffers(1, &vbo);
+	if (ebo) glDeleteBuffers(1, &ebo);
+	vao = vbo = ebo = 0;
+	vertices = RangeAllocator();
+	indices = RangeAllocator();
+}
+
+// Replaces the buffer with a larger one, keeping the contents
+static uint resizeBuffer(uint buffer, uint oldSize, uint newSize)
+{
+	uint newBuffer = 0;
+	glGenBuffers(1, &newBuffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, newBuffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, newSize, NULL, GL_STATIC_DRAW);
+	if (oldSize) {
+		glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, oldSize);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	}
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	glDeleteBuffers(1, &buffer);
+	return newBuffer;
+}
+
+void MeshBuffer::growVertices(uint minCapacity)
+{
+	uint capacity = glm::max(vertices.capacity * 2, minCapacity);
+	vbo = resizeBuffer(vbo, vertices.capacity * vertexSize, capacity * vertexSize);
+	vertices.grow(capacity);
+	glBindVertexArray(vao);
+	glBindVertexBuffer(0, vbo, 0, vertexSize);
+	glBindVertexArray(0);
+}
+
+void MeshBuffer::growIndices(uint minCapacity)
+{
+	uint capacity = glm::max(indices.capacity * 2, minCapacity);
+	ebo = resizeBuffer(ebo, indices.capacity * sizeof(uint), capacity * sizeof(uint));
+	indices.grow(capacity);
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+	glBindVertexArray(0);
+}
+
+MeshBuffer::Allocation MeshBuffer::allocate(const Batch& batch)
+{
+	ASSERT((uint)batch.vertexSize == vertexSize);
+	Allocation alloc;
+	alloc.numVertices = batch.numVertices;
+	alloc.numIndices = batch.indices.size();
+	if (alloc.numVertices) {
+		if (!vertices.allocate(alloc.numVertices, alloc.baseVertex)) {
+			growVertices(vertices.capacity + alloc.numVertices);
+			vertices.allocate(alloc.numVertices, alloc.baseVertex);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glBufferSubData(GL_ARRAY_BUFFER, alloc.baseVertex * vertexSize, alloc.numVertices * vertexSize, &batch.vertexData.front());
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+
+	if (alloc.numIndices) {
+		if (!indices.allocate(alloc.numIndices, alloc.firstIndex)) {
+			growIndices(indices.capacity + alloc.numIndices);
+			indices.allocate(alloc.numIndices, alloc.firstIndex);
+		}
+		glBindBuffer(GL_COPY_WRITE_BUFFER, ebo);
+		glBufferSubData(GL_COPY_WRITE_BUFFER, alloc.firstIndex * sizeof(uint), alloc.numIndices * sizeof(uint), &batch.indices.front());
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	}
+	return alloc;
+}
+
+void MeshBuffer::free(const Allocation& alloc)
+{
+	vertices.free(alloc.baseVertex, alloc.numVertices);
+	indices.free(alloc.firstIndex, alloc.numIndices);
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include "common.hpp"
+
+struct Batch;
+
+// First fit free list allocator for ranges of a buffer
+struct RangeAllocator
+{
+	struct Range {
+		uint offset;
+		uint size;
+	};
+
+	bool allocate(uint size, uint& offset);
+	void free(uint offset, uint size);
+	void grow(uint newCapacity);
+
+	uint capacity = 0;
+	uint used = 0;
+	std::vector<Range> freeRanges; // Sorted by offset, neighbours merged
+};
+
+// Large vertex and index buffers shared by all batches with the same vertex
+// format. The VAO uses separate attribute formats and buffer bindings, binding
+// 0 is the vertices and 1 the per instance matrices. Buffers grow on demand.
+struct MeshBuffer
+{
+	struct Allocation {
+		uint baseVertex = 0;
+		uint numVertices = 0;
+		uint firstIndex = 0;
+		uint numIndices = 0; // Zero for non-indexed batches
+	};
+
+	void create(const Batch& format, uint instanceBuffer, uint faceBuffer);
+	void destroy();
+	Allocation allocate(const Batch& batch);
+	void free(const Allocation& alloc);
+
+	static uint64 formatKey(const Batch& batch);
+
+	uint vao = 0;
+	uint vbo = 0;
+	uint ebo = 0;
+	uint vertexSize = 0;
+	RangeAllocator vertices; // In vertices
+	RangeAllocator indices; // In indices
+
+private:
+	void growVertices(uint minCapacity);
+	void growIndices(uint minCapacity);
+};
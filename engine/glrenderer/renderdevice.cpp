@@ -9,7 +9,9 @@
 #include "resources.hpp"
 #include "environment.hpp"
 #include "image.hpp"
+#include "lightgrid.hpp"
 #include <glm/gtc/matrix_inverse.hpp>
+#include <algorithm>
 
 #define DEBUG_REFLECTION 0 // Draws dynamic cubemap to skybox
 
@@ -30,6 +32,17 @@ static void debugCallback(GLenum /*source*/, GLenum type, GLuint id, GLenum seve
 	}
 }
 
+// Low discrepancy sequence for the sub-pixel jitter
+static float halton(uint index, uint base)
+{
+	float result = 0.f, f = 1.f;
+	for (; index > 0; index /= base) {
+		f /= base;
+		result += f * (index % base);
+	}
+	return result;
+}
+
 static const mat4 s_shadowBiasMatrix(
 	0.5f, 0.0f, 0.0f, 0.0f,
 	0.0f, 0.5f, 0.0f, 0.0f,
@@ -59,9 +72,46 @@ enum ShaderFeature {
 	USE_CUBE_RENDER = 1 << 18,
 	USE_TANGENT = 1 << 19,
 	USE_VERTEX_COLOR = 1 << 20,
-	NUM_SHADER_FEATURES = 21
+	USE_INSTANCING = 1 << 21,
+	USE_VERTEX_LAYER = 1 << 22,
+	USE_GBUFFER = 1 << 23,
+	USE_DEFERRED_LIGHTING = 1 << 24,
+	USE_LOD_FADE = 1 << 25,
+	NUM_SHADER_FEATURES = 26
+};
+
+// Effects compiled into a postfx permutation, the tonemap operator goes above them
+enum PostEffect {
+	USE_CHROMATIC_ABERRATION = 1 << 0,
+	USE_FXAA = 1 << 1,
+	USE_BLOOM = 1 << 2,
+	USE_VIGNETTE = 1 << 3,
+	USE_SATURATION = 1 << 4,
+	USE_SEPIA = 1 << 5,
+	USE_SCANLINES = 1 << 6,
+	NUM_POST_EFFECTS = 7
 };
 
+const float RenderDevice::CASCADE_SPLIT_LAMBDA = 0.75f;
+const float RenderDevice::CASCADE_CASTER_MARGIN = 50.f;
+const float RenderDevice::TAA_HISTORY_WEIGHT = 0.9f;
+
+static_assert(LightGrid::TILES_X == CLUSTER_TILES_X && LightGrid::TILES_Y == CLUSTER_TILES_Y
+	&& LightGrid::SLICES == CLUSTER_SLICES, "Light grid size must match uniforms.glsl");
+
+static void fillMaterialBlock(UniformMaterialBlock& block, const Material& mat)
+{
+	block.ambient = mat.ambient;
+	block.diffuse = mat.diffuse;
+	block.specular = mat.specular;
+	block.shininess = mat.shininess;
+	block.reflectivity = mat.reflectivity;
+	block.parallax = mat.parallax;
+	block.emissive = mat.emissive;
+	block.uvOffset = mat.uvOffset;
+	block.uvRepeat = mat.uvRepeat;
+}
+
 RenderDevice::RenderDevice(Resources& resources)
 	: m_resources(resources)
 {
@@ -79,6 +129,12 @@ RenderDevice::RenderDevice(Resources& resources)
 	glGetIntegerv(GL_MAX_COLOR_TEXTURE_SAMPLES, &caps.maxSamples);
 	glGetIntegerv(GL_MAX_TEXTURE_IMAGE_UNITS, &caps.maxSamplers);
 	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &caps.maxArrayTextureLayers);
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &caps.uniformBufferAlignment);
+	if (glutil::hasExtension("GL_ARB_shader_viewport_layer_array"))
+		m_layerExtensions = "#extension GL_ARB_shader_viewport_layer_array : require\n";
+	else if (glutil::hasExtension("GL_AMD_vertex_shader_layer") && glutil::hasExtension("GL_AMD_vertex_shader_viewport_index"))
+		m_layerExtensions = "#extension GL_AMD_vertex_shader_layer : require\n#extension GL_AMD_vertex_shader_viewport_index : require\n";
+	caps.vertexLayer = !m_layerExtensions.empty();
 	//logDebug("%.1f %d %d %d", caps.maxAnisotropy, caps.maxSamples, caps.maxSamplers, caps.maxArrayTextureLayers);
 
 	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
@@ -120,11 +176,29 @@ RenderDevice::RenderDevice(Resources& resources)
 
 	m_commonBlock.create();
 	m_objectBlock.create();
-	m_materialBlock.create();
-	m_lightBlock.create();
+	m_materialSlotStride = (sizeof(UniformMaterialBlock) + caps.uniformBufferAlignment - 1) / caps.uniformBufferAlignment * caps.uniformBufferAlignment;
 	m_cubeMatrixBlock.create();
 	m_skinningBlock.create();
 	m_postProcessBlock.create();
+
+	glGenQueries(2, m_sampleQueries);
+	glGenQueries(2, m_timeQueries);
+	glGenBuffers(1, &m_cullInstanceBuffer);
+	glGenBuffers(1, &m_cullCommandBuffer);
+	glGenBuffers(1, &m_instanceMatrixBuffer);
+	glGenBuffers(1, &m_instanceFaceBuffer);
+	glGenBuffers(1, &m_drawCommandBuffer);
+	createBufferTexture(GL_RGBA32F, m_lightBuffer, m_lightTexture);
+	createBufferTexture(GL_RG32UI, m_clusterGridBuffer, m_clusterGridTexture);
+	createBufferTexture(GL_R32UI, m_clusterIndexBuffer, m_clusterIndexTexture);
+	// Mesh buffer VAOs reference this, give it a data store before the first instanced draw
+	glBindBuffer(GL_ARRAY_BUFFER, m_instanceMatrixBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(mat4), NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, m_instanceFaceBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(uint), NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	m_uniformRing.create(UNIFORM_RING_SIZE, caps.uniformBufferAlignment);
 }
 
 void RenderDevice::resizeRenderTargets()
@@ -133,14 +207,14 @@ void RenderDevice::resizeRenderTargets()
 		m_msaaFbo.destroy();
 	if (m_fbo.valid())
 		m_fbo.destroy();
-	for (uint i = 0; i < countof(m_pingPongFbo); ++i)
-		if (m_pingPongFbo[i].valid())
-			m_pingPongFbo[i].destroy();
-	for (uint i = 0; i < countof(m_shadowFbo); ++i)
-		if (m_shadowFbo[i].valid())
-			m_shadowFbo[i].destroy();
-	if (m_reflectionFbo.valid())
-		m_reflectionFbo.destroy();
+	if (m_gbufferFbo.valid())
+		m_gbufferFbo.destroy();
+	if (m_hizTexture) {
+		glDeleteTextures(1, &m_hizTexture);
+		m_hizTexture = 0;
+		m_hizValid = false;
+	}
+	m_historyValid = false;
 	// Set up floating point framebuffer to render HDR scene to
 	int samples = Engine::settings["renderer"]["msaa"].number_value();
 	if (samples > 1) {
@@ -156,32 +230,43 @@ void RenderDevice::resizeRenderTargets()
 	m_fbo.numTextures = 3;
 	m_fbo.depthAttachment = 2;
 	m_fbo.create();
-	for (uint i = 0; i < countof(m_pingPongFbo); ++i) {
-		m_pingPongFbo[i].width = Engine::width();
-		m_pingPongFbo[i].height = Engine::height();
-		m_pingPongFbo[i].numTextures = 1;
-		m_pingPongFbo[i].create();
-	}
-	for (uint i = 0; i < MAX_SHADOW_MAPS; ++i) {
-		m_shadowFbo[i].width = Engine::settings["renderer"]["shadowMapSize"].number_value();
-		m_shadowFbo[i].height = m_shadowFbo[i].width;
-		m_shadowFbo[i].depthAttachment = 0;
-		m_shadowFbo[i].cube = false;
-		m_shadowFbo[i].create();
-	}
-	for (uint i = MAX_SHADOW_MAPS; i < MAX_SHADOWS; ++i) {
-		m_shadowFbo[i].width = Engine::settings["renderer"]["shadowCubeSize"].number_value();
-		m_shadowFbo[i].height = m_shadowFbo[i].width;
-		m_shadowFbo[i].depthAttachment = 0;
-		m_shadowFbo[i].cube = true;
-		m_shadowFbo[i].create();
-	}
-	m_reflectionFbo.width = Engine::settings["renderer"]["reflectionCubeSize"].number_value();
-	m_reflectionFbo.height = m_reflectionFbo.width;
-	m_reflectionFbo.numTextures = 2;
-	m_reflectionFbo.depthAttachment = 1;
-	m_reflectionFbo.cube = true;
-	m_reflectionFbo.create();
+	m_numCascades = glm::clamp(Engine::settings["renderer"]["shadowCascades"].int_value(), 1, MAX_CASCADES);
+	m_shadowDistance = Engine::settings["renderer"]["shadowDistance"].number_value();
+	m_shadowAtlasBudget = Engine::settings["renderer"]["shadowAtlasBudget"].int_value();
+	uint shadowMapSize = Engine::settings["renderer"]["shadowMapSize"].int_value();
+	uint shadowAtlasSize = Engine::settings["renderer"]["shadowAtlasSize"].int_value();
+	// Shadow and reflection targets don't depend on the window, keep them (and the shadow caches) unless their settings changed
+	if (!m_shadowFbo.valid() || m_shadowFbo.width != shadowMapSize || m_shadowFbo.layers != m_numCascades
+		|| m_shadowAtlasFbo.width != shadowAtlasSize) {
+		for (FBO* fbo : { &m_shadowFbo, &m_shadowCacheFbo }) {
+			if (fbo->valid())
+				fbo->destroy();
+			fbo->width = fbo->height = shadowMapSize;
+			fbo->depthAttachment = 0;
+			fbo->layers = m_numCascades;
+			fbo->create();
+		}
+		for (FBO* fbo : { &m_shadowAtlasFbo, &m_shadowAtlasCacheFbo }) {
+			if (fbo->valid())
+				fbo->destroy();
+			fbo->width = fbo->height = shadowAtlasSize;
+			fbo->depthAttachment = 0;
+			fbo->create();
+		}
+		m_shadowAtlas.create(shadowAtlasSize);
+		m_shadowCaches.assign(MAX_CASCADES + m_shadowAtlas.numSlots(), ShadowCache());
+	}
+	uint reflectionSize = Engine::settings["renderer"]["reflectionCubeSize"].int_value();
+	if (!m_reflectionFbo.valid() || m_reflectionFbo.width != reflectionSize) {
+		if (m_reflectionFbo.valid())
+			m_reflectionFbo.destroy();
+		m_reflectionFbo.width = m_reflectionFbo.height = reflectionSize;
+		m_reflectionFbo.numTextures = 2;
+		m_reflectionFbo.depthAttachment = 1;
+		m_reflectionFbo.cube = true;
+		m_reflectionFbo.create();
+	}
+	resetTextureCache();
 }
 
 void RenderDevice::loadShaders()
@@ -192,6 +277,10 @@ void RenderDevice::loadShaders()
 	m_shaders.clear();
 	m_shaderNames.clear();
 	m_shaderTags.clear();
+	m_instancedShaders.clear();
+	m_layeredShaders.clear();
+	m_fadeShaders.clear();
+	m_postShaders.clear();
 	std::string err;
 	Json jsonShaders = Json::parse(m_resources.getText("shaders.json", Resources::NO_CACHE), err);
 	if (!err.empty())
@@ -258,6 +347,8 @@ int RenderDevice::generateShader(uint tags)
 	string name;
 	if (tags & USE_DEPTH) name = "gen_depth_";
 	else if (tags & USE_CUBE_RENDER) name= "gen_refl_";
+	else if (tags & USE_GBUFFER) name = "gen_gbuffer_";
+	else if (tags & USE_DEFERRED_LIGHTING) name = "gen_lighting_";
 	else name = "gen_color_";
 	name += std::bitset<NUM_SHADER_FEATURES>(tags).to_string();
 	m_shaders.emplace_back(name);
@@ -265,6 +356,8 @@ int RenderDevice::generateShader(uint tags)
 
 	string defineText =	"#version " + Engine::settings["renderer"]["glslversion"].string_value() + "\n";
 	defineText += m_resources.getText("shaders/extensions.glsl", Resources::USE_CACHE);
+	if (tags & USE_VERTEX_LAYER)
+		defineText += m_layerExtensions;
 
 #define HANDLE_FEATURE(x) if (tags & x) defineText += "#define " #x " 1\n";
 	HANDLE_FEATURE(USE_FOG)
@@ -288,17 +381,25 @@ int RenderDevice::generateShader(uint tags)
 	HANDLE_FEATURE(USE_CUBE_RENDER)
 	HANDLE_FEATURE(USE_TANGENT)
 	HANDLE_FEATURE(USE_VERTEX_COLOR)
+	HANDLE_FEATURE(USE_INSTANCING)
+	HANDLE_FEATURE(USE_VERTEX_LAYER)
+	HANDLE_FEATURE(USE_GBUFFER)
+	HANDLE_FEATURE(USE_DEFERRED_LIGHTING)
+	HANDLE_FEATURE(USE_LOD_FADE)
 #undef HANDLE_FEATURE
 
 	defineText += m_resources.getText("shaders/uniforms.glsl", Resources::USE_CACHE);
 	defineText += "#line 1 1\n";
 
 	string file = (tags & USE_DEPTH) ? "depth" : "core";
-	program.compile(VERTEX_SHADER, m_resources.getText("shaders/" + file + ".vert", Resources::USE_CACHE), defineText);
+	// The deferred lighting pass is core.frag run over a fullscreen quad
+	string vertFile = (tags & USE_DEFERRED_LIGHTING) ? "postfx" : file;
+	program.compile(VERTEX_SHADER, m_resources.getText("shaders/" + vertFile + ".vert", Resources::USE_CACHE), defineText);
 	program.compile(FRAGMENT_SHADER, m_resources.getText("shaders/" + file + ".frag", Resources::USE_CACHE), defineText);
-	if (tags & USE_DEPTH_CUBE)
+	// Layered variants pick the cube face in the vertex shader
+	if ((tags & USE_DEPTH_CUBE) && !(tags & USE_VERTEX_LAYER))
 		program.compile(GEOMETRY_SHADER, m_resources.getText("shaders/depth.geom", Resources::USE_CACHE), defineText);
-	if (tags & USE_CUBE_RENDER)
+	if ((tags & USE_CUBE_RENDER) && !(tags & USE_VERTEX_LAYER))
 		program.compile(GEOMETRY_SHADER, m_resources.getText("shaders/core.geom", Resources::USE_CACHE), defineText);
 	if (tags & USE_TESSELLATION) {
 		program.compile(TESS_CONTROL_SHADER, m_resources.getText("shaders/core.tesc", Resources::USE_CACHE), defineText);
@@ -320,13 +421,132 @@ int RenderDevice::generateShader(uint tags)
 	return index;
 }
 
+// Key is a PostEffect mask with the tonemap operator shifted above it
+int RenderDevice::generatePostShader(uint key)
+{
+	auto it = m_postShaders.find(key);
+	if (it != m_postShaders.end())
+		return it->second;
+
+	uint effects = key & ((1 << NUM_POST_EFFECTS) - 1);
+	uint tonemap = key >> NUM_POST_EFFECTS;
+	string name = "gen_postfx_" + std::to_string(tonemap) + "_" + std::bitset<NUM_POST_EFFECTS>(effects).to_string();
+	m_shaders.emplace_back(name);
+	ShaderProgram& program = m_shaders.back();
+
+	string defineText =	"#version " + Engine::settings["renderer"]["glslversion"].string_value() + "\n";
+	defineText += m_resources.getText("shaders/extensions.glsl", Resources::USE_CACHE);
+#define HANDLE_FEATURE(x) if (effects & x) defineText += "#define " #x " 1\n";
+	HANDLE_FEATURE(USE_CHROMATIC_ABERRATION)
+	HANDLE_FEATURE(USE_FXAA)
+	HANDLE_FEATURE(USE_BLOOM)
+	HANDLE_FEATURE(USE_VIGNETTE)
+	HANDLE_FEATURE(USE_SATURATION)
+	HANDLE_FEATURE(USE_SEPIA)
+	HANDLE_FEATURE(USE_SCANLINES)
+#undef HANDLE_FEATURE
+	defineText += "#define TONEMAP " + std::to_string(tonemap) + "\n";
+	defineText += m_resources.getText("shaders/uniforms.glsl", Resources::USE_CACHE);
+	defineText += "#line 1 1\n";
+
+	program.compile(VERTEX_SHADER, m_resources.getText("shaders/postfx.vert", Resources::USE_CACHE), defineText);
+	program.compile(FRAGMENT_SHADER, m_resources.getText("shaders/postfx.frag", Resources::USE_CACHE), defineText);
+	int index = program.link() ? (int)m_shaders.size() - 1 : -1;
+	m_postShaders[key] = index;
+	return index;
+}
+
+int RenderDevice::instancedShader(int shaderId)
+{
+	auto it = m_instancedShaders.find(shaderId);
+	if (it != m_instancedShaders.end())
+		return it->second;
+
+	// Only auto-generated shaders have an instanced variant
+	int result = -1;
+	uint unsupported = USE_TESSELLATION | USE_ANIMATION;
+	for (auto& tagIt : m_shaderTags) {
+		if (tagIt.second != shaderId || (tagIt.first & unsupported))
+			continue;
+		uint tags = tagIt.first | USE_INSTANCING;
+		int index = generateShader(tags);
+		if (m_shaderTags.find(tags) != m_shaderTags.end())
+			result = index;
+		break;
+	}
+	m_instancedShaders[shaderId] = result;
+	return result;
+}
+
+int RenderDevice::layeredShader(int shaderId)
+{
+	auto it = m_layeredShaders.find(shaderId);
+	if (it != m_layeredShaders.end())
+		return it->second;
+
+	int result = -1;
+	int instanced = caps.vertexLayer ? instancedShader(shaderId) : -1;
+	for (auto& tagIt : m_shaderTags) {
+		if (instanced < 0 || tagIt.second != instanced)
+			continue;
+		uint tags = tagIt.first | USE_VERTEX_LAYER;
+		int index = generateShader(tags);
+		if (m_shaderTags.find(tags) != m_shaderTags.end())
+			result = index;
+		break;
+	}
+	m_layeredShaders[shaderId] = result;
+	return result;
+}
+
+// Dithered variant for LOD cross-fades, also only for auto-generated shaders
+int RenderDevice::fadeShader(int shaderId)
+{
+	auto it = m_fadeShaders.find(shaderId);
+	if (it != m_fadeShaders.end())
+		return it->second;
+
+	int result = -1;
+	for (auto& tagIt : m_shaderTags) {
+		if (tagIt.second != shaderId || (tagIt.first & (USE_DEPTH | USE_DEFERRED_LIGHTING)))
+			continue;
+		uint tags = tagIt.first | USE_LOD_FADE;
+		int index = generateShader(tags);
+		if (m_shaderTags.find(tags) != m_shaderTags.end())
+			result = index;
+		break;
+	}
+	m_fadeShaders[shaderId] = result;
+	return result;
+}
+
 RenderDevice::~RenderDevice()
 {
 	glDeleteBuffers(1, &m_fullscreenQuad.vbo);
 	glDeleteVertexArrays(1, &m_fullscreenQuad.vao);
+	destroyGeometry(m_impostorQuad);
+	m_impostors.clear();
 	m_textures.clear();
-	for (auto& g : m_geometries)
-		destroyGeometry(g);
+	for (auto& buffer : m_meshBuffers)
+		buffer.destroy();
+	glDeleteQueries(2, m_sampleQueries);
+	glDeleteQueries(2, m_timeQueries);
+	glDeleteBuffers(1, &m_cullInstanceBuffer);
+	glDeleteBuffers(1, &m_cullCommandBuffer);
+	glDeleteBuffers(1, &m_instanceMatrixBuffer);
+	glDeleteBuffers(1, &m_instanceFaceBuffer);
+	glDeleteBuffers(1, &m_drawCommandBuffer);
+	uint buffers[] = { m_lightBuffer, m_clusterGridBuffer, m_clusterIndexBuffer };
+	uint textures[] = { m_lightTexture, m_clusterGridTexture, m_clusterIndexTexture };
+	glDeleteBuffers(countof(buffers), buffers);
+	glDeleteTextures(countof(textures), textures);
+	if (m_probeArray)
+		glDeleteTextures(1, &m_probeArray);
+	m_uniformRing.destroy();
+	glDeleteBuffers(1, &m_materialBuffer);
+	if (m_hizTexture)
+		glDeleteTextures(1, &m_hizTexture);
+	m_frameGraph.destroy();
 }
 
 void RenderDevice::setEnvironment(Environment* env)
@@ -343,6 +563,7 @@ void RenderDevice::setEnvironment(Environment* env)
 		tex.anisotropy = caps.maxAnisotropy;
 		tex.create();
 		tex.uploadCube(m_env->skybox);
+		resetTextureCache();
 	}
 	m_skyboxMat.tex[Material::ENV_MAP] = tex.id;
 }
@@ -370,11 +591,16 @@ void RenderDevice::destroyGeometry(GPUGeometry& geometry)
 
 void RenderDevice::destroyGeometry(Geometry& geometry)
 {
+	auto impostorIt = m_impostors.lower_bound(ImpostorKey(&geometry, 0));
+	while (impostorIt != m_impostors.end() && impostorIt->first.first == &geometry)
+		impostorIt = m_impostors.erase(impostorIt);
 	for (auto& batch : geometry.batches) {
 		if (batch.renderId == -1)
 			continue;
-		GPUGeometry& g = m_geometries[batch.renderId];
-		destroyGeometry(g);
+		GPUBatch& gpuBatch = m_batches[batch.renderId];
+		m_meshBuffers[gpuBatch.meshBuffer].free(gpuBatch.alloc);
+		gpuBatch = GPUBatch();
+		m_freeBatches.push_back(batch.renderId);
 		batch.renderId = -1;
 	}
 }
@@ -388,36 +614,27 @@ bool RenderDevice::uploadGeometry(Geometry& geometry)
 
 	for (auto& batch : geometry.batches) {
 		ASSERT(batch.renderId == -1);
-		batch.renderId = m_geometries.size();
-		m_geometries.emplace_back();
-		GPUGeometry& model = m_geometries.back();
-
-		if (!model.vao) glGenVertexArrays(1, &model.vao);
-		if (!model.vbo) glGenBuffers(1, &model.vbo);
-		if (!model.ebo && !batch.indices.empty()) glGenBuffers(1, &model.ebo);
-		ASSERT(model.vao && model.vbo);
-		glBindVertexArray(model.vao);
-		glBindBuffer(GL_ARRAY_BUFFER, model.vbo);
-		glBufferData(GL_ARRAY_BUFFER, batch.vertexData.size(), &batch.vertexData.front(), GL_STATIC_DRAW);
-		// Setup attributes
-		for (int i = 0; i < ATTR_MAX; ++i) {
-			Batch::Attribute& attr = batch.attributes[i];
-			if (attr.components) {
-				glEnableVertexAttribArray(i);
-				glVertexAttribPointer(i, attr.components, attr.type, attr.normalized ? GL_TRUE : GL_FALSE, batch.vertexSize, (GLvoid*)(uintptr_t)attr.offset);
-			} else {
-				glDisableVertexAttribArray(i);
-			}
-		}
-		// Elements
-		if (model.ebo) {
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model.ebo);
-			glBufferData(GL_ELEMENT_ARRAY_BUFFER, batch.indices.size() * sizeof(uint), &batch.indices.front(), GL_STATIC_DRAW);
+		uint64 format = MeshBuffer::formatKey(batch);
+		auto it = m_meshBufferIndex.find(format);
+		int bufferIndex;
+		if (it == m_meshBufferIndex.end()) {
+			bufferIndex = m_meshBuffers.size();
+			m_meshBuffers.emplace_back();
+			m_meshBuffers.back().create(batch, m_instanceMatrixBuffer, m_instanceFaceBuffer);
+			m_meshBufferIndex[format] = bufferIndex;
+		} else bufferIndex = it->second;
+
+		if (m_freeBatches.empty()) {
+			batch.renderId = m_batches.size();
+			m_batches.emplace_back();
+		} else {
+			batch.renderId = m_freeBatches.back();
+			m_freeBatches.pop_back();
 		}
+		GPUBatch& gpuBatch = m_batches[batch.renderId];
+		gpuBatch.meshBuffer = bufferIndex;
+		gpuBatch.alloc = m_meshBuffers[bufferIndex].allocate(batch);
 	}
-
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
 	return true;
 }
 
@@ -468,6 +685,8 @@ bool RenderDevice::uploadMaterial(Material& material)
 	}
 	// Other techs are always auto generated
 	{
+		// G-buffer, materials that can't use it are drawn forward after the lighting pass
+		material.shaderId[TECH_GBUFFER] = canDefer(material) ? generateShader(tag | USE_GBUFFER) : -1;
 		// Simpler reflection shader
 		tag &= ~(USE_SHADOW_MAP | USE_AO_MAP | USE_REFLECTION_MAP | USE_PARALLAX_MAP | USE_ENV_MAP | USE_TESSELLATION);
 		material.shaderId[TECH_REFLECTION] = generateShader(tag | USE_CUBE_RENDER);
@@ -499,6 +718,7 @@ bool RenderDevice::uploadMaterial(Material& material)
 			tex.anisotropy = caps.maxAnisotropy;
 			tex.create();
 			tex.upload(*material.map[i]);
+			resetTextureCache();
 		}
 		material.tex[i] = tex.id;
 	}
@@ -507,6 +727,121 @@ bool RenderDevice::uploadMaterial(Material& material)
 	return true;
 }
 
+void RenderDevice::updateMaterialBlock(Material& material)
+{
+	UniformMaterialBlock block = UniformMaterialBlock();
+	fillMaterialBlock(block, material);
+	if (material.blockId >= 0 && material.blockId < (int)m_materialSlots.size()) {
+		MaterialSlot& slot = m_materialSlots[material.blockId];
+		if (slot.used && !memcmp(&slot.block, &block, sizeof(block))) {
+			slot.lastUsed = m_frame;
+			return;
+		}
+	}
+	// Edited or new, share a slot with identical materials
+	uint64 hash = id::hash64(&block, sizeof(block));
+	auto it = m_materialSlotIndex.find(hash);
+	if (it != m_materialSlotIndex.end() && !memcmp(&m_materialSlots[it->second].block, &block, sizeof(block))) {
+		material.blockId = it->second;
+		m_materialSlots[it->second].lastUsed = m_frame;
+		return;
+	}
+
+	int slotId;
+	if (!m_freeMaterialSlots.empty()) {
+		slotId = m_freeMaterialSlots.back();
+		m_freeMaterialSlots.pop_back();
+	} else {
+		slotId = m_materialSlots.size();
+		m_materialSlots.emplace_back();
+	}
+	if (m_materialSlots.size() > m_materialBufferSlots) {
+		// Grow the buffer keeping existing slots in place
+		uint oldSize = m_materialBufferSlots * m_materialSlotStride;
+		m_materialBufferSlots = glm::max(m_materialBufferSlots * 2, 256u);
+		uint buffer = 0;
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, m_materialBufferSlots * m_materialSlotStride, NULL, GL_DYNAMIC_DRAW);
+		if (m_materialBuffer) {
+			glBindBuffer(GL_COPY_READ_BUFFER, m_materialBuffer);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, oldSize);
+			glBindBuffer(GL_COPY_READ_BUFFER, 0);
+			glDeleteBuffers(1, &m_materialBuffer);
+		}
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		m_materialBuffer = buffer;
+		m_boundMaterialBlock = -1;
+	}
+	MaterialSlot& slot = m_materialSlots[slotId];
+	if (slot.used)
+		m_materialSlotIndex.erase(slot.hash);
+	slot.block = block;
+	slot.hash = hash;
+	slot.lastUsed = m_frame;
+	slot.used = true;
+	m_materialSlotIndex[hash] = slotId;
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_materialBuffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, slotId * m_materialSlotStride, sizeof(block), &block);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	material.blockId = slotId;
+}
+
+void RenderDevice::bindMaterialBlock(int blockId)
+{
+	ASSERT(blockId >= 0 && blockId < (int)m_materialSlots.size());
+	if (m_boundMaterialBlock == blockId) {
+		++stats.avoided.materials;
+		return;
+	}
+	glBindBufferRange(GL_UNIFORM_BUFFER, UniformMaterialBlock::binding, m_materialBuffer,
+		blockId * m_materialSlotStride, sizeof(UniformMaterialBlock));
+	m_boundMaterialBlock = blockId;
+}
+
+void RenderDevice::bindTexture(uint unit, uint target, uint tex)
+{
+	ASSERT(unit < MAX_TEXTURE_UNITS);
+	if (m_boundTextures[unit] == tex) {
+		++stats.avoided.textures;
+		return;
+	}
+	glActiveTexture(GL_TEXTURE0 + unit);
+	glBindTexture(target, tex);
+	m_boundTextures[unit] = tex;
+}
+
+// Needed after code that binds textures directly (e.g. texture creation)
+void RenderDevice::resetTextureCache()
+{
+	memset(m_boundTextures, 0, sizeof(m_boundTextures));
+}
+
+template<typename T>
+void RenderDevice::uploadBlock(UBO<T>& ubo)
+{
+	if (m_uniformRing.bindUniforms(T::binding, &ubo.uniforms, sizeof(T))) {
+		stats.bytesStreamed += sizeof(T);
+		return;
+	}
+	// Ring is full this frame, fall back to the block's own buffer
+	ubo.upload();
+	glBindBufferBase(GL_UNIFORM_BUFFER, T::binding, ubo.id);
+}
+
+void RenderDevice::createBufferTexture(uint format, uint& buffer, uint& texture)
+{
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+	glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_BUFFER, texture);
+	glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	resetTextureCache();
+}
+
 void RenderDevice::useProgram(const ShaderProgram& program)
 {
 	uint programId = program.id;
@@ -514,27 +849,28 @@ void RenderDevice::useProgram(const ShaderProgram& program)
 		m_program = programId;
 		glUseProgram(m_program);
 		++stats.programs;
-	}
+	} else ++stats.avoided.programs;
 }
 
-void RenderDevice::drawSetup(const Transform& transform, const BoneAnimation* animation)
+void RenderDevice::drawSetup(const mat4& modelMatrix, const BoneAnimation* animation, float lodFade)
 {
-	m_objectBlock.uniforms.modelMatrix = transform.matrix;
+	m_objectBlock.uniforms.modelMatrix = modelMatrix;
+	m_objectBlock.uniforms.lodFade = lodFade;
 	mat4 modelView = m_commonBlock.uniforms.viewMatrix * m_objectBlock.uniforms.modelMatrix;
 	m_objectBlock.uniforms.modelViewMatrix = modelView;
 	m_objectBlock.uniforms.modelViewProjMatrix = m_commonBlock.uniforms.projectionMatrix * modelView;
 	m_objectBlock.uniforms.normalMatrix = glm::inverseTranspose(modelView);
-	m_objectBlock.upload();
+	uploadBlock(m_objectBlock);
 
 	if (animation && !animation->bones.empty()) {
 		ASSERT(animation->bones.size() <= MAX_BONES);
 		uint numBones = std::min((uint)animation->bones.size(), (uint)MAX_BONES);
 		memcpy(&m_skinningBlock.uniforms.boneMatrices[0], &animation->bones[0], numBones * sizeof(mat3x4));
-		m_skinningBlock.upload();
+		uploadBlock(m_skinningBlock);
 	}
 }
 
-void RenderDevice::setupCubeMatrices(mat4 proj, vec3 pos)
+void RenderDevice::setupCubeMatrices(mat4 proj, vec3 pos, uint faceMask)
 {
 	mat4* cubeMatrices = &m_cubeMatrixBlock.uniforms.cubeMatrices[0];
 	cubeMatrices[0] = proj * glm::lookAt(pos, pos + vec3(1, 0, 0), vec3(0, -1, 0));
@@ -543,63 +879,229 @@ void RenderDevice::setupCubeMatrices(mat4 proj, vec3 pos)
 	cubeMatrices[3] = proj * glm::lookAt(pos, pos + vec3(0, -1, 0), vec3(0, 0, -1));
 	cubeMatrices[4] = proj * glm::lookAt(pos, pos + vec3(0, 0, 1), vec3(0, -1, 0));
 	cubeMatrices[5] = proj * glm::lookAt(pos, pos + vec3(0, 0, -1), vec3(0, -1, 0));
-	m_cubeMatrixBlock.upload();
+	m_cubeMatrixBlock.uniforms.cubeFaceMask = faceMask;
+	uploadBlock(m_cubeMatrixBlock);
+	m_cubeCenter = pos;
+}
+
+// Faces of the current cube whose 90 degree frustum touches the sphere, in setupCubeMatrices() order
+uint RenderDevice::cubeFaceMask(vec3 center, float radius) const
+{
+	vec3 d = center - m_cubeCenter;
+	float r = radius * glm::root_two<float>();
+	uint mask = 0;
+	for (int axis = 0; axis < 3; ++axis) {
+		float a = d[(axis + 1) % 3], b = d[(axis + 2) % 3];
+		for (int side = 0; side < 2; ++side) {
+			float depth = side ? -d[axis] : d[axis];
+			if (depth + a >= -r && depth - a >= -r && depth + b >= -r && depth - b >= -r)
+				mask |= 1 << (axis * 2 + side);
+		}
+	}
+	return mask;
+}
+
+void RenderDevice::setupCascades(const Light& sun, const Camera& camera)
+{
+	// Practical split scheme, blending logarithmic and uniform distribution
+	float near = glm::max(camera.near, 0.01f);
+	float far = m_shadowDistance > 0.f ? glm::min(camera.far, m_shadowDistance) : camera.far;
+	for (uint i = 0; i < m_numCascades; ++i) {
+		float f = (i + 1) / (float)m_numCascades;
+		float logSplit = near * glm::pow(far / near, f);
+		float uniformSplit = near + (far - near) * f;
+		m_cascades[i].split = glm::mix(uniformSplit, logSplit, CASCADE_SPLIT_LAMBDA);
+	}
+
+	// Frustum corners in world space, interpolated along the edges per cascade
+	mat4 invViewProj = glm::inverse(camera.projection * camera.view);
+	vec3 nearCorners[4], farCorners[4];
+	for (int i = 0; i < 4; ++i) {
+		vec2 ndc((i & 1) ? 1.f : -1.f, (i & 2) ? 1.f : -1.f);
+		vec4 n = invViewProj * vec4(ndc, -1.f, 1.f);
+		vec4 f = invViewProj * vec4(ndc, 1.f, 1.f);
+		nearCorners[i] = vec3(n) / n.w;
+		farCorners[i] = vec3(f) / f.w;
+	}
+
+	// Fixed light orientation so that texel snapping keeps the cascades stable
+	vec3 sunDir = glm::normalize(sun.position - sun.target);
+	vec3 up = glm::abs(sunDir.y) > 0.99f ? vec3(0, 0, 1) : vec3(0, 1, 0);
+	mat4 lightView = glm::lookAt(vec3(0.f), -sunDir, up);
+	float shadowMapSize = m_shadowFbo.width;
+	float sliceNear = near;
+	for (uint i = 0; i < m_numCascades; ++i) {
+		Cascade& cascade = m_cascades[i];
+		float t0 = (sliceNear - camera.near) / (camera.far - camera.near);
+		float t1 = (cascade.split - camera.near) / (camera.far - camera.near);
+		vec3 corners[8];
+		vec3 center(0.f);
+		for (int j = 0; j < 4; ++j) {
+			corners[j] = glm::mix(nearCorners[j], farCorners[j], t0);
+			corners[j + 4] = glm::mix(nearCorners[j], farCorners[j], t1);
+			center += corners[j] + corners[j + 4];
+		}
+		center /= 8.f;
+		// Bounding sphere keeps the size constant when the camera rotates
+		float radius = 0.f;
+		for (int j = 0; j < 8; ++j)
+			radius = glm::max(radius, glm::distance(center, corners[j]));
+		radius = glm::ceil(radius * 16.f) / 16.f;
+
+		vec3 lightCenter = vec3(lightView * vec4(center, 1.f));
+		float texelSize = 2.f * radius / shadowMapSize;
+		lightCenter.x = glm::floor(lightCenter.x / texelSize) * texelSize;
+		lightCenter.y = glm::floor(lightCenter.y / texelSize) * texelSize;
+
+		cascade.view = lightView;
+		cascade.center = lightCenter;
+		cascade.radius = radius;
+		cascade.near = -lightCenter.z - radius - CASCADE_CASTER_MARGIN;
+		cascade.far = -lightCenter.z + radius;
+		cascade.proj = glm::ortho(lightCenter.x - radius, lightCenter.x + radius,
+			lightCenter.y - radius, lightCenter.y + radius, cascade.near, cascade.far);
+
+		m_commonBlock.uniforms.cascadeMatrices[i] = s_shadowBiasMatrix * cascade.proj * cascade.view;
+		m_commonBlock.uniforms.cascadeSplits[i] = cascade.split;
+		sliceNear = cascade.split;
+	}
+	m_commonBlock.uniforms.numCascades = m_numCascades;
+}
+
+void RenderDevice::setupCascadePass(uint cascade)
+{
+	ASSERT(m_env);
+	ASSERT(cascade < m_numCascades);
+	m_shadowTarget = &m_shadowFbo;
+	m_shadowCacheTarget = &m_shadowCacheFbo;
+	m_shadowLayer = cascade;
+	m_shadowRect = glm::uvec4(0, 0, m_shadowFbo.width, m_shadowFbo.height);
+	m_shadowCacheIndex = cascade;
+	m_shadowFbo.bindLayer(cascade);
+	glViewport(0, 0, m_shadowFbo.width, m_shadowFbo.height);
+	glCullFace(GL_FRONT);
+	m_program = 0;
+	glUseProgram(0);
+	m_tech = TECH_DEPTH;
+	const Cascade& c = m_cascades[cascade];
+	m_commonBlock.uniforms.near = c.near;
+	m_commonBlock.uniforms.far = c.far;
+	m_commonBlock.uniforms.projectionMatrix = c.proj;
+	m_commonBlock.uniforms.viewMatrix = c.view;
+	m_commonBlock.uniforms.cameraPosition = vec3(glm::inverse(c.view) * vec4(c.center + vec3(0, 0, -c.near), 1.f));
+	uploadBlock(m_commonBlock);
+}
+
+bool RenderDevice::cascadeVisible(uint cascade, vec3 position, float radius) const
+{
+	const Cascade& c = m_cascades[cascade];
+	vec3 p = vec3(c.view * vec4(position, 1.f));
+	float extent = c.radius + radius;
+	return glm::abs(p.x - c.center.x) < extent && glm::abs(p.y - c.center.y) < extent
+		&& -p.z + radius > c.near && -p.z - radius < c.far;
+}
+
+void RenderDevice::updateShadowAtlas(const std::vector<Light>& lights, vec3 cameraPosition)
+{
+	m_shadowAtlas.update(lights.empty() ? nullptr : &lights[0], lights.size(), cameraPosition, m_frame, m_shadowAtlasBudget);
+	for (uint i = 0; i < lights.size(); ++i)
+		if (m_shadowAtlas.lightSlot(i) >= 0)
+			stats.shadowedLights++;
 }
 
 void RenderDevice::setupShadowPass(const Light& light, uint index)
 {
 	ASSERT(m_env);
-	m_shadowFbo[index].bind();
-	glViewport(0, 0, m_shadowFbo[index].width, m_shadowFbo[index].height);
-	glClear(GL_DEPTH_BUFFER_BIT);
+	// Directional lights go through setupCascadePass()
+	ASSERT(light.type == Light::POINT_LIGHT);
+	int slotIndex = m_shadowAtlas.lightSlot(index);
+	ASSERT(slotIndex >= 0);
+	const ShadowAtlas::Slot& slot = m_shadowAtlas.slot(slotIndex);
+	uint tileSize = slot.tileSize;
+	m_shadowTarget = &m_shadowAtlasFbo;
+	m_shadowCacheTarget = &m_shadowAtlasCacheFbo;
+	m_shadowLayer = 0;
+	m_shadowRect = glm::uvec4(slot.x, slot.y, tileSize * 3, tileSize * 2);
+	m_shadowCacheIndex = MAX_CASCADES + slotIndex;
+	m_shadowAtlasFbo.bind();
+	// The geometry shader sends each cube face to its own viewport
+	for (uint face = 0; face < 6; ++face)
+		glViewportIndexedf(face, slot.x + face % 3 * tileSize, slot.y + face / 3 * tileSize, tileSize, tileSize);
 	glCullFace(GL_FRONT);
 	m_program = 0;
 	glUseProgram(0);
 	float& near = m_commonBlock.uniforms.near;
 	float& far = m_commonBlock.uniforms.far;
-	if (light.type == Light::POINT_LIGHT) {
-		m_tech = TECH_DEPTH_CUBE;
-		float aspect = (float)m_shadowFbo[index].width / (float)m_shadowFbo[index].height;
-		near = 0.2f; far = light.distance;
-		m_shadowProj[index] = glm::perspective(glm::radians(90.0f), aspect, near, far);
-		setupCubeMatrices(m_shadowProj[index], light.position);
-	} else if (light.type == Light::DIRECTIONAL_LIGHT) {
-		m_tech = TECH_DEPTH;
-		// TODO: Configure
-		float size = 20.f;
-		near = 1.f; far = 50.f;
-		m_shadowProj[index] = glm::ortho(-size, size, -size, size, near, far);
-		m_shadowView[index] = glm::lookAt(light.position, light.target, vec3(0, 1, 0));
-	} else ASSERT(!"Unsupported light type for shadow pass");
-
-	m_commonBlock.uniforms.projectionMatrix = m_shadowProj[index];
-	m_commonBlock.uniforms.viewMatrix = m_shadowView[index];
+	m_tech = TECH_DEPTH_CUBE;
+	near = 0.2f; far = light.distance;
+	mat4 proj = glm::perspective(glm::radians(90.0f), 1.f, near, far);
+	setupCubeMatrices(proj, light.position);
+
+	m_commonBlock.uniforms.projectionMatrix = proj;
+	m_commonBlock.uniforms.viewMatrix = mat4();
 	m_commonBlock.uniforms.cameraPosition = light.position;
-	m_commonBlock.upload();
+	uploadBlock(m_commonBlock);
+	m_shadowAtlas.rendered(index, light, m_frame);
 }
 
-void RenderDevice::renderShadow(Model& model, Transform& transform, BoneAnimation* animation)
+bool RenderDevice::beginShadowCache(uint64 casterHash)
 {
-	drawSetup(transform, animation);
+	ShadowCache& cache = m_shadowCaches[m_shadowCacheIndex];
+	// The pass matrices identify the light (and cascade placement)
+	const UniformCommonBlock& common = m_commonBlock.uniforms;
+	uint64 hash = id::hash64(&common.projectionMatrix, sizeof(common.projectionMatrix), casterHash);
+	hash = id::hash64(&common.viewMatrix, sizeof(common.viewMatrix), hash);
+	hash = id::hash64(&common.cameraPosition, sizeof(common.cameraPosition), hash);
+	stats.shadowMaps++;
+	cache.rebuilt = !shadowCaching || !cache.valid || cache.hash != hash;
+	if (!cache.rebuilt) {
+		stats.shadowCacheHits++;
+		return false;
+	}
+	cache.hash = hash;
+	cache.valid = shadowCaching;
+	bindShadowTarget(*m_shadowCacheTarget);
+	// Atlas tiles are cleared through the scissor, the viewports keep the draws inside them
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(m_shadowRect.x, m_shadowRect.y, m_shadowRect.z, m_shadowRect.w);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glDisable(GL_SCISSOR_TEST);
+	return true;
+}
 
-	Geometry& geom = *model.geometry;
+void RenderDevice::endShadowCache(bool dynamicCasters)
+{
+	ShadowCache& cache = m_shadowCaches[m_shadowCacheIndex];
+	if (cache.rebuilt || cache.dynamic || dynamicCasters) {
+		uint target = m_shadowTarget->layers ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+		glCopyImageSubData(m_shadowCacheTarget->tex[0], target, 0, m_shadowRect.x, m_shadowRect.y, m_shadowLayer,
+			m_shadowTarget->tex[0], target, 0, m_shadowRect.x, m_shadowRect.y, m_shadowLayer,
+			m_shadowRect.z, m_shadowRect.w, 1);
+	}
+	cache.dynamic = dynamicCasters;
+	bindShadowTarget(*m_shadowTarget);
+}
+
+void RenderDevice::bindShadowTarget(FBO& fbo)
+{
+	if (fbo.layers) fbo.bindLayer(m_shadowLayer);
+	else fbo.bind();
+}
+
+void RenderDevice::renderShadow(Model& model, Transform& transform, BoneAnimation* animation, Geometry* geometry)
+{
+	Geometry& geom = geometry ? *geometry : *model.geometry;
 	for (auto& batch : geom.batches) {
 
 		ASSERT(batch.materialIndex <= model.materials.size());
 		Material& mat = model.materials[batch.materialIndex];
 		if (!(mat.flags & Material::CAST_SHADOW))
 			continue;
+		if (mat.blockId < 0)
+			updateMaterialBlock(mat);
 
-		useProgram(m_shaders[mat.shaderId[m_tech]]);
-
-		if (mat.flags & Material::ALPHA_TEST) {
-			glActiveTexture(GL_TEXTURE0 + BINDING_DIFFUSE_MAP);
-			glBindTexture(GL_TEXTURE_2D, mat.tex[Material::DIFFUSE_MAP]);
-		}
-
-		drawBatch(batch);
+		queue(batch, mat, transform, model.bounds.radius, animation);
 	}
-	glBindVertexArray(0);
 }
 
 void RenderDevice::setupRenderPass(const Camera& camera, const std::vector<Light>& lights, Technique tech)
@@ -610,14 +1112,40 @@ void RenderDevice::setupRenderPass(const Camera& camera, const std::vector<Light
 	else if (m_msaaFbo.valid()) fbo = &m_msaaFbo;
 	else fbo = &m_fbo;
 	fbo->bind();
-	glViewport(0, 0, fbo->width, fbo->height);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	// The scene pass may use only part of its targets, see resolutionScale
+	uint width = fbo->width, height = fbo->height;
+	if (tech == TECH_COLOR) {
+		float scale = glm::clamp(resolutionScale, 0.1f, 1.f);
+		width = glm::max((uint)glm::ceil(width * scale), 1u);
+		height = glm::max((uint)glm::ceil(height * scale), 1u);
+		m_sceneScale = vec2((float)width / fbo->width, (float)height / fbo->height);
+		stats.resolutionScale = m_sceneScale.x;
+	}
+	glViewport(0, 0, width, height);
+	if (tech == TECH_REFLECTION && reflectionFaces != ALL_CUBE_FACES)
+		fbo->clearFaces(reflectionFaces);
+	else glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	glCullFace(GL_BACK);
 	m_tech = tech;
+	m_prepassDone = false;
+	m_deferredDone = false;
 	m_program = 0;
 	glUseProgram(0);
 	m_commonBlock.uniforms.projectionMatrix = camera.projection;
 	m_commonBlock.uniforms.viewMatrix = camera.view;
+	if (tech == TECH_COLOR) {
+		mat4 viewProj = camera.projection * camera.view;
+		m_reprojection = (m_historyValid ? m_prevViewProj : viewProj) * glm::inverse(viewProj);
+		m_prevViewProj = viewProj;
+		m_jitter = vec2(0.f);
+		if (temporalAA) {
+			// Sub-pixel offset from an 8 frame sequence, applied in NDC after projection
+			uint index = m_frame % 8 + 1;
+			vec2 ndcJitter = (vec2(halton(index, 2), halton(index, 3)) - 0.5f) * 2.f / vec2(width, height);
+			m_commonBlock.uniforms.projectionMatrix = glm::translate(mat4(), vec3(ndcJitter, 0.f)) * camera.projection;
+			m_jitter = ndcJitter * 0.5f * m_sceneScale;
+		}
+	}
 	m_commonBlock.uniforms.cameraPosition = camera.position();
 	m_commonBlock.uniforms.globalAmbient = m_env->ambient;
 	m_commonBlock.uniforms.shadowDarkness = m_env->shadowDarkness;
@@ -629,94 +1157,909 @@ void RenderDevice::setupRenderPass(const Camera& camera, const std::vector<Light
 	m_commonBlock.uniforms.fogDensity = m_env->fogDensity;
 	m_commonBlock.uniforms.near = camera.near;
 	m_commonBlock.uniforms.far = camera.far;
+	// Cube passes reflect the skybox only
+	m_commonBlock.uniforms.numProbes = tech == TECH_COLOR ? m_numProbes : 0;
+	m_commonBlock.uniforms.dynamicProbe = dynamicProbe;
+	m_commonBlock.uniforms.detailParams = vec4(detailQuality, width, height, 0.f);
 
-	uint numLights = std::min((int)lights.size(), MAX_LIGHTS);
+	uint numLights = std::min((int)lights.size(), MAX_CLUSTERED_LIGHTS);
 	m_commonBlock.uniforms.numLights = numLights;
 	stats.lights = numLights;
-	if (numLights) {
-		for (uint i = 0; i < numLights; i++) {
-			const Light& light = lights[i];
-			m_lightBlock.uniforms.lights[i].color = light.color;
-			m_lightBlock.uniforms.lights[i].position = light.position;
-			m_lightBlock.uniforms.lights[i].direction = light.direction;
-			m_lightBlock.uniforms.lights[i].params = vec4(light.distance, light.decay, 0.0f, 0.0f);
+	m_lightData.resize(glm::max(numLights, 1u));
+	for (uint i = 0; i < numLights; i++) {
+		const Light& light = lights[i];
+		UniformLightData& data = m_lightData[i];
+		data.color = light.color;
+		data.position = light.position;
+		data.direction = light.direction;
+		data.params = vec4(light.distance, light.decay, 0.0f, 0.0f);
+		data.shadowRect = vec4(0.f);
+		int slotIndex = m_shadowAtlas.lightSlot(i);
+		if (slotIndex >= 0 && m_shadowAtlas.slot(slotIndex).rendered) {
+			const ShadowAtlas::Slot& slot = m_shadowAtlas.slot(slotIndex);
+			float atlasSize = m_shadowAtlas.size();
+			data.shadowRect = vec4(slot.x / atlasSize, slot.y / atlasSize, slot.tileSize / atlasSize, slot.tileSize);
+			data.shadowOrigin = vec4(slot.origin, slot.far);
 		}
 	}
-	m_lightBlock.upload();
-	m_commonBlock.upload();
+	glBindBuffer(GL_TEXTURE_BUFFER, m_lightBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, m_lightData.size() * sizeof(UniformLightData), &m_lightData[0], GL_STREAM_DRAW);
+	bindTexture(BINDING_LIGHT_BUFFER, GL_TEXTURE_BUFFER, m_lightTexture);
+
+	// Cube map rendering just uses the first few lights
+	if (tech == TECH_COLOR) {
+		m_lightGrid.build(camera.view, camera.projection, camera.near, camera.far, numLights ? &lights[0] : nullptr, numLights);
+		const std::vector<uint>& grid = m_lightGrid.grid();
+		const std::vector<uint>& indices = m_lightGrid.indices();
+		glBindBuffer(GL_TEXTURE_BUFFER, m_clusterGridBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, grid.size() * sizeof(uint), &grid[0], GL_STREAM_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, m_clusterIndexBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, indices.size() * sizeof(uint), &indices[0], GL_STREAM_DRAW);
+		bindTexture(BINDING_CLUSTER_GRID, GL_TEXTURE_BUFFER, m_clusterGridTexture);
+		bindTexture(BINDING_CLUSTER_INDICES, GL_TEXTURE_BUFFER, m_clusterIndexTexture);
+		m_commonBlock.uniforms.clusterParams = vec4(
+			(float)CLUSTER_TILES_X / width, (float)CLUSTER_TILES_Y / height,
+			m_lightGrid.sliceScale(), m_lightGrid.sliceBias());
+		stats.lightAssignments = m_lightGrid.assignments();
+	}
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	uploadBlock(m_commonBlock);
 
 	if (tech == TECH_REFLECTION)
-		setupCubeMatrices(m_commonBlock.uniforms.projectionMatrix, camera.position());
+		setupCubeMatrices(m_commonBlock.uniforms.projectionMatrix, camera.position(), reflectionFaces);
+
+	if (m_probeArray)
+		bindTexture(BINDING_PROBE_ARRAY, GL_TEXTURE_CUBE_MAP_ARRAY, m_probeArray);
+
+	// Shaded samples of the scene pass, read from the other query to avoid a stall
+	if (tech == TECH_COLOR) {
+		if (m_sampleQueryActive)
+			glEndQuery(GL_SAMPLES_PASSED);
+		m_sampleQueryIndex ^= 1;
+		GLuint available = 0, samples = 0;
+		if (m_sampleQueryIssued[m_sampleQueryIndex])
+			glGetQueryObjectuiv(m_sampleQueries[m_sampleQueryIndex], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			glGetQueryObjectuiv(m_sampleQueries[m_sampleQueryIndex], GL_QUERY_RESULT, &samples);
+			m_overdraw = (float)samples / (width * height * glm::max(fbo->samples, 1u));
+		}
+		glBeginQuery(GL_SAMPLES_PASSED, m_sampleQueries[m_sampleQueryIndex]);
+		m_sampleQueryActive = true;
+		m_sampleQueryIssued[m_sampleQueryIndex] = true;
+	}
+	stats.overdraw = m_overdraw;
 
 	// Shadow map textures
-	for (uint i = 0; i < countof(m_shadowFbo); ++i) {
-		glActiveTexture(GL_TEXTURE0 + BINDING_SHADOW_MAP + i);
-		glBindTexture(m_shadowFbo[i].cube ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D, m_shadowFbo[i].tex[0]);
-	}
+	bindTexture(BINDING_SHADOW_MAP, GL_TEXTURE_2D_ARRAY, m_shadowFbo.tex[0]);
+	bindTexture(BINDING_SHADOW_ATLAS, GL_TEXTURE_2D, m_shadowAtlasFbo.tex[0]);
 
 	if (m_wireframe)
 		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 }
 
-void RenderDevice::render(Model& model, Transform& transform, BoneAnimation* animation)
+void RenderDevice::createProbeArray(uint count)
 {
-	m_objectBlock.uniforms.shadowMatrix = s_shadowBiasMatrix * (m_shadowProj[0] * (m_shadowView[0] * transform.matrix));
-	drawSetup(transform, animation);
+	ASSERT(count <= MAX_PROBES);
+	if (m_probeArray)
+		glDeleteTextures(1, &m_probeArray);
+	m_probeArray = 0;
+	m_numProbes = 0;
+	if (!count)
+		return;
+	uint size = m_reflectionFbo.width;
+	glGenTextures(1, &m_probeArray);
+	glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, m_probeArray);
+	glTexImage3D(GL_TEXTURE_CUBE_MAP_ARRAY, 0, GL_RGB16F, size, size, count * 6, 0, GL_RGB, GL_FLOAT, NULL);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, 0);
+	resetTextureCache();
+}
 
-	uint envTex = m_tech == TECH_COLOR ? m_reflectionFbo.tex[0] : m_skyboxMat.tex[Material::ENV_MAP];
-	glActiveTexture(GL_TEXTURE0 + BINDING_ENV_MAP);
-	glBindTexture(GL_TEXTURE_CUBE_MAP, envTex);
+void RenderDevice::storeProbe(uint index, vec3 position)
+{
+	ASSERT(m_probeArray && index < MAX_PROBES);
+	uint size = m_reflectionFbo.width;
+	glCopyImageSubData(m_reflectionFbo.tex[0], GL_TEXTURE_CUBE_MAP, 0, 0, 0, 0,
+		m_probeArray, GL_TEXTURE_CUBE_MAP_ARRAY, 0, 0, 0, index * 6, size, size, 6);
+	m_commonBlock.uniforms.probePositions[index] = vec4(position, 1.f);
+	m_numProbes = glm::max(m_numProbes, index + 1);
+}
 
-	Geometry& geom = *model.geometry;
+void RenderDevice::render(Model& model, Transform& transform, BoneAnimation* animation, Geometry* geometry, float lodFade)
+{
+	if (m_prepass && lodFade != 0.f)
+		return;
+	Geometry& geom = geometry ? *geometry : *model.geometry;
 	for (auto& batch : geom.batches) {
 
 		ASSERT(batch.materialIndex < model.materials.size());
 		Material& mat = model.materials[batch.materialIndex];
+		// The G-buffer pass takes what the lighting pass can shade, the forward pass after it the rest
+		if ((m_deferred || m_deferredDone) && canDefer(mat) != m_deferred)
+			continue;
+		if (m_deferred)
+			stats.deferredItems++;
 		ASSERT(mat.shaderId[m_tech] >= 0);
+		if (m_prepass) {
+			if (!canPrepass(mat))
+				continue;
+			stats.prepassItems++;
+		}
+		if (mat.blockId < 0)
+			updateMaterialBlock(mat);
+
+		queue(batch, mat, transform, model.bounds.radius, animation, lodFade);
+	}
+}
+
+void RenderDevice::beginDepthPrepass()
+{
+	ASSERT(m_tech == TECH_COLOR);
+	m_tech = TECH_DEPTH;
+	m_prepass = true;
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	// Depth only samples aren't shaded, the query restarts after the pre-pass
+	if (m_sampleQueryActive) {
+		glEndQuery(GL_SAMPLES_PASSED);
+		m_sampleQueryActive = false;
+	}
+}
+
+void RenderDevice::endDepthPrepass()
+{
+	ASSERT(m_prepass && m_queue.empty());
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	m_tech = TECH_COLOR;
+	m_prepass = false;
+	m_prepassDone = true;
+	if (m_sampleQueryIssued[m_sampleQueryIndex]) {
+		glBeginQuery(GL_SAMPLES_PASSED, m_sampleQueries[m_sampleQueryIndex]);
+		m_sampleQueryActive = true;
+	}
+}
+
+void RenderDevice::beginDeferred()
+{
+	ASSERT(m_tech == TECH_COLOR);
+	if (!m_gbufferFbo.valid()) {
+		m_gbufferFbo.numTextures = 5;
+		m_gbufferFbo.depthAttachment = 4;
+		m_gbufferFbo.external = true;
+		m_gbufferFbo.create();
+	}
+	// Only held until lighting, later targets of the same size and format reuse the textures
+	static const char* names[] = { "G-buffer albedo", "G-buffer normal", "G-buffer specular", "G-buffer unlit", "G-buffer depth" };
+	FrameGraph::TextureDesc desc;
+	desc.width = m_fbo.width;
+	desc.height = m_fbo.height;
+	m_gbufferFbo.width = m_fbo.width;
+	m_gbufferFbo.height = m_fbo.height;
+	for (uint i = 0; i < m_gbufferFbo.numTextures; ++i) {
+		desc.format = i == m_gbufferFbo.depthAttachment ? GL_DEPTH_COMPONENT32F : GL_RGBA16F;
+		m_gbuffer[i] = m_frameGraph.acquireTexture(names[i], desc);
+		m_gbufferFbo.attach(i, m_frameGraph.texture(m_gbuffer[i]));
+	}
+	m_gbufferFbo.bind();
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	m_tech = TECH_GBUFFER;
+	m_deferred = true;
+}
+
+void RenderDevice::endDeferred()
+{
+	ASSERT(m_deferred && m_queue.empty());
+	// The G-buffer is single sampled, so lighting and the forward leftovers skip the MSAA target
+	m_fbo.bind();
+	glClear(GL_COLOR_BUFFER_BIT);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, m_gbufferFbo.fbo);
+	glBlitFramebuffer(0, 0, m_gbufferFbo.width, m_gbufferFbo.height, 0, 0, m_fbo.width, m_fbo.height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+	m_fbo.bind();
+
+	// Clustered lights are looked up per pixel like in the forward shader
+	int shaderId = generateShader(USE_DEFERRED_LIGHTING | USE_FOG | USE_DIFFUSE | USE_SPECULAR | USE_SHADOW_MAP);
+	if (shaderId >= 0) {
+		useProgram(m_shaders[shaderId]);
+		for (uint i = 0; i < m_gbufferFbo.numTextures; ++i)
+			bindTexture(BINDING_GBUFFER_START + i, GL_TEXTURE_2D, m_gbufferFbo.tex[i]);
+		if (m_wireframe)
+			glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+		glDisable(GL_DEPTH_TEST);
+		renderFullscreenQuad();
+		glEnable(GL_DEPTH_TEST);
+		if (m_wireframe)
+			glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+	}
+	for (uint i = 0; i < m_gbufferFbo.numTextures; ++i)
+		m_frameGraph.releaseTexture(m_gbuffer[i]);
+	m_tech = TECH_COLOR;
+	m_deferred = false;
+	m_deferredDone = true;
+}
+
+// Alpha tested and tessellated materials, and custom shaders, have no G-buffer variant
+bool RenderDevice::canDefer(const Material& material) const
+{
+	return material.shaderName.empty() && !(material.flags & (Material::TESSELLATE | Material::ALPHA_TEST));
+}
+
+// Depth has to come out bit exact in both passes, tessellation and custom shaders may move vertices
+bool RenderDevice::canPrepass(const Material& material) const
+{
+	return material.shaderName.empty() && !(material.flags & Material::TESSELLATE);
+}
 
-		useProgram(m_shaders[mat.shaderId[m_tech]]);
+void RenderDevice::queue(const Batch& batch, const Material& material, const Transform& transform, float radius, const BoneAnimation* animation, float lodFade)
+{
+	ASSERT(material.shaderId[m_tech] >= 0);
+	bool depthOnly = m_tech == TECH_DEPTH || m_tech == TECH_DEPTH_CUBE;
+	ASSERT(material.blockId >= 0);
+	uint64 blockId = 0, texHash = 0;
+	if (!depthOnly || (material.flags & Material::ALPHA_TEST)) {
+		blockId = material.blockId;
+		texHash = id::hash64(material.tex, sizeof(uint) * Material::ENV_MAP);
+	}
+	// Front to back, quantized to 16 bits over the view range
+	float far = glm::max(m_commonBlock.uniforms.far, 0.001f);
+	float dist = glm::distance(m_commonBlock.uniforms.cameraPosition, transform.position);
+	uint64 depth = (uint64)(glm::clamp(dist / far, 0.f, 1.f) * 65535.f);
+
+	RenderItem item;
+	// pass:4 | shader:12 | material:12 | textures:12 | meshbuffer:4 | mesh:8 | depth:12
+	// Mesh comes before depth to keep instancing candidates next to each other
+	item.key = ((uint64)(m_tech & 0xf) << 60)
+		| ((uint64)(material.shaderId[m_tech] & 0xfff) << 48)
+		| ((blockId & 0xfff) << 36)
+		| (((texHash ^ (texHash >> 32)) & 0xfff) << 24)
+		| ((uint64)(m_batches[batch.renderId].meshBuffer & 0xf) << 20)
+		| ((uint64)(batch.renderId & 0xff) << 12)
+		| (depth >> 4);
+	item.batch = &batch;
+	item.material = &material;
+	item.modelMatrix = transform.matrix;
+	item.radius = radius;
+	item.animation = animation;
+	item.lodFade = lodFade;
+	m_queue.push_back(item);
+}
 
-		m_materialBlock.uniforms.ambient = mat.ambient;
-		m_materialBlock.uniforms.diffuse = mat.diffuse;
-		m_materialBlock.uniforms.specular = mat.specular;
-		m_materialBlock.uniforms.shininess = mat.shininess;
-		m_materialBlock.uniforms.reflectivity = mat.reflectivity;
-		m_materialBlock.uniforms.parallax = mat.parallax;
-		m_materialBlock.uniforms.emissive = mat.emissive;
-		m_materialBlock.uniforms.uvOffset = mat.uvOffset;
-		m_materialBlock.uniforms.uvRepeat = mat.uvRepeat;
-		m_materialBlock.upload();
+// LSD radix sort of the queue keys, 8 bits per pass
+void RenderDevice::sortQueue()
+{
+	uint count = m_queue.size();
+	m_sortItems.resize(count);
+	m_sortTemp.resize(count);
+	for (uint i = 0; i < count; ++i)
+		m_sortItems[i] = SortItem{ m_queue[i].key, i };
+
+	for (uint shift = 0; shift < 64; shift += 8) {
+		uint histogram[256] = {};
+		for (auto& it : m_sortItems)
+			histogram[(it.key >> shift) & 0xff]++;
+		// Skip digits that are the same for every item
+		if (histogram[(m_sortItems[0].key >> shift) & 0xff] == count)
+			continue;
+		uint offset = 0;
+		for (uint i = 0; i < 256; ++i) {
+			uint n = histogram[i];
+			histogram[i] = offset;
+			offset += n;
+		}
+		for (auto& it : m_sortItems)
+			m_sortTemp[histogram[(it.key >> shift) & 0xff]++] = it;
+		m_sortItems.swap(m_sortTemp);
+	}
+}
 
-		for (uint i = 0; i < Material::ENV_MAP; ++i) {
-			uint tex = mat.tex[i];
-			if (!tex) continue;
-			glActiveTexture(GL_TEXTURE0 + BINDING_MATERIAL_MAP_START + i);
-			glBindTexture(GL_TEXTURE_2D, tex);
-			//glUniform1i(i, i);
+void RenderDevice::flush()
+{
+	if (m_queue.empty())
+		return;
+	sortQueue();
+
+	// Consecutive items with the same material and mesh buffer are drawn with one
+	// multi-draw, one indirect command per mesh with its instances
+	m_runs.clear();
+	m_instanceMatrices.clear();
+	m_instanceFaces.clear();
+	m_drawCommands.clear();
+	// Cube passes without a geometry shader: every instance is repeated for each face it touches
+	bool layered = layeredCubes && caps.vertexLayer && (m_tech == TECH_DEPTH_CUBE || m_tech == TECH_REFLECTION);
+	// With a depth pre-pass everything instanceable goes through the instanced shaders in both
+	// passes, so each object's vertices are transformed the same way for the GL_EQUAL test
+	bool matchPrepass = m_prepass || m_prepassDone;
+	for (uint i = 0; i < m_sortItems.size(); ) {
+		const RenderItem& item = m_queue[m_sortItems[i].index];
+		uint end = i + 1;
+		int shaderId = -1;
+		if ((instancing || layered || matchPrepass) && canInstance(item)) {
+			while (instancing && end < m_sortItems.size() && sameState(item, m_queue[m_sortItems[end].index]))
+				++end;
+			if (layered)
+				shaderId = layeredShader(item.material->shaderId[m_tech]);
+			else if (end - i >= MIN_INSTANCES || matchPrepass)
+				shaderId = instancedShader(item.material->shaderId[m_tech]);
+			if (shaderId < 0)
+				end = i + 1;
 		}
+		DrawRun run = { i, end - i, (uint)m_drawCommands.size(), 0, shaderId };
+		if (shaderId >= 0) {
+			for (uint j = i; j < end; ) {
+				const Batch* batch = m_queue[m_sortItems[j].index].batch;
+				uint baseInstance = m_instanceMatrices.size();
+				for (; j < end && m_queue[m_sortItems[j].index].batch == batch; ++j) {
+					const RenderItem& instance = m_queue[m_sortItems[j].index];
+					if (!layered) {
+						m_instanceMatrices.push_back(instance.modelMatrix);
+						continue;
+					}
+					uint mask = cubeFaceMask(vec3(instance.modelMatrix[3]), instance.radius) & m_cubeMatrixBlock.uniforms.cubeFaceMask;
+					for (uint face = 0; face < 6; ++face) {
+						if (!(mask & (1 << face))) {
+							stats.culledCubeFaces++;
+							continue;
+						}
+						m_instanceMatrices.push_back(instance.modelMatrix);
+						m_instanceFaces.push_back(face);
+					}
+				}
+				uint instanceCount = m_instanceMatrices.size() - baseInstance;
+				if (instanceCount) {
+					m_drawCommands.push_back(drawCommand(*batch, instanceCount, baseInstance));
+					run.numCommands++;
+				}
+			}
+		}
+		m_runs.push_back(run);
+		i = end;
+	}
+	if (!m_instanceMatrices.empty()) {
+		glBindBuffer(GL_ARRAY_BUFFER, m_instanceMatrixBuffer);
+		glBufferData(GL_ARRAY_BUFFER, m_instanceMatrices.size() * sizeof(mat4), &m_instanceMatrices[0], GL_STREAM_DRAW);
+		if (!m_instanceFaces.empty()) {
+			glBindBuffer(GL_ARRAY_BUFFER, m_instanceFaceBuffer);
+			glBufferData(GL_ARRAY_BUFFER, m_instanceFaces.size() * sizeof(uint), &m_instanceFaces[0], GL_STREAM_DRAW);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_drawCommandBuffer);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, m_drawCommands.size() * sizeof(DrawCommand), &m_drawCommands[0], GL_STREAM_DRAW);
+	}
+
+	bool depthOnly = m_tech == TECH_DEPTH || m_tech == TECH_DEPTH_CUBE;
+	if (!depthOnly) {
+		uint envTex = m_tech == TECH_REFLECTION ? m_skyboxMat.tex[Material::ENV_MAP] : m_reflectionFbo.tex[0];
+		bindTexture(BINDING_ENV_MAP, GL_TEXTURE_CUBE_MAP, envTex);
+	}
+
+	m_vao = 0;
+	bool equalDepth = false;
+	for (auto& run : m_runs) {
+		if (run.shaderId >= 0 && !run.numCommands)
+			continue; // Every face culled
+		const RenderItem& item = m_queue[m_sortItems[run.start].index];
+		const Material& mat = *item.material;
+
+		// Fading LODs weren't in the pre-pass
+		if (m_prepassDone && (canPrepass(mat) && item.lodFade == 0.f) != equalDepth) {
+			equalDepth = !equalDepth;
+			glDepthFunc(equalDepth ? GL_EQUAL : GL_LESS);
+			glDepthMask(equalDepth ? GL_FALSE : GL_TRUE);
+		}
+
+		if (run.shaderId >= 0) {
+			useProgram(m_shaders[run.shaderId]);
+		} else {
+			drawSetup(item.modelMatrix, item.animation, item.lodFade);
+			int shaderId = item.lodFade != 0.f ? fadeShader(mat.shaderId[m_tech]) : -1;
+			useProgram(m_shaders[shaderId >= 0 ? shaderId : mat.shaderId[m_tech]]);
+		}
+
+		if (!depthOnly || (mat.flags & Material::ALPHA_TEST)) {
+			bindMaterialBlock(mat.blockId);
+			uint numMaps = depthOnly ? Material::DIFFUSE_MAP + 1 : Material::ENV_MAP;
+			for (uint i = 0; i < numMaps; ++i) {
+				if (mat.tex[i])
+					bindTexture(BINDING_MATERIAL_MAP_START + i, GL_TEXTURE_2D, mat.tex[i]);
+			}
+		}
+
+		if (run.shaderId >= 0) {
+			drawIndirect(*item.batch, run.firstCommand, run.numCommands);
+			for (uint i = run.firstCommand; i < run.firstCommand + run.numCommands; ++i)
+				stats.triangles += m_drawCommands[i].count / 3 * m_drawCommands[i].instanceCount;
+			stats.instances += run.count;
+		} else drawBatch(*item.batch, m_tech == TECH_COLOR && (mat.flags & Material::TESSELLATE));
+	}
+	if (equalDepth) {
+		glDepthFunc(GL_LESS);
+		glDepthMask(GL_TRUE);
+	}
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	glBindVertexArray(0);
+	m_vao = 0;
+	m_queue.clear();
+}
+
+bool RenderDevice::canInstance(const RenderItem& item) const
+{
+	if (item.animation && !item.animation->bones.empty())
+		return false;
+	if (item.lodFade != 0.f)
+		return false;
+	return !(m_tech == TECH_COLOR && (item.material->flags & Material::TESSELLATE));
+}
+
+bool RenderDevice::sameState(const RenderItem& a, const RenderItem& b) const
+{
+	if (!canInstance(b))
+		return false;
+	if (a.batch != b.batch) {
+		// Different meshes can share a multi-draw if they live in the same buffers
+		const GPUBatch& ga = m_batches[a.batch->renderId];
+		const GPUBatch& gb = m_batches[b.batch->renderId];
+		if (ga.meshBuffer != gb.meshBuffer || !ga.alloc.numIndices != !gb.alloc.numIndices)
+			return false;
+	}
+	if (a.material == b.material)
+		return true;
+	const Material& ma = *a.material;
+	const Material& mb = *b.material;
+	if (ma.shaderId[m_tech] != mb.shaderId[m_tech] || ma.flags != mb.flags || ma.blockId != mb.blockId)
+		return false;
+	return !memcmp(ma.tex, mb.tex, sizeof(uint) * Material::ENV_MAP);
+}
+
+RenderDevice::DrawCommand RenderDevice::drawCommand(const Batch& batch, uint instanceCount, uint baseInstance) const
+{
+	const MeshBuffer::Allocation& alloc = m_batches[batch.renderId].alloc;
+	if (alloc.numIndices)
+		return { alloc.numIndices, instanceCount, alloc.firstIndex, alloc.baseVertex, baseInstance };
+	return { alloc.numVertices, instanceCount, alloc.baseVertex, baseInstance, 0 };
+}
 
-		drawBatch(batch, m_tech == TECH_COLOR && (mat.flags & Material::TESSELLATE));
+bool RenderDevice::addCulledInstance(const Model& model, const Transform& transform)
+{
+	if (m_tech != TECH_COLOR)
+		return false;
+	const Geometry& geom = *model.geometry;
+	for (auto& batch : geom.batches) {
+		const Material& mat = model.materials[batch.materialIndex];
+		if (batch.renderId < 0 || (mat.flags & (Material::TESSELLATE | Material::ANIMATED)))
+			return false;
+		if (instancedShader(mat.shaderId[TECH_COLOR]) < 0)
+			return false;
 	}
+
+	for (auto& batch : geom.batches) {
+		const Material& mat = model.materials[batch.materialIndex];
+		CullGroup group;
+		group.batch = &batch;
+		group.shaderId = instancedShader(mat.shaderId[TECH_COLOR]);
+		for (uint i = 0; i < Material::ENV_MAP; ++i)
+			group.tex[i] = mat.tex[i];
+		group.blockId = mat.blockId;
+		// Instances with identical mesh and material share a draw command
+		const GPUBatch& gpuBatch = m_batches[batch.renderId];
+		uint indexed = gpuBatch.alloc.numIndices > 0;
+		group.stateKey = id::hash64(&gpuBatch.meshBuffer, sizeof(gpuBatch.meshBuffer));
+		group.stateKey = id::hash64(&indexed, sizeof(indexed), group.stateKey);
+		group.stateKey = id::hash64(&group.shaderId, sizeof(group.shaderId), group.stateKey);
+		group.stateKey = id::hash64(group.tex, sizeof(group.tex), group.stateKey);
+		group.stateKey = id::hash64(&group.blockId, sizeof(group.blockId), group.stateKey);
+		uint64 key = id::hash64(&batch.renderId, sizeof(batch.renderId), group.stateKey);
+		auto it = m_cullGroupIndex.find(key);
+		uint groupIndex;
+		if (it == m_cullGroupIndex.end()) {
+			groupIndex = m_cullGroups.size();
+			group.count = 0;
+			group.first = 0;
+			m_cullGroups.push_back(group);
+			m_cullGroupIndex[key] = groupIndex;
+		} else groupIndex = it->second;
+		m_cullGroups[groupIndex].count++;
+
+		CullInstance inst;
+		inst.modelMatrix = transform.matrix;
+		inst.boundsMin = vec4(geom.bounds.min, 1.f);
+		inst.boundsMax = vec4(geom.bounds.max, 1.f);
+		inst.info = glm::uvec4(groupIndex, 0, 0, 0);
+		m_cullInstances.push_back(inst);
+	}
+	return true;
+}
+
+void RenderDevice::renderCulledInstances(bool hiz)
+{
+	m_hizRequested = hiz;
+	auto cullIt = m_shaderNames.find($id(cull));
+	if (m_cullInstances.empty() || cullIt == m_shaderNames.end()) {
+		m_cullInstances.clear();
+		m_cullGroups.clear();
+		m_cullGroupIndex.clear();
+		return;
+	}
+
+	// Order the groups so that ones differing only by mesh are adjacent
+	std::vector<uint> order(m_cullGroups.size());
+	for (uint i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [this](uint a, uint b) {
+		return m_cullGroups[a].stateKey < m_cullGroups[b].stateKey;
+	});
+	std::vector<CullGroup> groups(m_cullGroups.size());
+	std::vector<uint> remap(m_cullGroups.size());
+	for (uint i = 0; i < order.size(); ++i) {
+		groups[i] = m_cullGroups[order[i]];
+		remap[order[i]] = i;
+	}
+	m_cullGroups.swap(groups);
+
+	// Reserve output ranges and set up the commands with zero instances
+	std::vector<DrawCommand> commands(m_cullGroups.size());
+	uint first = 0;
+	for (uint i = 0; i < m_cullGroups.size(); ++i) {
+		CullGroup& group = m_cullGroups[i];
+		commands[i] = drawCommand(*group.batch, 0, first);
+		group.first = first;
+		first += group.count;
+	}
+	for (auto& inst : m_cullInstances) {
+		inst.info.x = remap[inst.info.x];
+		inst.info.y = m_cullGroups[inst.info.x].first;
+	}
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_cullInstanceBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, m_cullInstances.size() * sizeof(CullInstance), &m_cullInstances[0], GL_STREAM_DRAW);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BINDING_CULL_INSTANCES, m_cullInstanceBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_cullCommandBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, commands.size() * sizeof(DrawCommand), &commands[0], GL_STREAM_DRAW);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BINDING_CULL_COMMANDS, m_cullCommandBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_instanceMatrixBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, first * sizeof(mat4), NULL, GL_STREAM_DRAW);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BINDING_CULL_MATRICES, m_instanceMatrixBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	// Cull
+	m_cullViewProj = m_commonBlock.uniforms.projectionMatrix * m_commonBlock.uniforms.viewMatrix;
+	bool useHiz = hiz && m_hizValid;
+	const ShaderProgram& cull = m_shaders[cullIt->second];
+	useProgram(cull);
+	glUniformMatrix4fv(0, 1, GL_FALSE, &m_cullViewProj[0][0]);
+	glUniformMatrix4fv(1, 1, GL_FALSE, &m_hizViewProj[0][0]);
+	glUniform1ui(2, m_cullInstances.size());
+	glUniform1i(3, useHiz);
+	if (useHiz)
+		bindTexture(BINDING_HIZ_MAP, GL_TEXTURE_2D, m_hizTexture);
+	cull.compute((m_cullInstances.size() + 63) / 64, 1, 1);
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+
+	// Draw
+	bindTexture(BINDING_ENV_MAP, GL_TEXTURE_CUBE_MAP, m_reflectionFbo.tex[0]);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_cullCommandBuffer);
+	m_vao = 0;
+	for (uint i = 0; i < m_cullGroups.size(); ) {
+		const CullGroup& group = m_cullGroups[i];
+		uint end = i + 1;
+		while (end < m_cullGroups.size() && m_cullGroups[end].stateKey == group.stateKey)
+			++end;
+		useProgram(m_shaders[group.shaderId]);
+		bindMaterialBlock(group.blockId);
+		for (uint j = 0; j < Material::ENV_MAP; ++j) {
+			if (group.tex[j])
+				bindTexture(BINDING_MATERIAL_MAP_START + j, GL_TEXTURE_2D, group.tex[j]);
+		}
+		drawIndirect(*group.batch, i, end - i);
+		i = end;
+	}
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
 	glBindVertexArray(0);
+	m_vao = 0;
+	stats.gpuInstances += m_cullInstances.size();
+
+	m_cullInstances.clear();
+	m_cullGroups.clear();
+	m_cullGroupIndex.clear();
 }
 
+RenderDevice::ImpostorKey RenderDevice::impostorKey(const Model& model) const
+{
+	const Geometry* geometry = model.numLods() ? model.lods[0].geometry : model.geometry;
+	uint64 hash = 0;
+	if (geometry) {
+		hash = id::hash64(nullptr, 0);
+		for (auto& batch : geometry->batches) {
+			// Contents rather than the block slot, which moves whenever constants are edited
+			const Material& mat = model.materials[batch.materialIndex];
+			UniformMaterialBlock block = UniformMaterialBlock();
+			fillMaterialBlock(block, mat);
+			hash = id::hash64(&mat.shaderId[TECH_COLOR], sizeof(int), hash);
+			hash = id::hash64(&block, sizeof(block), hash);
+			hash = id::hash64(mat.tex, Material::ENV_MAP * sizeof(uint), hash);
+		}
+	}
+	return ImpostorKey(geometry, hash);
+}
+
+bool RenderDevice::bakeImpostor(const Model& model)
+{
+	ImpostorKey key = impostorKey(model);
+	const Geometry* geometry = key.first;
+	if (!geometry)
+		return false;
+	auto found = m_impostors.find(key);
+	if (found != m_impostors.end()) {
+		found->second.lastUsed = m_frame;
+		return found->second.atlas.valid();
+	}
+
+	// Not ready yet, try again on a later frame
+	for (auto& batch : geometry->batches) {
+		if (batch.renderId < 0)
+			return false;
+		const Material& mat = model.materials[batch.materialIndex];
+		if (mat.shaderId[TECH_COLOR] < 0 || mat.blockId < 0)
+			return false;
+		for (uint i = 0; i < Material::ENV_MAP; ++i)
+			if (mat.tex[i] == m_placeholderTex.id)
+				return false;
+	}
+
+	// Failures are remembered with an invalid atlas. The G-buffer variant of the color shader
+	// is used even for alpha tested materials, tessellation is left out.
+	Impostor& impostor = m_impostors[key];
+	impostor.lastUsed = m_frame;
+	std::vector<int> shaderIds;
+	for (auto& batch : geometry->batches) {
+		int shaderId = model.materials[batch.materialIndex].shaderId[TECH_COLOR];
+		uint tags = 0;
+		bool generated = false;
+		for (auto& tagIt : m_shaderTags) {
+			if (tagIt.second == shaderId) {
+				tags = (tagIt.first & ~(USE_TESSELLATION | USE_SHADOW_MAP)) | USE_GBUFFER;
+				generated = true;
+				break;
+			}
+		}
+		if (!generated)
+			return false;
+		shaderIds.push_back(generateShader(tags));
+		if (m_shaderTags.find(tags) == m_shaderTags.end())
+			return false;
+	}
+	const Bounds& bounds = geometry->bounds;
+	float radius = glm::length(bounds.max - bounds.min) * 0.5f;
+	if (!(radius > 0.f && radius < INFINITY)) // Also NaN from unset bounds
+		return false;
+	vec3 center = (bounds.min + bounds.max) * 0.5f;
+	impostor.bounds = vec4(center, radius);
+
+	FBO& atlas = impostor.atlas;
+	atlas.width = IMPOSTOR_TILE_SIZE * IMPOSTOR_VIEWS_AROUND;
+	atlas.height = IMPOSTOR_TILE_SIZE * IMPOSTOR_VIEW_ELEVATIONS;
+	atlas.numTextures = 5;
+	atlas.depthAttachment = 4;
+	atlas.alpha = true;
+	atlas.create();
+	atlas.bind();
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	if (m_wireframe)
+		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+	glCullFace(GL_BACK);
+
+	// Views are rendered in object space, the shader picks them with the same angles
+	UniformCommonBlock common = m_commonBlock.uniforms;
+	m_commonBlock.uniforms.projectionMatrix = glm::ortho(-radius, radius, -radius, radius, radius, 3.f * radius);
+	m_commonBlock.uniforms.numProbes = 0;
+	m_commonBlock.uniforms.dynamicProbe = vec4(0.f, 0.f, 0.f, FLT_MAX);
+	Technique tech = m_tech;
+	m_tech = TECH_GBUFFER;
+	m_program = 0;
+	m_vao = 0;
+	if (m_skyboxMat.tex[Material::ENV_MAP])
+		bindTexture(BINDING_ENV_MAP, GL_TEXTURE_CUBE_MAP, m_skyboxMat.tex[Material::ENV_MAP]);
+	for (uint elevation = 0; elevation < IMPOSTOR_VIEW_ELEVATIONS; ++elevation) {
+		for (uint around = 0; around < IMPOSTOR_VIEWS_AROUND; ++around) {
+			float yaw = around * glm::two_pi<float>() / IMPOSTOR_VIEWS_AROUND;
+			float pitch = elevation * glm::half_pi<float>() / IMPOSTOR_VIEW_ELEVATIONS;
+			vec3 dir(glm::cos(pitch) * glm::cos(yaw), glm::sin(pitch), glm::cos(pitch) * glm::sin(yaw));
+			vec3 eye = center + dir * 2.f * radius;
+			m_commonBlock.uniforms.viewMatrix = glm::lookAt(eye, center, vec3(0, 1, 0));
+			m_commonBlock.uniforms.cameraPosition = eye;
+			uploadBlock(m_commonBlock);
+			glViewport(around * IMPOSTOR_TILE_SIZE, elevation * IMPOSTOR_TILE_SIZE, IMPOSTOR_TILE_SIZE, IMPOSTOR_TILE_SIZE);
+			for (uint i = 0; i < geometry->batches.size(); ++i) {
+				const Batch& batch = geometry->batches[i];
+				const Material& mat = model.materials[batch.materialIndex];
+				drawSetup(mat4());
+				useProgram(m_shaders[shaderIds[i]]);
+				bindMaterialBlock(mat.blockId);
+				for (uint j = 0; j < Material::ENV_MAP; ++j) {
+					if (mat.tex[j])
+						bindTexture(BINDING_MATERIAL_MAP_START + j, GL_TEXTURE_2D, mat.tex[j]);
+				}
+				drawBatch(batch);
+			}
+		}
+	}
+	glBindVertexArray(0);
+	m_vao = 0;
+	m_tech = tech;
+	m_commonBlock.uniforms = common;
+	uploadBlock(m_commonBlock);
+	if (m_wireframe)
+		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	return true;
+}
+
+bool RenderDevice::addImpostor(const Model& model, const Transform& transform)
+{
+	auto it = m_impostors.find(impostorKey(model));
+	if (it == m_impostors.end() || !it->second.atlas.valid())
+		return false;
+	it->second.instances.push_back(transform.matrix);
+	return true;
+}
+
+void RenderDevice::renderImpostors()
+{
+	auto shaderIt = m_deferred ? m_shaderNames.find($id(impostor_gbuffer)) : m_shaderNames.find($id(impostor));
+	if (shaderIt == m_shaderNames.end())
+		return;
+	if (!m_impostorQuad.vao) {
+		glGenVertexArrays(1, &m_impostorQuad.vao);
+		glGenBuffers(1, &m_impostorQuad.vbo);
+		glBindVertexArray(m_impostorQuad.vao);
+		glBindBuffer(GL_ARRAY_BUFFER, m_impostorQuad.vbo);
+		for (uint i = 0; i < 4; ++i) {
+			glEnableVertexAttribArray(ATTR_INSTANCE_MATRIX + i);
+			glVertexAttribPointer(ATTR_INSTANCE_MATRIX + i, 4, GL_FLOAT, GL_FALSE, sizeof(mat4), (GLvoid*)(i * sizeof(vec4)));
+			glVertexAttribDivisor(ATTR_INSTANCE_MATRIX + i, 1);
+		}
+	}
+
+	// All instances in one buffer, each baked model draws its range
+	m_instanceMatrices.clear();
+	for (auto& it : m_impostors)
+		m_instanceMatrices.insert(m_instanceMatrices.end(), it.second.instances.begin(), it.second.instances.end());
+	if (m_instanceMatrices.empty())
+		return;
+	glBindBuffer(GL_ARRAY_BUFFER, m_impostorQuad.vbo);
+	glBufferData(GL_ARRAY_BUFFER, m_instanceMatrices.size() * sizeof(mat4), &m_instanceMatrices[0], GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	useProgram(m_shaders[shaderIt->second]);
+	glBindVertexArray(m_impostorQuad.vao);
+	m_vao = 0;
+	uint baseInstance = 0;
+	for (auto& it : m_impostors) {
+		Impostor& impostor = it.second;
+		uint count = impostor.instances.size();
+		if (!count)
+			continue;
+		glUniform4fv(0, 1, &impostor.bounds[0]);
+		for (uint i = 0; i < impostor.atlas.numTextures; ++i)
+			bindTexture(BINDING_GBUFFER_START + i, GL_TEXTURE_2D, impostor.atlas.tex[i]);
+		glDrawArraysInstancedBaseInstance(GL_TRIANGLE_STRIP, 0, 4, count, baseInstance);
+		baseInstance += count;
+		impostor.instances.clear();
+		++stats.drawCalls;
+		stats.triangles += 2 * count;
+		stats.impostors += count;
+	}
+	glBindVertexArray(0);
+}
+
+void RenderDevice::buildHiZ()
+{
+	auto it = m_shaderNames.find($id(hiz));
+	if (it == m_shaderNames.end())
+		return;
+	if (!m_hizTexture) {
+		m_hizLevels = 1 + (uint)glm::log2((float)glm::max(m_fbo.width, m_fbo.height));
+		glGenTextures(1, &m_hizTexture);
+		glBindTexture(GL_TEXTURE_2D, m_hizTexture);
+		glTexStorage2D(GL_TEXTURE_2D, m_hizLevels, GL_R32F, m_fbo.width, m_fbo.height);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	}
+	const ShaderProgram& program = m_shaders[it->second];
+	useProgram(program);
+	glActiveTexture(GL_TEXTURE0 + BINDING_HIZ_MAP);
+	uint w = m_fbo.width, h = m_fbo.height;
+	for (uint level = 0; level < m_hizLevels; ++level) {
+		// First level is a copy of the resolved depth buffer
+		glBindTexture(GL_TEXTURE_2D, level == 0 ? m_fbo.tex[m_fbo.depthAttachment] : m_hizTexture);
+		glUniform1i(0, (int)level - 1);
+		glBindImageTexture(0, m_hizTexture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+		program.compute((w + 7) / 8, (h + 7) / 8, 1);
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+		w = glm::max(w / 2, 1u);
+		h = glm::max(h / 2, 1u);
+	}
+	// Only the rendered part of the depth buffer is valid, the rest is cleared to far
+	m_hizViewProj = glm::translate(mat4(), vec3(m_sceneScale - 1.f, 0.f))
+		* glm::scale(mat4(), vec3(m_sceneScale, 1.f)) * m_cullViewProj;
+	m_hizValid = true;
+}
+
+// The bright target is filtered down a half resolution mip chain and added back up level by
+// level, so the blur radius grows with the chain while each step stays cheap
+void RenderDevice::buildBloom(uint texture, const FrameGraph::TextureDesc& desc)
+{
+	auto down = m_shaderNames.find($id(bloom_down));
+	auto up = m_shaderNames.find($id(bloom_up));
+	if (down == m_shaderNames.end() || up == m_shaderNames.end())
+		return;
+	const ShaderProgram& downsample = m_shaders[down->second];
+	const ShaderProgram& upsample = m_shaders[up->second];
+	uint width = desc.width, height = desc.height;
+	glActiveTexture(GL_TEXTURE0 + BINDING_BLOOM_MAP);
+	useProgram(downsample);
+	for (uint level = 0; level < desc.levels; ++level) {
+		// First level comes from the full resolution bright target
+		glBindTexture(GL_TEXTURE_2D, level == 0 ? m_fbo.tex[1] : texture);
+		glUniform1i(0, level == 0 ? 0 : (int)level - 1);
+		glUniform2f(1, level == 0 ? m_sceneScale.x : 1.f, level == 0 ? m_sceneScale.y : 1.f);
+		glBindImageTexture(0, texture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA16F);
+		uint w = glm::max(width >> level, 1u), h = glm::max(height >> level, 1u);
+		downsample.compute((w + 7) / 8, (h + 7) / 8, 1);
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+	}
+	useProgram(upsample);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glUniform2f(1, 1.f, 1.f);
+	for (int level = (int)desc.levels - 2; level >= 0; --level) {
+		glUniform1i(0, level + 1);
+		glBindImageTexture(0, texture, level, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA16F);
+		uint w = glm::max(width >> level, 1u), h = glm::max(height >> level, 1u);
+		upsample.compute((w + 7) / 8, (h + 7) / 8, 1);
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+	}
+}
 
 void RenderDevice::drawBatch(const Batch& batch, bool tessellate)
 {
 	ASSERT(batch.renderId >= 0);
-	GPUGeometry& gpuData = m_geometries[batch.renderId];
-	glBindVertexArray(gpuData.vao);
+	const GPUBatch& gpuBatch = m_batches[batch.renderId];
+	const MeshBuffer::Allocation& alloc = gpuBatch.alloc;
+	uint vao = m_meshBuffers[gpuBatch.meshBuffer].vao;
+	if (m_vao != vao) {
+		m_vao = vao;
+		glBindVertexArray(m_vao);
+	} else ++stats.avoided.vaos;
 	uint mode = tessellate ? GL_PATCHES : GL_TRIANGLES;
-	if (gpuData.ebo) {
-		glDrawElements(mode, batch.indices.size(), GL_UNSIGNED_INT, 0);
-		stats.triangles += batch.indices.size() / 3;
+	if (alloc.numIndices) {
+		glDrawElementsBaseVertex(mode, alloc.numIndices, GL_UNSIGNED_INT, (GLvoid*)(uintptr_t)(alloc.firstIndex * sizeof(uint)), alloc.baseVertex);
+		stats.triangles += alloc.numIndices / 3;
 	} else {
-		glDrawArrays(mode, 0, batch.numVertices);
-		stats.triangles += batch.numVertices / 3;
+		glDrawArrays(mode, alloc.baseVertex, alloc.numVertices);
+		stats.triangles += alloc.numVertices / 3;
 	}
 	++stats.drawCalls;
 }
 
+// Commands must be in the bound GL_DRAW_INDIRECT_BUFFER and use the same mesh buffer as the batch
+void RenderDevice::drawIndirect(const Batch& batch, uint firstCommand, uint numCommands)
+{
+	ASSERT(batch.renderId >= 0);
+	const GPUBatch& gpuBatch = m_batches[batch.renderId];
+	uint vao = m_meshBuffers[gpuBatch.meshBuffer].vao;
+	if (m_vao != vao) {
+		m_vao = vao;
+		glBindVertexArray(m_vao);
+	} else ++stats.avoided.vaos;
+	GLvoid* offset = (GLvoid*)(uintptr_t)(firstCommand * sizeof(DrawCommand));
+	if (gpuBatch.alloc.numIndices)
+		glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, offset, numCommands, sizeof(DrawCommand));
+	else glMultiDrawArraysIndirect(GL_TRIANGLES, offset, numCommands, sizeof(DrawCommand));
+	++stats.drawCalls;
+	stats.indirectCommands += numCommands;
+}
+
 void RenderDevice::renderFullscreenQuad()
 {
 	glBindVertexArray(m_fullscreenQuad.vao);
@@ -785,17 +2128,16 @@ void RenderDevice::renderSkybox()
 	glDepthFunc(GL_LEQUAL);
 	glUseProgram(m_shaders[m_skyboxMat.shaderId[m_tech]].id);
 	if (m_tech == TECH_REFLECTION) {
-		setupCubeMatrices(m_commonBlock.uniforms.projectionMatrix, vec3(0, 0, 0));
+		setupCubeMatrices(m_commonBlock.uniforms.projectionMatrix, vec3(0, 0, 0), reflectionFaces);
 	} else {
 		// Remove translation
 		m_commonBlock.uniforms.viewMatrix = glm::mat4(glm::mat3(m_commonBlock.uniforms.viewMatrix));
-		m_commonBlock.upload();
+		uploadBlock(m_commonBlock);
 	}
 	glBindVertexArray(m_skyboxCube.vao);
-	glActiveTexture(GL_TEXTURE0 + BINDING_ENV_MAP);
 	if (DEBUG_REFLECTION && m_tech == TECH_COLOR)
-		glBindTexture(GL_TEXTURE_CUBE_MAP, m_reflectionFbo.tex[0]);
-	else glBindTexture(GL_TEXTURE_CUBE_MAP, m_skyboxMat.tex[Material::ENV_MAP]);
+		bindTexture(BINDING_ENV_MAP, GL_TEXTURE_CUBE_MAP, m_reflectionFbo.tex[0]);
+	else bindTexture(BINDING_ENV_MAP, GL_TEXTURE_CUBE_MAP, m_skyboxMat.tex[Material::ENV_MAP]);
 	glDrawArrays(GL_TRIANGLES, 0, 36);
 	glBindVertexArray(0);
 	glDepthFunc(GL_LESS);
@@ -803,14 +2145,96 @@ void RenderDevice::renderSkybox()
 	stats.triangles += 36;
 }
 
+void RenderDevice::beginFrame()
+{
+	// The scene pass can take G-buffer textures from the graph's pool
+	m_frameGraph.reset();
+
+	// The other query was issued two frames ago, read it without waiting
+	m_timeQueryIndex ^= 1;
+	if (m_frame >= 2) {
+		GLuint available = 0;
+		glGetQueryObjectuiv(m_timeQueries[m_timeQueryIndex], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			GLuint64 elapsed = 0;
+			glGetQueryObjectui64v(m_timeQueries[m_timeQueryIndex], GL_QUERY_RESULT, &elapsed);
+			m_gpuFrameMs = elapsed / 1000000.f;
+		}
+	}
+	glBeginQuery(GL_TIME_ELAPSED, m_timeQueries[m_timeQueryIndex]);
+	m_timeQueryActive = true;
+}
+
 void RenderDevice::postRender()
 {
+	if (m_sampleQueryActive) {
+		glEndQuery(GL_SAMPLES_PASSED);
+		m_sampleQueryActive = false;
+	}
 	glBindVertexArray(0);
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
 	if (m_wireframe)
 		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 
+	// Everything after the scene pass goes through the frame graph, which drops the passes the
+	// output doesn't need and takes the transient targets from its pool
+	FrameGraph& graph = m_frameGraph;
+	int scene = graph.importTexture("Scene", m_fbo.tex[0], m_fbo.bytes());
+	int backbuffer = graph.importTexture("Back buffer", 0, Engine::width() * Engine::height() * 4);
+	graph.output(backbuffer);
+	// Targets the graph doesn't schedule, listed for the memory report
+	graph.importTexture("Shadow cascades", m_shadowFbo.tex[0], m_shadowFbo.bytes() + m_shadowCacheFbo.bytes());
+	graph.importTexture("Shadow atlas", m_shadowAtlasFbo.tex[0], m_shadowAtlasFbo.bytes() + m_shadowAtlasCacheFbo.bytes());
+	graph.importTexture("Reflection cube", m_reflectionFbo.tex[0], m_reflectionFbo.bytes());
+
+	// Resolve MSAA to regular FBO, the deferred path renders there directly
+	if (m_msaaFbo.valid()) {
+		int msaa = graph.importTexture("Scene MSAA", m_msaaFbo.tex[0], m_msaaFbo.bytes());
+		if (!m_deferredDone) {
+			int pass = graph.addPass("Resolve", [this]() {
+				glBindFramebuffer(GL_READ_FRAMEBUFFER, m_msaaFbo.fbo);
+				glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_fbo.fbo);
+				glReadBuffer(GL_COLOR_ATTACHMENT0);
+				glDrawBuffer(GL_COLOR_ATTACHMENT0);
+				glBlitFramebuffer(0, 0, m_msaaFbo.width, m_msaaFbo.height, 0, 0, m_fbo.width, m_fbo.height, GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+				glReadBuffer(GL_COLOR_ATTACHMENT1);
+				glDrawBuffer(GL_COLOR_ATTACHMENT1);
+				glBlitFramebuffer(0, 0, m_msaaFbo.width, m_msaaFbo.height, 0, 0, m_fbo.width, m_fbo.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+			});
+			graph.read(pass, msaa);
+			graph.write(pass, scene);
+		}
+	}
+
+	// Depth pyramid for next frame's GPU occlusion culling
+	if (m_hizRequested) {
+		FrameGraph::TextureDesc hizDesc;
+		hizDesc.width = m_fbo.width;
+		hizDesc.height = m_fbo.height;
+		hizDesc.levels = glm::max(m_hizLevels, 1u);
+		hizDesc.format = GL_R32F;
+		int hiz = graph.importTexture("Hi-Z", m_hizTexture, FrameGraph::textureBytes(hizDesc));
+		int pass = graph.addPass("Hi-Z", [this]() { buildHiZ(); });
+		graph.read(pass, scene);
+		graph.write(pass, hiz);
+		graph.output(hiz);
+	}
+
+	// Only kept when postfx reads the result
+	bool bloom = m_env->bloomThreshold > 0.f && m_env->bloomIntensity > 0.f;
+	FrameGraph::TextureDesc bloomDesc;
+	bloomDesc.width = glm::max(m_fbo.width / 2, 1u);
+	bloomDesc.height = glm::max(m_fbo.height / 2, 1u);
+	bloomDesc.levels = glm::min(MAX_BLOOM_LEVELS, 1 + (uint)glm::log2((float)glm::min(bloomDesc.width, bloomDesc.height)));
+	bloomDesc.format = GL_RGBA16F;
+	int bloomTarget = graph.createTexture("Bloom", bloomDesc);
+	int bloomPass = graph.addPass("Bloom", [this, bloomTarget, bloomDesc]() {
+		buildBloom(m_frameGraph.texture(bloomTarget), bloomDesc);
+	});
+	graph.read(bloomPass, scene);
+	graph.write(bloomPass, bloomTarget);
+
 	m_postProcessBlock.uniforms.tonemap = m_env->tonemap;
 	m_postProcessBlock.uniforms.exposure = m_env->exposure;
 	m_postProcessBlock.uniforms.saturation = m_env->saturation;
@@ -819,55 +2243,119 @@ void RenderDevice::postRender()
 	m_postProcessBlock.uniforms.sepia = m_env->sepia;
 	m_postProcessBlock.uniforms.vignette = m_env->vignette;
 	m_postProcessBlock.uniforms.scanlines = m_env->scanlines;
-	m_postProcessBlock.upload();
-
-	// Resolve MSAA to regular FBO
-	if (m_msaaFbo.valid()) {
-		glBindFramebuffer(GL_READ_FRAMEBUFFER, m_msaaFbo.fbo);
-		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_fbo.fbo);
-		glReadBuffer(GL_COLOR_ATTACHMENT0);
-		glDrawBuffer(GL_COLOR_ATTACHMENT0);
-		glBlitFramebuffer(0, 0, m_msaaFbo.width, m_msaaFbo.height, 0, 0, m_fbo.width, m_fbo.height, GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT, GL_NEAREST);
-		glReadBuffer(GL_COLOR_ATTACHMENT1);
-		glDrawBuffer(GL_COLOR_ATTACHMENT1);
-		glBlitFramebuffer(0, 0, m_msaaFbo.width, m_msaaFbo.height, 0, 0, m_fbo.width, m_fbo.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
-	}
-
-	uint pingpong = 0;
-	//if (m_env->bloomIntensity >= 1.f && m_env->bloomThreshold > 0.f)
-	{
-		// Blur bloom texture
-		uint amount = (uint)m_env->bloomIntensity;
-		glUseProgram(m_shaders[m_shaderNames[$id(hblur)]].id);
-		glActiveTexture(GL_TEXTURE20);
-		for (uint i = 0; i < amount; i++)
-		{
-			m_pingPongFbo[pingpong].bind();
-			glBindTexture(GL_TEXTURE_2D, i == 0 ? m_fbo.tex[1] : m_pingPongFbo[!pingpong].tex[0]);
-			renderFullscreenQuad();
-			pingpong = !pingpong;
+	// Upsampling sums every level of the chain
+	m_postProcessBlock.uniforms.bloomIntensity = bloom ? m_env->bloomIntensity / bloomDesc.levels : 0.f;
+	m_postProcessBlock.uniforms.reprojectionMatrix = m_reprojection;
+	m_postProcessBlock.uniforms.sceneScale = m_sceneScale;
+	m_postProcessBlock.uniforms.jitter = m_jitter;
+	m_postProcessBlock.uniforms.historyWeight = m_historyValid ? TAA_HISTORY_WEIGHT : 0.f;
+	uploadBlock(m_postProcessBlock);
+
+	// Temporal resolve to output resolution, postfx then reads the whole of the result. Last
+	// frame's output goes back to the pool once read, so the next G-buffer can take it.
+	int sceneResult = scene;
+	int prevHistory = m_history ? graph.reclaim("TAA history", m_history) : -1;
+	int history = -1;
+	m_history = 0;
+	auto taa = m_shaderNames.find($id(taa));
+	if (temporalAA && taa != m_shaderNames.end()) {
+		if (!m_historyFbo.valid()) {
+			m_historyFbo.external = true;
+			m_historyFbo.create();
 		}
-		glUseProgram(m_shaders[m_shaderNames[$id(vblur)]].id);
-		for (uint i = 0; i < amount; i++)
-		{
-			m_pingPongFbo[pingpong].bind();
-			glBindTexture(GL_TEXTURE_2D, m_pingPongFbo[!pingpong].tex[0]);
+		// Same description as the G-buffer color targets
+		FrameGraph::TextureDesc historyDesc;
+		historyDesc.width = m_fbo.width;
+		historyDesc.height = m_fbo.height;
+		historyDesc.format = GL_RGBA16F;
+		history = graph.createTexture("TAA output", historyDesc);
+		int shaderId = taa->second;
+		int pass = graph.addPass("Temporal AA", [this, shaderId, prevHistory, history]() {
+			m_historyFbo.attach(0, m_frameGraph.texture(history));
+			m_historyFbo.bind();
+			glUseProgram(m_shaders[shaderId].id);
+			++stats.programs;
+			glActiveTexture(GL_TEXTURE20);
+			glBindTexture(GL_TEXTURE_2D, m_fbo.tex[0]);
+			glActiveTexture(GL_TEXTURE21);
+			glBindTexture(GL_TEXTURE_2D, prevHistory >= 0 ? m_frameGraph.texture(prevHistory) : 0);
+			glActiveTexture(GL_TEXTURE22);
+			glBindTexture(GL_TEXTURE_2D, m_fbo.tex[2]);
 			renderFullscreenQuad();
-			pingpong = !pingpong;
-		}
-	}
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glUseProgram(m_shaders[m_shaderNames[$id(postfx)]].id);
-	++stats.programs;
-	glActiveTexture(GL_TEXTURE20);
-	glBindTexture(GL_TEXTURE_2D, m_fbo.tex[0]);
-	glActiveTexture(GL_TEXTURE21);
-	glBindTexture(GL_TEXTURE_2D, m_pingPongFbo[!pingpong].tex[0]);
-	glActiveTexture(GL_TEXTURE22);
-	glBindTexture(GL_TEXTURE_2D, m_fbo.tex[2]);
-	renderFullscreenQuad();
+			m_historyValid = true;
+			m_postProcessBlock.uniforms.sceneScale = vec2(1.f);
+			uploadBlock(m_postProcessBlock);
+		});
+		graph.read(pass, scene);
+		if (prevHistory >= 0)
+			graph.read(pass, prevHistory);
+		graph.write(pass, history);
+		graph.retain(history); // Next frame's history
+		sceneResult = history;
+	} else m_historyValid = false;
+
+	// Effects at their neutral setting are left out of the shader altogether
+	uint postKey = 0;
+	if (m_env->chromaticAberration > 0.f) postKey |= USE_CHROMATIC_ABERRATION;
+	else if (m_env->postAA == Environment::POST_AA_FXAA) postKey |= USE_FXAA;
+	if (bloom) postKey |= USE_BLOOM;
+	if (m_env->vignette.z > 0.f) postKey |= USE_VIGNETTE;
+	if (m_env->saturation != 0.f) postKey |= USE_SATURATION;
+	if (m_env->sepia > 0.f) postKey |= USE_SEPIA;
+	if (m_env->scanlines > 0.f) postKey |= USE_SCANLINES;
+	postKey |= (uint)m_env->tonemap << NUM_POST_EFFECTS;
+	int postShader = generatePostShader(postKey);
+
+	int postfx = graph.addPass("Postprocess", [this, sceneResult, bloomTarget, bloom, postShader]() {
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		if (postShader < 0)
+			return;
+		glUseProgram(m_shaders[postShader].id);
+		++stats.programs;
+		glActiveTexture(GL_TEXTURE20);
+		glBindTexture(GL_TEXTURE_2D, m_frameGraph.texture(sceneResult));
+		glActiveTexture(GL_TEXTURE21);
+		glBindTexture(GL_TEXTURE_2D, bloom ? m_frameGraph.texture(bloomTarget) : 0);
+		glActiveTexture(GL_TEXTURE22);
+		glBindTexture(GL_TEXTURE_2D, m_fbo.tex[2]);
+		renderFullscreenQuad();
+	});
+	graph.read(postfx, scene);
+	graph.read(postfx, sceneResult);
+	if (bloom)
+		graph.read(postfx, bloomTarget);
+	graph.write(postfx, backbuffer);
+
+	glViewport(0, 0, m_fbo.width, m_fbo.height);
+	graph.execute();
+	stats.culledPasses = graph.numCulled();
+	if (history >= 0)
+		m_history = graph.texture(history);
 
 	glUseProgram(0);
+	resetTextureCache();
+	if (m_timeQueryActive) {
+		glEndQuery(GL_TIME_ELAPSED);
+		m_timeQueryActive = false;
+	}
+	stats.gpuFrameMs = m_gpuFrameMs;
+
+	// Recycle material slots that nothing has used for a while
+	for (uint i = 0; i < m_materialSlots.size(); ++i) {
+		MaterialSlot& slot = m_materialSlots[i];
+		if (slot.used && m_frame - slot.lastUsed > MATERIAL_SLOT_LIFETIME) {
+			m_materialSlotIndex.erase(slot.hash);
+			slot.used = false;
+			m_freeMaterialSlots.push_back(i);
+		}
+	}
+	// Atlases whose materials no model has anymore, e.g. replaced by an edit
+	for (auto it = m_impostors.begin(); it != m_impostors.end(); ) {
+		if (m_frame - it->second.lastUsed > IMPOSTOR_LIFETIME)
+			it = m_impostors.erase(it);
+		else ++it;
+	}
+	++m_frame;
+	m_uniformRing.nextFrame();
 }
@@ -1,11 +1,16 @@
 #pragma once
 #include "common.hpp"
 #include "uniforms.hpp"
+#include "ringbuffer.hpp"
+#include "meshbuffer.hpp"
+#include "lightgrid.hpp"
+#include "shadowatlas.hpp"
 #include "shader.hpp"
 #include "components.hpp"
 #include "texture.hpp"
 #include "material.hpp"
 #include "fbo.hpp"
+#include "framegraph.hpp"
 #include <unordered_map>
 
 class Resources;
@@ -26,15 +31,80 @@ public:
 	void loadShaders();
 	bool uploadGeometry(Geometry& geometry);
 	bool uploadMaterial(Material& material);
+	// Finds or builds the material's constant block, cheap when nothing changed
+	void updateMaterialBlock(Material& material);
 	void destroyGeometry(Geometry& geometry);
 
+	// Fits the sun shadow cascades to the camera frustum, call before the cascade passes
+	void setupCascades(const Light& sun, const Camera& camera);
+	void setupCascadePass(uint cascade);
+	bool cascadeVisible(uint cascade, vec3 position, float radius) const;
+	uint numCascades() const { return m_numCascades; }
+	// Picks the point lights that get atlas tiles and which of them are redrawn this frame
+	void updateShadowAtlas(const std::vector<Light>& lights, vec3 cameraPosition);
+	const std::vector<uint>& shadowRenderList() const { return m_shadowAtlas.renderList(); }
 	void setupShadowPass(const Light& light, uint index);
-	void renderShadow(Model& model, Transform& transform, BoneAnimation* animation = nullptr);
+	// Static casters are kept in a cached depth map that is only redrawn when the light or the
+	// caster hash changes. Returns true if the static casters need to be rendered (and flushed).
+	bool beginShadowCache(uint64 casterHash);
+	// Copies the cache to the shadow map for the dynamic casters, skipped if nothing changed
+	void endShadowCache(bool dynamicCasters);
+	bool shadowCaching = true;
+	void renderShadow(Model& model, Transform& transform, BoneAnimation* animation = nullptr, Geometry* geometry = nullptr);
 
 	void setupRenderPass(const Camera& camera, const std::vector<Light>& lights, Technique tech = TECH_COLOR);
-	void render(Model& model, Transform& transform, BoneAnimation* animation = nullptr);
+	// Baked reflection probes live in a cube map array, filled from complete reflection passes
+	void createProbeArray(uint count);
+	void storeProbe(uint index, vec3 position);
+	uint numProbes() const { return m_numProbes; }
+	uint reflectionSize() const { return m_reflectionFbo.width; }
+	vec4 dynamicProbe = vec4(0.f, 0.f, 0.f, FLT_MAX); // Objects within w of xyz use the dynamic cube
+	// Geometry overrides model.geometry, e.g. for a coarser LOD. A non-zero lodFade dithers the draw
+	// for a LOD cross-fade: positive fades out, negative fades in. Fading draws skip the pre-pass.
+	void render(Model& model, Transform& transform, BoneAnimation* animation = nullptr, Geometry* geometry = nullptr, float lodFade = 0.f);
+	// Draws queued by render() and renderShadow() are sorted and submitted here
+	void flush();
+	// Depth only pass over the following render() calls; the next color flush() then tests
+	// GL_EQUAL against it without depth writes. Goes between setupRenderPass() and the color draws.
+	void beginDepthPrepass();
+	void endDepthPrepass();
+	// Deferred path: the following render() calls fill the G-buffer, endDeferred() lights it with a
+	// fullscreen pass. Render again afterwards for the materials that need forward shading.
+	void beginDeferred();
+	void endDeferred();
+	bool instancing = true; // Draw repeated batch and material pairs instanced in flush()
+	// Cube passes set the layer from the vertex shader, one instance per face an object touches
+	bool layeredCubes = true;
+	static const uint ALL_CUBE_FACES = 0x3f;
+	uint reflectionFaces = ALL_CUBE_FACES; // Faces the next reflection pass redraws, the rest keep their contents
+	// GPU driven path: instances are culled by a compute shader that also writes indirect draw commands
+	bool addCulledInstance(const Model& model, const Transform& transform);
+	void renderCulledInstances(bool hiz = false);
+	// Far-field billboards: the model's full detail geometry is baked from a ring of views into a
+	// G-buffer atlas once per set of materials. Call every frame for each model that may use it,
+	// atlases no model asks for are freed. Returns false if the model can't have one (yet),
+	// e.g. custom shaders or textures still loading.
+	bool bakeImpostor(const Model& model);
+	// Queues an instance if the model has a baked impostor
+	bool addImpostor(const Model& model, const Transform& transform);
+	// One instanced draw per baked model, into the G-buffer when called between beginDeferred()
+	// and endDeferred(), otherwise forward shaded with the sun only
+	void renderImpostors();
+	static const uint IMPOSTOR_TILE_SIZE = 64; // Pixels of one view in the atlas
 	void renderSkybox();
+	// GPU frame timing, call before the first pass
+	void beginFrame();
 	void postRender();
+	float gpuFrameMs() const { return m_gpuFrameMs; } // Two frames late
+	// Fraction of the window the scene is rendered at, inside the full size targets
+	float resolutionScale = 1.f;
+	// Jitters the scene projection and resolves it against reprojected history, also upscales
+	bool temporalAA = false;
+	// Scales tessellation, parallax layers and shadow filter taps, which already fall off with distance
+	float detailQuality = 1.f;
+
+	// Post-processing passes and their targets, resources() reports the GPU memory of each
+	const FrameGraph& frameGraph() const { return m_frameGraph; }
 
 	void resizeRenderTargets();
 	void toggleWireframe();
@@ -46,6 +116,8 @@ public:
 		int maxSamples;
 		int maxSamplers;
 		int maxArrayTextureLayers;
+		int uniformBufferAlignment;
+		bool vertexLayer; // gl_Layer and gl_ViewportIndex writable from the vertex shader
 	} caps;
 
 	struct Stats
@@ -54,8 +126,34 @@ public:
 		uint programs = 0;
 		uint triangles = 0;
 		uint lights = 0;
+		uint lightAssignments = 0; // Light references in the cluster grid
+		uint occluders = 0;
+		uint occlusionTested = 0;
+		uint occlusionCulled = 0;
+		uint gpuInstances = 0;
+		uint instances = 0;
+		uint indirectCommands = 0; // Draws issued through multi-draw indirect
+		uint bytesStreamed = 0; // Uniform data written to the ring buffer
+		uint shadowMaps = 0;
+		uint shadowCacheHits = 0; // Shadow maps with no static casters redrawn
+		uint shadowedLights = 0; // Lights with an atlas tile
+		uint culledCubeFaces = 0; // Instances skipped by layered cube draws
+		uint prepassItems = 0; // Draws in the depth pre-pass
+		uint deferredItems = 0; // Draws into the G-buffer
+		uint culledPasses = 0; // Frame graph passes nothing used
+		uint impostors = 0; // Billboards drawn instead of models
+		float overdraw = 0.f; // Scene pass samples shaded per pixel, a frame late
+		float gpuFrameMs = 0.f;
+		float resolutionScale = 1.f;
+		struct {
+			uint programs = 0;
+			uint materials = 0;
+			uint textures = 0;
+			uint vaos = 0;
+		} avoided; // Redundant state changes skipped
 		struct {
 			float prerender = 0.f;
+			float occlusion = 0.f;
 			float upload = 0.f;
 			float shadow = 0.f;
 			float reflection = 0.f;
@@ -72,42 +170,251 @@ private:
 		uint ebo = 0;
 	};
 	void destroyGeometry(GPUGeometry& geometry);
+	// Batch data lives in the mesh buffer of its vertex format
+	struct GPUBatch
+	{
+		int meshBuffer = -1; // -1 if the slot is free
+		MeshBuffer::Allocation alloc;
+	};
+
+	// Must match cull.comp
+	struct CullInstance
+	{
+		mat4 modelMatrix;
+		vec4 boundsMin;
+		vec4 boundsMax;
+		glm::uvec4 info; // x = draw command index, y = first output slot of the command
+	};
+	// Layout of both DrawElementsIndirectCommand and DrawArraysIndirectCommand (padded)
+	struct DrawCommand
+	{
+		uint count;
+		uint instanceCount;
+		uint first;
+		uint baseVertexOrInstance;
+		uint baseInstanceOrPad;
+	};
+	struct CullGroup
+	{
+		const Batch* batch;
+		int shaderId;
+		uint tex[Material::ENV_MAP];
+		int blockId;
+		uint64 stateKey; // Groups with equal keys (and mesh buffer) are drawn with one multi-draw
+		uint count;
+		uint first;
+	};
+
+	struct RenderItem
+	{
+		uint64 key;
+		const Batch* batch;
+		const Material* material;
+		mat4 modelMatrix;
+		float radius;
+		const BoneAnimation* animation;
+		float lodFade;
+	};
+	struct SortItem
+	{
+		uint64 key;
+		uint index;
+	};
+	struct DrawRun
+	{
+		uint start;
+		uint count;
+		uint firstCommand;
+		uint numCommands;
+		int shaderId; // Instanced shader, -1 for regular draws
+	};
+	static const uint MIN_INSTANCES = 2;
+	void queue(const Batch& batch, const Material& material, const Transform& transform, float radius, const BoneAnimation* animation, float lodFade = 0.f);
+	void sortQueue();
+	bool canInstance(const RenderItem& item) const;
+	bool canPrepass(const Material& material) const;
+	bool canDefer(const Material& material) const;
+	bool sameState(const RenderItem& a, const RenderItem& b) const;
+	DrawCommand drawCommand(const Batch& batch, uint instanceCount, uint baseInstance) const;
 
+	static const uint UNIFORM_RING_SIZE = 1024 * 1024; // Per frame, grows if needed
+	template<typename T> void uploadBlock(UBO<T>& ubo);
+	void bindMaterialBlock(int blockId);
+	void bindTexture(uint unit, uint target, uint tex);
+	void resetTextureCache();
+	void createBufferTexture(uint format, uint& buffer, uint& texture);
 	int generateShader(uint tags);
-	void setupCubeMatrices(mat4 proj, vec3 pos);
-	void drawSetup(const Transform& transform, const BoneAnimation* animation = nullptr);
+	int generatePostShader(uint key);
+	int instancedShader(int shaderId);
+	int layeredShader(int shaderId);
+	int fadeShader(int shaderId);
+	void buildHiZ();
+	void buildBloom(uint texture, const FrameGraph::TextureDesc& desc);
+	void setupCubeMatrices(mat4 proj, vec3 pos, uint faceMask = ALL_CUBE_FACES);
+	uint cubeFaceMask(vec3 center, float radius) const;
+	void bindShadowTarget(FBO& fbo);
+	void drawSetup(const mat4& modelMatrix, const BoneAnimation* animation = nullptr, float lodFade = 0.f);
 	void drawBatch(const Batch& batch, bool tessellate = false);
+	void drawIndirect(const Batch& batch, uint firstCommand, uint numCommands);
 	void renderFullscreenQuad();
 
 	FBO m_msaaFbo;
 	FBO m_fbo;
-	FBO m_pingPongFbo[2];
-	FBO m_shadowFbo[MAX_SHADOWS];
+	FBO m_gbufferFbo; // Textures from the frame graph pool while deferred lighting needs them
+	int m_gbuffer[FBO::MAX_TEXTURES] = {}; // Frame graph resources
+	FBO m_historyFbo; // Temporal resolve output, the texture is retained in the frame graph pool
+	FBO m_shadowFbo; // Sun cascades
+	FBO m_shadowCacheFbo;
+	FBO m_shadowAtlasFbo; // Point lights
+	FBO m_shadowAtlasCacheFbo;
 	FBO m_reflectionFbo;
+	uint m_probeArray = 0;
+	uint m_numProbes = 0;
 
 	GPUGeometry m_fullscreenQuad;
 	GPUGeometry m_skyboxCube;
 	Material m_skyboxMat;
 	Texture m_placeholderTex;
 
-	mat4 m_shadowProj[MAX_SHADOWS];
-	mat4 m_shadowView[MAX_SHADOWS];
+	struct Cascade
+	{
+		mat4 view; // Rotation only, same for all cascades
+		mat4 proj;
+		vec3 center; // Light space, snapped to texels
+		float radius;
+		float near;
+		float far;
+		float split; // View space far distance
+	};
+	static const float CASCADE_SPLIT_LAMBDA; // Blend between logarithmic and uniform splits
+	static const float CASCADE_CASTER_MARGIN; // Extends the cascades toward the sun for off screen casters
+	Cascade m_cascades[MAX_CASCADES];
+	struct ShadowCache
+	{
+		uint64 hash = 0;
+		bool valid = false;
+		bool dynamic = false; // Shadow map has dynamic casters on top of the cache
+		bool rebuilt = false;
+	};
+	std::vector<ShadowCache> m_shadowCaches; // Cascades followed by atlas slots
+	ShadowAtlas m_shadowAtlas;
+	uint m_shadowAtlasBudget = 0; // Lights redrawn per frame
+	// Target of the current shadow pass
+	FBO* m_shadowTarget = nullptr;
+	FBO* m_shadowCacheTarget = nullptr;
+	uint m_shadowLayer = 0;
+	glm::uvec4 m_shadowRect; // x, y, width, height
+	uint m_shadowCacheIndex = 0;
+	uint m_numCascades = 1;
+	float m_shadowDistance = 0.f;
 
 	uint m_program = 0;
+	uint m_vao = 0;
 	Technique m_tech = TECH_COLOR;
 	bool m_wireframe = false;
 	UBO<UniformCommonBlock> m_commonBlock;
 	UBO<UniformObjectBlock> m_objectBlock;
-	UBO<UniformMaterialBlock> m_materialBlock;
-	UBO<UniformLightBlock> m_lightBlock;
 	UBO<UniformCubeMatrixBlock> m_cubeMatrixBlock;
 	UBO<UniformSkinningBlock> m_skinningBlock;
 	UBO<UniformPostProcessBlock> m_postProcessBlock;
+	RingBuffer m_uniformRing;
+	LightGrid m_lightGrid;
+	std::vector<UniformLightData> m_lightData;
+	uint m_lightBuffer = 0;
+	uint m_lightTexture = 0;
+	uint m_clusterGridBuffer = 0;
+	uint m_clusterGridTexture = 0;
+	uint m_clusterIndexBuffer = 0;
+	uint m_clusterIndexTexture = 0;
+	// Constant blocks of all materials in one buffer, deduplicated by content
+	struct MaterialSlot
+	{
+		UniformMaterialBlock block;
+		uint64 hash = 0;
+		uint lastUsed = 0; // Frame number
+		bool used = false;
+	};
+	static const uint MATERIAL_SLOT_LIFETIME = 8; // Frames before an unused slot is recycled
+	std::vector<MaterialSlot> m_materialSlots;
+	std::vector<int> m_freeMaterialSlots;
+	std::unordered_map<uint64, int> m_materialSlotIndex;
+	uint m_materialBuffer = 0;
+	uint m_materialBufferSlots = 0;
+	uint m_materialSlotStride = 0;
+	int m_boundMaterialBlock = -1;
+	uint m_frame = 0;
+	static const uint MAX_TEXTURE_UNITS = 32;
+	uint m_boundTextures[MAX_TEXTURE_UNITS] = {};
 	std::vector<ShaderProgram> m_shaders;
 	std::unordered_map<uint, int> m_shaderNames;
 	std::unordered_map<uint, int> m_shaderTags;
+	std::unordered_map<uint, int> m_postShaders; // Effect key to program, -1 if it failed to link
 	std::map<void*, Texture> m_textures;
-	std::vector<GPUGeometry> m_geometries;
+	std::vector<GPUBatch> m_batches; // Indexed by Batch::renderId
+	std::vector<int> m_freeBatches;
+	std::vector<MeshBuffer> m_meshBuffers;
+	std::unordered_map<uint64, int> m_meshBufferIndex; // Vertex format to mesh buffer
+	std::vector<RenderItem> m_queue;
+	std::vector<SortItem> m_sortItems;
+	std::vector<SortItem> m_sortTemp;
+	std::vector<DrawRun> m_runs;
+	std::vector<mat4> m_instanceMatrices;
+	std::vector<DrawCommand> m_drawCommands;
+	std::unordered_map<int, int> m_instancedShaders;
+	std::unordered_map<int, int> m_layeredShaders;
+	std::unordered_map<int, int> m_fadeShaders;
+	std::vector<uint> m_instanceFaces;
+	string m_layerExtensions; // Enables for vertex shader layer output, empty if unsupported
+	vec3 m_cubeCenter;
+	struct Impostor
+	{
+		FBO atlas; // G-buffer layout, invalid if baking failed
+		vec4 bounds; // Object space center and radius the views were framed on
+		std::vector<mat4> instances; // This frame
+		uint lastUsed = 0; // Frame a model with these materials was last seen in
+	};
+	static const uint IMPOSTOR_LIFETIME = 8; // Frames before an unclaimed atlas is freed
+	// By full detail geometry and a hash of the materials drawn on it, geometry is shared between models
+	typedef std::pair<const Geometry*, uint64> ImpostorKey;
+	ImpostorKey impostorKey(const Model& model) const;
+	std::map<ImpostorKey, Impostor> m_impostors;
+	GPUGeometry m_impostorQuad; // Only the instance matrix buffer, corners come from gl_VertexID
+	std::vector<CullInstance> m_cullInstances;
+	std::vector<CullGroup> m_cullGroups;
+	std::unordered_map<uint64, uint> m_cullGroupIndex;
+	uint m_cullInstanceBuffer = 0;
+	uint m_cullCommandBuffer = 0;
+	uint m_instanceMatrixBuffer = 0;
+	uint m_instanceFaceBuffer = 0;
+	bool m_prepass = false; // Queuing depth pre-pass draws
+	bool m_prepassDone = false; // The current color pass has pre-pass depth
+	bool m_deferred = false; // Queuing G-buffer draws
+	bool m_deferredDone = false; // The current color pass was lit from the G-buffer
+	uint m_sampleQueries[2] = {};
+	uint m_sampleQueryIndex = 0;
+	bool m_sampleQueryActive = false;
+	bool m_sampleQueryIssued[2] = {}; // Reading a query that was never begun is an error
+	float m_overdraw = 0.f;
+	uint m_timeQueries[2] = {};
+	uint m_timeQueryIndex = 0;
+	bool m_timeQueryActive = false;
+	float m_gpuFrameMs = 0.f;
+	vec2 m_sceneScale = vec2(1.f); // Rendered part of the scene targets
+	vec2 m_jitter = vec2(0.f); // Scene uv offset of this frame's projection
+	mat4 m_prevViewProj;
+	mat4 m_reprojection; // Unjittered clip space to the previous frame's
+	uint m_history = 0; // Last temporal resolve output, reclaimed by the next frame's graph
+	bool m_historyValid = false;
+	static const float TAA_HISTORY_WEIGHT;
+	uint m_drawCommandBuffer = 0;
+	mat4 m_cullViewProj;
+	uint m_hizTexture = 0;
+	uint m_hizLevels = 0;
+	mat4 m_hizViewProj;
+	bool m_hizRequested = false;
+	bool m_hizValid = false;
+	static const uint MAX_BLOOM_LEVELS = 6;
+	FrameGraph m_frameGraph;
 	Environment* m_env = nullptr;
 	Resources& m_resources;
 };
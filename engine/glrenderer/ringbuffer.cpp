@@ -0,0 +1,101 @@
+#include "ringbuffer.hpp"
+#include "glutil.hpp"
+
+RingBuffer::~RingBuffer()
+{
+	destroy();
+}
+
+void RingBuffer::create(uint size, uint align)
+{
+	destroy();
+	frameSize = (size + align - 1) / align * align;
+	alignment = align;
+	frame = 0;
+	offset = 0;
+	overflow = false;
+	persistent = glutil::hasExtension("GL_ARB_buffer_storage", 44);
+	GLsizeiptr totalSize = (GLsizeiptr)frameSize * NUM_FRAMES;
+	glGenBuffers(1, &id);
+	glBindBuffer(GL_UNIFORM_BUFFER, id);
+	if (persistent) {
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_UNIFORM_BUFFER, totalSize, NULL, flags);
+		mapped = (char*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, totalSize, flags);
+		if (!mapped) {
+			logError("Failed to map uniform ring buffer");
+			persistent = false;
+			glDeleteBuffers(1, &id);
+			glGenBuffers(1, &id);
+			glBindBuffer(GL_UNIFORM_BUFFER, id);
+		}
+	}
+	if (!persistent)
+		glBufferData(GL_UNIFORM_BUFFER, totalSize, NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+void RingBuffer::destroy()
+{
+	for (auto& fence : fences) {
+		if (fence)
+			glDeleteSync((GLsync)fence);
+		fence = nullptr;
+	}
+	if (id) {
+		if (mapped) {
+			glBindBuffer(GL_UNIFORM_BUFFER, id);
+			glUnmapBuffer(GL_UNIFORM_BUFFER);
+			glBindBuffer(GL_UNIFORM_BUFFER, 0);
+			mapped = nullptr;
+		}
+		glDeleteBuffers(1, &id);
+		id = 0;
+	}
+}
+
+bool RingBuffer::bindUniforms(uint binding, const void* data, uint size)
+{
+	if (!id || offset + size > frameSize) {
+		overflow = true;
+		return false;
+	}
+	uint start = frame * frameSize + offset;
+	if (mapped) {
+		memcpy(mapped + start, data, size);
+	} else {
+		glBindBuffer(GL_UNIFORM_BUFFER, id);
+		glBufferSubData(GL_UNIFORM_BUFFER, start, size, data);
+	}
+	glBindBufferRange(GL_UNIFORM_BUFFER, binding, id, start, size);
+	offset += (size + alignment - 1) / alignment * alignment;
+	return true;
+}
+
+void RingBuffer::nextFrame()
+{
+	if (!id)
+		return;
+	if (fences[frame])
+		glDeleteSync((GLsync)fences[frame]);
+	fences[frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	if (overflow) {
+		// Not everything fit last frame, grow (the old buffer lives until the GPU is done with it)
+		logDebug("Growing uniform ring buffer to %u bytes per frame", frameSize * 2);
+		create(frameSize * 2, alignment);
+		return;
+	}
+
+	frame = (frame + 1) % NUM_FRAMES;
+	offset = 0;
+	if (GLsync fence = (GLsync)fences[frame]) {
+		GLenum res = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		while (res == GL_TIMEOUT_EXPIRED)
+			res = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+		if (res == GL_WAIT_FAILED)
+			logError("Waiting for uniform ring buffer fence failed");
+		glDeleteSync(fence);
+		fences[frame] = nullptr;
+	}
+}
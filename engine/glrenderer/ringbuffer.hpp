@@ -0,0 +1,35 @@
+#pragma once
+#include "common.hpp"
+
+// Stream buffer for per draw uniform data. It is split into one region per
+// frame in flight, the CPU writes to the current one while the GPU can still
+// read the others. Regions are fenced so in-flight data is never overwritten.
+// Uses a persistently mapped buffer where GL_ARB_buffer_storage is available.
+struct RingBuffer
+{
+	static const uint NUM_FRAMES = 3;
+
+	RingBuffer() {}
+	~RingBuffer();
+
+	NONCOPYABLE(RingBuffer);
+
+	void create(uint frameSize, uint alignment);
+	void destroy();
+	// Copies the data to the current region and binds it to a uniform block
+	// binding point, returns false if the region is full
+	bool bindUniforms(uint binding, const void* data, uint size);
+	// Fences the current region and waits until the next one is free
+	void nextFrame();
+	bool valid() const { return id > 0; }
+
+	uint id = 0;
+	uint frameSize = 0;
+	uint alignment = 256;
+	uint frame = 0;
+	uint offset = 0; // Within the current region
+	bool overflow = false;
+	bool persistent = false;
+	char* mapped = nullptr;
+	void* fences[NUM_FRAMES] = {}; // GLsync
+};
@@ -35,7 +35,6 @@ void UBO<T>::destroy()
 template struct UBO<UniformCommonBlock>;
 template struct UBO<UniformObjectBlock>;
 template struct UBO<UniformMaterialBlock>;
-template struct UBO<UniformLightBlock>;
 template struct UBO<UniformCubeMatrixBlock>;
 template struct UBO<UniformSkinningBlock>;
 template struct UBO<UniformPostProcessBlock>;
@@ -0,0 +1,112 @@
+#include "lightgrid.hpp"
+#include "components.hpp"
+
+void LightGrid::updateClusterBounds(const mat4& projection, float near, float far)
+{
+	m_projection = projection;
+	m_near = near;
+	m_far = far;
+	float logRatio = glm::log(far / near);
+	m_sliceScale = SLICES / logRatio;
+	m_sliceBias = -SLICES * glm::log(near) / logRatio;
+
+	// View space position at the given depth that projects to ndc
+	auto unproject = [&projection](vec2 ndc, float depth) {
+		return vec3((ndc.x + projection[2][0]) * depth / projection[0][0],
+			(ndc.y + projection[2][1]) * depth / projection[1][1], -depth);
+	};
+	m_clusterBounds.resize(NUM_CLUSTERS);
+	for (int z = 0; z < SLICES; ++z) {
+		float d0 = near * glm::pow(far / near, (float)z / SLICES);
+		float d1 = near * glm::pow(far / near, (float)(z + 1) / SLICES);
+		for (int y = 0; y < TILES_Y; ++y) {
+			for (int x = 0; x < TILES_X; ++x) {
+				vec2 ndc0(2.f * x / TILES_X - 1.f, 2.f * y / TILES_Y - 1.f);
+				vec2 ndc1(2.f * (x + 1) / TILES_X - 1.f, 2.f * (y + 1) / TILES_Y - 1.f);
+				Bounds& b = m_clusterBounds[(z * TILES_Y + y) * TILES_X + x];
+				b.min = vec3(FLT_MAX);
+				b.max = vec3(-FLT_MAX);
+				for (int i = 0; i < 8; ++i) {
+					vec3 p = unproject(vec2((i & 1) ? ndc1.x : ndc0.x, (i & 2) ? ndc1.y : ndc0.y), (i & 4) ? d1 : d0);
+					b.min = glm::min(b.min, p);
+					b.max = glm::max(b.max, p);
+				}
+			}
+		}
+	}
+}
+
+int LightGrid::slice(float depth) const
+{
+	if (depth <= m_near)
+		return 0;
+	return glm::clamp((int)(glm::log(depth) * m_sliceScale + m_sliceBias), 0, SLICES - 1);
+}
+
+void LightGrid::build(const mat4& view, const mat4& projection, float near, float far, const Light* lights, uint numLights)
+{
+	if (projection != m_projection || near != m_near || far != m_far || m_clusterBounds.empty())
+		updateClusterBounds(projection, near, far);
+
+	m_pairs.clear();
+	m_counts.assign(NUM_CLUSTERS, 0);
+	for (uint i = 0; i < numLights; ++i) {
+		const Light& light = lights[i];
+		vec3 center = vec3(view * vec4(light.position, 1.f));
+		float radius = light.distance;
+		float depth = -center.z;
+		if (depth + radius < near || depth - radius > far)
+			continue;
+
+		// Conservative screen rectangle from the projected bounding box of the sphere
+		int x0 = 0, y0 = 0, x1 = TILES_X - 1, y1 = TILES_Y - 1;
+		if (depth - radius > near) {
+			vec2 ndcMin(FLT_MAX), ndcMax(-FLT_MAX);
+			for (int c = 0; c < 8; ++c) {
+				vec3 corner = center + vec3((c & 1) ? radius : -radius, (c & 2) ? radius : -radius, (c & 4) ? radius : -radius);
+				vec4 clip = projection * vec4(corner, 1.f);
+				vec2 ndc = vec2(clip) / clip.w;
+				ndcMin = glm::min(ndcMin, ndc);
+				ndcMax = glm::max(ndcMax, ndc);
+			}
+			if (ndcMax.x < -1.f || ndcMax.y < -1.f || ndcMin.x > 1.f || ndcMin.y > 1.f)
+				continue;
+			x0 = glm::clamp((int)((ndcMin.x * 0.5f + 0.5f) * TILES_X), 0, TILES_X - 1);
+			x1 = glm::clamp((int)((ndcMax.x * 0.5f + 0.5f) * TILES_X), 0, TILES_X - 1);
+			y0 = glm::clamp((int)((ndcMin.y * 0.5f + 0.5f) * TILES_Y), 0, TILES_Y - 1);
+			y1 = glm::clamp((int)((ndcMax.y * 0.5f + 0.5f) * TILES_Y), 0, TILES_Y - 1);
+		}
+		int z0 = slice(depth - radius);
+		int z1 = slice(depth + radius);
+
+		// Refine with sphere vs. cluster box tests
+		float radiusSq = radius * radius;
+		for (int z = z0; z <= z1; ++z) {
+			for (int y = y0; y <= y1; ++y) {
+				for (int x = x0; x <= x1; ++x) {
+					uint cluster = (z * TILES_Y + y) * TILES_X + x;
+					const Bounds& b = m_clusterBounds[cluster];
+					vec3 closest = glm::clamp(center, b.min, b.max);
+					if (glm::distance2(closest, center) > radiusSq)
+						continue;
+					m_pairs.push_back(glm::uvec2(cluster, i));
+					m_counts[cluster]++;
+				}
+			}
+		}
+	}
+
+	// Counting sort the pairs into per cluster lists
+	m_grid.resize(NUM_CLUSTERS * 2);
+	uint offset = 0;
+	for (uint i = 0; i < NUM_CLUSTERS; ++i) {
+		m_grid[i * 2] = offset;
+		m_grid[i * 2 + 1] = 0;
+		offset += m_counts[i];
+	}
+	m_indices.resize(glm::max(offset, 1u));
+	for (auto& pair : m_pairs) {
+		uint* cell = &m_grid[pair.x * 2];
+		m_indices[cell[0] + cell[1]++] = pair.y;
+	}
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include "common.hpp"
+
+struct Light;
+
+// Clustered light assignment for forward shading. The view frustum is split
+// into screen space tiles and exponential depth slices, and each cluster
+// gets a list of the lights whose sphere of influence touches it.
+class LightGrid
+{
+public:
+	static const int TILES_X = 16;
+	static const int TILES_Y = 9;
+	static const int SLICES = 24;
+	static const int NUM_CLUSTERS = TILES_X * TILES_Y * SLICES;
+
+	void build(const mat4& view, const mat4& projection, float near, float far, const Light* lights, uint numLights);
+
+	// Per cluster offset and count into indices()
+	const std::vector<uint>& grid() const { return m_grid; }
+	const std::vector<uint>& indices() const { return m_indices; }
+	uint assignments() const { return m_pairs.size(); }
+	// Slice index = log(depth) * sliceScale + sliceBias
+	float sliceScale() const { return m_sliceScale; }
+	float sliceBias() const { return m_sliceBias; }
+
+private:
+	void updateClusterBounds(const mat4& projection, float near, float far);
+	int slice(float depth) const;
+
+	struct Bounds { vec3 min, max; };
+	std::vector<Bounds> m_clusterBounds; // View space
+	mat4 m_projection;
+	float m_near = 0.f;
+	float m_far = 0.f;
+	float m_sliceScale = 0.f;
+	float m_sliceBias = 0.f;
+	std::vector<uint> m_grid;
+	std::vector<uint> m_indices;
+	std::vector<uint> m_counts;
+	std::vector<glm::uvec2> m_pairs; // Cluster, light
+};
@@ -8,6 +8,7 @@ enum Technique {
 	TECH_REFLECTION,
 	TECH_DEPTH,
 	TECH_DEPTH_CUBE,
+	TECH_GBUFFER,
 	NUM_TECHNIQUES
 };
 
@@ -48,6 +49,7 @@ struct Material
 	};
 	uint flags = DIRTY_MAPS | CAST_SHADOW | RECEIVE_SHADOW;
 
-	int shaderId[NUM_TECHNIQUES] = { -1, -1, -1, -1 }; // Automatic
+	int shaderId[NUM_TECHNIQUES] = { -1, -1, -1, -1, -1 }; // Automatic
+	int blockId = -1; // Constant block slot in the renderer's material buffer, automatic
 	string shaderName = "";
 };
@@ -0,0 +1,267 @@
+#include "meshoptimize.hpp"
+#include "geometry.hpp"
+#include <algorithm>
+#include <numeric>
+#include <cstring>
+
+namespace {
+	const uint CACHE_SIZE = 32; // LRU cache the triangle order is scored against
+	const uint FIFO_SIZE = 16; // Cache for the miss counts and cluster cuts
+	const float LAST_TRIANGLE_SCORE = 0.75f; // Vertices of the last triangle, scored lower to avoid strips
+	const float CACHE_DECAY_POWER = 1.5f;
+	const float VALENCE_BOOST_SCALE = 2.f; // Favors vertices with few triangles left
+	const float VALENCE_BOOST_POWER = 0.5f;
+	const float CLUSTER_THRESHOLD = 1.05f; // Cluster ACMR allowed over the whole mesh's before cutting
+
+	float vertexScore(int cachePos, uint valence) {
+		if (!valence)
+			return -1.f;
+		float score = 0.f;
+		if (cachePos >= 3)
+			score = glm::pow(1.f - (cachePos - 3) / (float)(CACHE_SIZE - 3), CACHE_DECAY_POWER);
+		else if (cachePos >= 0)
+			score = LAST_TRIANGLE_SCORE;
+		return score + VALENCE_BOOST_SCALE * glm::pow((float)valence, -VALENCE_BOOST_POWER);
+	}
+
+	// A vertex stays cached for FIFO_SIZE misses after its own, restarting skips time ahead
+	struct FifoCache {
+		std::vector<uint> stamps;
+		uint time = FIFO_SIZE + 1;
+
+		FifoCache(uint numVertices): stamps(numVertices, 0) {}
+		bool miss(uint v) {
+			if (time - stamps[v] <= FIFO_SIZE)
+				return false;
+			stamps[v] = time++;
+			return true;
+		}
+		void restart() { time += FIFO_SIZE + 1; }
+	};
+
+	uint countMisses(const std::vector<uint>& indices, uint numVertices) {
+		FifoCache cache(numVertices);
+		uint misses = 0;
+		for (uint v : indices)
+			misses += cache.miss(v);
+		return misses;
+	}
+
+	// Greedily takes the triangle whose vertices score best, only looking at the triangles
+	// around the cache. When none of them is left it continues in input order.
+	void cacheOrder(std::vector<uint>& indices, uint numVertices) {
+		uint numTris = indices.size() / 3;
+		// Live triangles of each vertex come first in its adjacency range
+		std::vector<uint> valence(numVertices, 0);
+		std::vector<uint> offsets(numVertices + 1, 0);
+		std::vector<uint> adjacency(indices.size());
+		for (uint v : indices)
+			valence[v]++;
+		for (uint v = 0; v < numVertices; ++v)
+			offsets[v + 1] = offsets[v] + valence[v];
+		std::vector<uint> fill(offsets.begin(), offsets.end() - 1);
+		for (uint i = 0; i < indices.size(); ++i)
+			adjacency[fill[indices[i]]++] = i / 3;
+
+		std::vector<int> cachePos(numVertices, -1);
+		std::vector<float> scores(numVertices);
+		for (uint v = 0; v < numVertices; ++v)
+			scores[v] = vertexScore(-1, valence[v]);
+		auto triangleScore = [&](uint t) {
+			return scores[indices[t * 3]] + scores[indices[t * 3 + 1]] + scores[indices[t * 3 + 2]];
+		};
+		int best = 0;
+		for (uint t = 1; t < numTris; ++t)
+			if (triangleScore(t) > triangleScore(best))
+				best = t;
+
+		std::vector<bool> emitted(numTris, false);
+		std::vector<uint> cache, newCache;
+		std::vector<uint> result;
+		result.reserve(indices.size());
+		uint cursor = 0;
+		while (result.size() < indices.size()) {
+			if (best < 0) {
+				while (emitted[cursor])
+					++cursor;
+				best = cursor;
+			}
+			emitted[best] = true;
+			newCache.clear();
+			for (uint k = 0; k < 3; ++k) {
+				uint v = indices[best * 3 + k];
+				result.push_back(v);
+				if (std::find(newCache.begin(), newCache.end(), v) == newCache.end())
+					newCache.push_back(v);
+				uint* tris = &adjacency[offsets[v]];
+				uint* end = tris + valence[v];
+				std::swap(*std::find(tris, end, (uint)best), *(end - 1));
+				valence[v]--;
+			}
+			uint numNew = newCache.size();
+			for (uint v : cache)
+				if (std::find(newCache.begin(), newCache.begin() + numNew, v) == newCache.begin() + numNew)
+					newCache.push_back(v);
+			for (uint i = CACHE_SIZE; i < newCache.size(); ++i) {
+				cachePos[newCache[i]] = -1;
+				scores[newCache[i]] = vertexScore(-1, valence[newCache[i]]);
+			}
+			newCache.resize(glm::min((uint)newCache.size(), CACHE_SIZE));
+			cache.swap(newCache);
+			for (uint i = 0; i < cache.size(); ++i) {
+				cachePos[cache[i]] = i;
+				scores[cache[i]] = vertexScore(i, valence[cache[i]]);
+			}
+
+			best = -1;
+			float bestScore = -1.f;
+			for (uint v : cache) {
+				for (uint i = offsets[v]; i < offsets[v] + valence[v]; ++i) {
+					float score = triangleScore(adjacency[i]);
+					if (score > bestScore) {
+						best = adjacency[i];
+						bestScore = score;
+					}
+				}
+			}
+		}
+		indices.swap(result);
+	}
+
+	// Cuts the cache order where a cluster restarted with a cold cache has caught up with the
+	// whole mesh's miss ratio, then draws the clusters facing away from the center first, as
+	// they are the likely occluders from any direction
+	void overdrawOrder(std::vector<uint>& indices, const std::vector<vec3>& positions) {
+		uint numTris = indices.size() / 3;
+		float target = (float)countMisses(indices, positions.size()) / numTris * CLUSTER_THRESHOLD;
+		std::vector<uint> starts;
+		FifoCache cache(positions.size());
+		uint misses = 0, clusterTris = 0;
+		for (uint t = 0; t < numTris; ++t) {
+			if (!clusterTris) {
+				starts.push_back(t);
+				cache.restart();
+				misses = 0;
+			}
+			for (uint k = 0; k < 3; ++k)
+				misses += cache.miss(indices[t * 3 + k]);
+			if ((float)misses / ++clusterTris <= target)
+				clusterTris = 0;
+		}
+		if (starts.size() < 2)
+			return;
+		starts.push_back(numTris);
+
+		vec3 meshCenter(0.f);
+		for (uint v : indices)
+			meshCenter += positions[v];
+		meshCenter /= (float)indices.size();
+		uint numClusters = starts.size() - 1;
+		std::vector<float> keys(numClusters);
+		for (uint c = 0; c < numClusters; ++c) {
+			vec3 center(0.f), normal(0.f);
+			float area = 0.f;
+			for (uint t = starts[c]; t < starts[c + 1]; ++t) {
+				vec3 p0 = positions[indices[t * 3]], p1 = positions[indices[t * 3 + 1]], p2 = positions[indices[t * 3 + 2]];
+				vec3 cross = glm::cross(p1 - p0, p2 - p0);
+				float triArea = glm::length(cross);
+				center += (p0 + p1 + p2) * (triArea / 3.f);
+				normal += cross;
+				area += triArea;
+			}
+			float normalLength = glm::length(normal);
+			keys[c] = area > 0.f && normalLength > 0.f ? glm::dot(center / area - meshCenter, normal / normalLength) : 0.f;
+		}
+		std::vector<uint> order(numClusters);
+		std::iota(order.begin(), order.end(), 0);
+		std::stable_sort(order.begin(), order.end(), [&](uint a, uint b) { return keys[a] > keys[b]; });
+		std::vector<uint> result;
+		result.reserve(indices.size());
+		for (uint c : order)
+			result.insert(result.end(), indices.begin() + starts[c] * 3, indices.begin() + starts[c + 1] * 3);
+		indices.swap(result);
+	}
+
+	template<typename T>
+	void reorder(std::vector<T>& data, const std::vector<uint>& order) {
+		if (data.empty())
+			return;
+		std::vector<T> result;
+		result.reserve(order.size());
+		for (uint i : order)
+			result.push_back(data[i]);
+		data.swap(result);
+	}
+}
+
+void optimizeBatch(Batch& batch)
+{
+	ASSERT(!batch.positions.empty() && !batch.vertexData.empty());
+	uint numVerts = batch.numVertices;
+	uint vertexSize = batch.vertexSize;
+	const char* data = &batch.vertexData[0];
+
+	// Weld by sorting on the uploaded bytes, equal neighbours become one vertex
+	std::vector<uint> sorted(numVerts);
+	std::iota(sorted.begin(), sorted.end(), 0);
+	std::sort(sorted.begin(), sorted.end(), [&](uint a, uint b) {
+		int order = memcmp(data + a * vertexSize, data + b * vertexSize, vertexSize);
+		return order < 0 || (order == 0 && a < b);
+	});
+	std::vector<uint> remap(numVerts);
+	std::vector<uint> sources; // First source vertex of each welded one
+	for (uint i = 0; i < numVerts; ++i) {
+		uint v = sorted[i];
+		if (!i || memcmp(data + v * vertexSize, data + sources.back() * vertexSize, vertexSize))
+			sources.push_back(v);
+		remap[v] = sources.size() - 1;
+	}
+
+	// Welding can leave zero area triangles with a repeated index, they draw nothing
+	std::vector<uint> indices;
+	uint numIndices = batch.indices.empty() ? numVerts : batch.indices.size();
+	indices.reserve(numIndices);
+	for (uint i = 0; i + 2 < numIndices; i += 3) {
+		uint tri[3];
+		for (uint k = 0; k < 3; ++k)
+			tri[k] = remap[batch.indices.empty() ? i + k : batch.indices[i + k]];
+		if (tri[0] == tri[1] || tri[1] == tri[2] || tri[2] == tri[0])
+			continue;
+		indices.insert(indices.end(), tri, tri + 3);
+	}
+
+	if (indices.empty())
+		return;
+	std::vector<vec3> positions;
+	for (uint v : sources)
+		positions.push_back(batch.positions[v]);
+	cacheOrder(indices, sources.size());
+	overdrawOrder(indices, positions);
+
+	// Vertices in order of first use, unused ones are dropped
+	std::vector<uint> newIndex(sources.size(), ~0u);
+	std::vector<uint> used;
+	for (uint& v : indices) {
+		if (newIndex[v] == ~0u) {
+			newIndex[v] = used.size();
+			used.push_back(sources[v]);
+		}
+		v = newIndex[v];
+	}
+	reorder(batch.positions, used);
+	reorder(batch.texcoords, used);
+	reorder(batch.normals, used);
+	reorder(batch.tangents, used);
+	reorder(batch.colors, used);
+	reorder(batch.boneindices, used);
+	reorder(batch.boneweights, used);
+	batch.indices.swap(indices);
+	batch.setupAttributes();
+}
+
+uint vertexCacheMisses(const Batch& batch)
+{
+	if (batch.indices.empty())
+		return batch.numVertices;
+	return countMisses(batch.indices, batch.numVertices);
+}
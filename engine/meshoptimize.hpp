@@ -0,0 +1,14 @@
+#pragma once
+#include "common.hpp"
+
+struct Batch;
+
+// Reorders a batch for the GPU at load time. Identical vertices are welded into an index buffer
+// first, so triangle soups come out indexed. Triangles are then ordered for the post-transform
+// vertex cache (Forsyth's linear-speed optimizer), the order is cut into clusters where a cold
+// cache costs little and the clusters are sorted outward facing first to cut overdraw (Sander et
+// al. 2007). Finally vertices are renumbered in order of first use for fetch locality.
+void optimizeBatch(Batch& batch);
+// Vertices transformed with a FIFO cache of typical hardware size, divide by the triangles for
+// the ACMR (3 is the worst)
+uint vertexCacheMisses(const Batch& batch);
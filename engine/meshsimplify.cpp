@@ -0,0 +1,326 @@
+#include "meshsimplify.hpp"
+#include "geometry.hpp"
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+
+namespace {
+	const float SEAM_WEIGHT = 10.f; // Of the planes keeping seams in shape, relative to the surface
+	const float MAX_TURN_COS = 0.25f;
+
+	// Symmetric 4x4 matrix as its upper triangle
+	struct Quadric {
+		double a2 = 0, ab = 0, ac = 0, ad = 0, b2 = 0, bc = 0, bd = 0, c2 = 0, cd = 0, d2 = 0;
+
+		void addPlane(vec3 n, float d, float weight) {
+			a2 += weight * n.x * n.x; ab += weight * n.x * n.y; ac += weight * n.x * n.z; ad += weight * n.x * d;
+			b2 += weight * n.y * n.y; bc += weight * n.y * n.z; bd += weight * n.y * d;
+			c2 += weight * n.z * n.z; cd += weight * n.z * d;
+			d2 += weight * d * d;
+		}
+
+		void add(const Quadric& q) {
+			a2 += q.a2; ab += q.ab; ac += q.ac; ad += q.ad;
+			b2 += q.b2; bc += q.bc; bd += q.bd;
+			c2 += q.c2; cd += q.cd;
+			d2 += q.d2;
+		}
+
+		// Weighted sum of squared distances to the planes
+		double error(vec3 p) const {
+			double x = p.x, y = p.y, z = p.z;
+			return a2 * x * x + b2 * y * y + c2 * z * z + d2
+				+ 2.0 * (ab * x * y + ac * x * z + bc * y * z + ad * x + bd * y + cd * z);
+		}
+	};
+
+	enum VertexKind {
+		MANIFOLD, // Collapses anywhere
+		SEAM, // Two vertices at one position, collapse together along the seam
+		LOCKED // Border, non-manifold or more than two vertices at one position
+	};
+
+	struct Collapse {
+		uint from;
+		uint to;
+		double error;
+	};
+
+	// Index of an existing equal item or next if there is none. Hash collisions probe the next key.
+	template<typename Equal>
+	uint findOrAdd(std::unordered_map<uint64, uint>& map, uint64 key, uint next, Equal equal) {
+		for (;; ++key) {
+			auto it = map.find(key);
+			if (it == map.end()) {
+				map[key] = next;
+				return next;
+			}
+			if (equal(it->second))
+				return it->second;
+		}
+	}
+
+	uint64 edgeKey(uint a, uint b) {
+		return (uint64)a << 32 | b;
+	}
+
+	template<typename T>
+	void gather(std::vector<T>& dst, const std::vector<T>& src, const std::vector<uint>& indices) {
+		if (src.empty())
+			return;
+		dst.reserve(indices.size());
+		for (uint i : indices)
+			dst.push_back(src[i]);
+	}
+}
+
+uint simplifyBatch(const Batch& source, Batch& result, float ratio)
+{
+	ASSERT(!source.positions.empty() && !source.vertexData.empty());
+	const std::vector<vec3>& positions = source.positions;
+	uint numIndices = source.indices.empty() ? positions.size() : source.indices.size();
+	auto sourceIndex = [&](uint i) { return source.indices.empty() ? i : source.indices[i]; };
+
+	// Weld vertices with identical attributes, and separately the ones sharing a position
+	uint vertexSize = source.vertexSize;
+	std::vector<uint> weld(positions.size());
+	std::vector<uint> sources; // Source vertex of each welded one
+	std::vector<uint> posIds; // Position of each welded vertex
+	std::vector<uint> posSources; // Source vertex of each position
+	std::unordered_map<uint64, uint> vertexMap, positionMap;
+	for (uint i = 0; i < positions.size(); ++i) {
+		const char* data = &source.vertexData[i * vertexSize];
+		uint v = findOrAdd(vertexMap, id::hash64(data, vertexSize), sources.size(), [&](uint other) {
+			return !std::memcmp(data, &source.vertexData[sources[other] * vertexSize], vertexSize);
+		});
+		weld[i] = v;
+		if (v < sources.size())
+			continue;
+		sources.push_back(i);
+		uint p = findOrAdd(positionMap, id::hash64(&positions[i], sizeof(vec3)), posSources.size(), [&](uint other) {
+			return positions[posSources[other]] == positions[i];
+		});
+		if (p == posSources.size())
+			posSources.push_back(i);
+		posIds.push_back(p);
+	}
+	uint numVerts = sources.size();
+	uint numPositions = posSources.size();
+	auto position = [&](uint v) -> const vec3& { return positions[sources[v]]; };
+
+	std::vector<uint> tris;
+	tris.reserve(numIndices);
+	for (uint i = 0; i + 2 < numIndices; i += 3) {
+		uint a = weld[sourceIndex(i)], b = weld[sourceIndex(i + 1)], c = weld[sourceIndex(i + 2)];
+		if (posIds[a] == posIds[b] || posIds[b] == posIds[c] || posIds[c] == posIds[a])
+			continue;
+		tris.push_back(a);
+		tris.push_back(b);
+		tris.push_back(c);
+	}
+	uint numTris = tris.size() / 3;
+	uint target = glm::max((uint)(numTris * ratio), 1u);
+
+	// Vertices at the same position form a ring through wedge
+	std::vector<uint> wedge(numVerts);
+	std::vector<uint> firstWedge(numPositions, ~0u);
+	std::vector<uint> wedgeCount(numPositions, 0);
+	for (uint v = 0; v < numVerts; ++v) {
+		uint& first = firstWedge[posIds[v]];
+		if (first == ~0u) {
+			first = v;
+			wedge[v] = v;
+		} else {
+			wedge[v] = wedge[first];
+			wedge[first] = v;
+		}
+		wedgeCount[posIds[v]]++;
+	}
+
+	// Position edges without a twin going the other way are borders
+	std::unordered_map<uint64, uint> posEdges;
+	std::unordered_map<uint64, uint> vertexEdges;
+	for (uint i = 0; i < tris.size(); ++i) {
+		uint a = tris[i], b = tris[i / 3 * 3 + (i + 1) % 3];
+		posEdges[edgeKey(posIds[a], posIds[b])]++;
+		vertexEdges[edgeKey(a, b)]++;
+	}
+	std::vector<bool> lockedPos(numPositions, false);
+	for (auto& edge : posEdges) {
+		uint a = edge.first >> 32, b = edge.first & 0xffffffff;
+		if (edge.second > 1 || posEdges.find(edgeKey(b, a)) == posEdges.end())
+			lockedPos[a] = lockedPos[b] = true;
+	}
+	std::vector<uint8> kinds(numVerts);
+	for (uint v = 0; v < numVerts; ++v) {
+		uint p = posIds[v];
+		kinds[v] = lockedPos[p] || wedgeCount[p] > 2 ? LOCKED : wedgeCount[p] == 2 ? SEAM : MANIFOLD;
+	}
+
+	// Area weighted planes of the triangles, plus planes along seam edges to keep them in place
+	std::vector<Quadric> quadrics(numPositions);
+	for (uint i = 0; i < tris.size(); i += 3) {
+		vec3 a = position(tris[i]), b = position(tris[i + 1]), c = position(tris[i + 2]);
+		vec3 normal = glm::cross(b - a, c - a);
+		float area = glm::length(normal);
+		if (area <= 0.f)
+			continue;
+		normal /= area;
+		for (int j = 0; j < 3; ++j)
+			quadrics[posIds[tris[i + j]]].addPlane(normal, -glm::dot(normal, a), area * 0.5f);
+		for (int j = 0; j < 3; ++j) {
+			uint from = tris[i + j], to = tris[i + (j + 1) % 3];
+			if (vertexEdges.find(edgeKey(to, from)) != vertexEdges.end())
+				continue;
+			vec3 edge = position(to) - position(from);
+			vec3 seamNormal = glm::normalize(glm::cross(edge, normal));
+			float weight = glm::length2(edge) * SEAM_WEIGHT;
+			quadrics[posIds[from]].addPlane(seamNormal, -glm::dot(seamNormal, position(from)), weight);
+			quadrics[posIds[to]].addPlane(seamNormal, -glm::dot(seamNormal, position(from)), weight);
+		}
+	}
+
+	std::vector<uint> adjOffsets(numVerts + 1);
+	std::vector<uint> adjTris;
+	std::vector<uint> adjFill;
+	std::vector<uint> remap(numVerts);
+	std::vector<bool> locked(numVerts);
+	std::vector<Collapse> collapses;
+	while (numTris > target) {
+		// Triangles around each vertex
+		std::fill(adjOffsets.begin(), adjOffsets.end(), 0);
+		for (uint v : tris)
+			adjOffsets[v + 1]++;
+		for (uint v = 0; v < numVerts; ++v)
+			adjOffsets[v + 1] += adjOffsets[v];
+		adjTris.resize(tris.size());
+		adjFill.assign(adjOffsets.begin(), adjOffsets.end() - 1);
+		for (uint i = 0; i < tris.size(); ++i)
+			adjTris[adjFill[tris[i]]++] = i / 3;
+
+		auto hasEdge = [&](uint a, uint b) {
+			for (uint i = adjOffsets[a]; i < adjOffsets[a + 1]; ++i) {
+				const uint* tri = &tris[adjTris[i] * 3];
+				if (tri[0] == b || tri[1] == b || tri[2] == b)
+					return true;
+			}
+			return false;
+		};
+		// Where the other vertex of a seam goes, -1 if the collapse doesn't follow the seam
+		auto seamTarget = [&](uint from, uint to) {
+			if (kinds[to] != SEAM || !hasEdge(wedge[from], wedge[to]))
+				return -1;
+			return (int)wedge[to];
+		};
+		auto flips = [&](uint from, uint to) {
+			vec3 target = position(to);
+			for (uint i = adjOffsets[from]; i < adjOffsets[from + 1]; ++i) {
+				const uint* tri = &tris[adjTris[i] * 3];
+				vec3 p[3];
+				bool removed = false;
+				for (int j = 0; j < 3; ++j) {
+					removed |= posIds[tri[j]] == posIds[to];
+					p[j] = position(tri[j]);
+				}
+				if (removed)
+					continue;
+				vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+				for (int j = 0; j < 3; ++j)
+					if (tri[j] == from)
+						p[j] = target;
+				// Turning a triangle by more than ~75 degrees tends to fold the surface over
+				vec3 after = glm::cross(p[1] - p[0], p[2] - p[0]);
+				if (glm::dot(before, after) <= MAX_TURN_COS * glm::length(before) * glm::length(after))
+					return true;
+			}
+			return false;
+		};
+
+		collapses.clear();
+		for (uint i = 0; i < tris.size(); ++i) {
+			uint a = tris[i], b = tris[i / 3 * 3 + (i + 1) % 3];
+			for (int dir = 0; dir < 2; ++dir) {
+				uint from = dir ? b : a, to = dir ? a : b;
+				if (kinds[from] == LOCKED || (kinds[from] == SEAM && seamTarget(from, to) < 0))
+					continue;
+				collapses.push_back({ from, to, quadrics[posIds[from]].error(position(to)) });
+			}
+		}
+		std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) {
+			return a.error < b.error;
+		});
+
+		// A collapse removes about two triangles. Vertices around a collapse are locked for the rest
+		// of the pass, so the adjacency and errors above stay valid.
+		uint budget = (numTris - target + 1) / 2;
+		uint applied = 0;
+		for (uint v = 0; v < numVerts; ++v)
+			remap[v] = v;
+		std::fill(locked.begin(), locked.end(), false);
+		for (const Collapse& collapse : collapses) {
+			if (applied >= budget)
+				break;
+			uint from = collapse.from, to = collapse.to;
+			if (locked[from] || locked[to])
+				continue;
+			bool seam = kinds[from] == SEAM;
+			int twinTo = seam ? seamTarget(from, to) : -1;
+			uint twin = wedge[from];
+			if (seam && (locked[twin] || locked[twinTo]))
+				continue;
+			if (flips(from, to) || (seam && flips(twin, twinTo)))
+				continue;
+			for (uint v : { from, twin }) {
+				for (uint i = adjOffsets[v]; i < adjOffsets[v + 1]; ++i)
+					for (int j = 0; j < 3; ++j)
+						locked[tris[adjTris[i] * 3 + j]] = true;
+			}
+			locked[to] = true;
+			remap[from] = to;
+			if (seam) {
+				locked[twinTo] = true;
+				remap[twin] = twinTo;
+			}
+			quadrics[posIds[to]].add(quadrics[posIds[from]]);
+			++applied;
+		}
+		if (!applied)
+			break;
+
+		uint count = 0;
+		for (uint i = 0; i < tris.size(); i += 3) {
+			uint a = remap[tris[i]], b = remap[tris[i + 1]], c = remap[tris[i + 2]];
+			if (posIds[a] == posIds[b] || posIds[b] == posIds[c] || posIds[c] == posIds[a])
+				continue;
+			tris[count++] = a;
+			tris[count++] = b;
+			tris[count++] = c;
+		}
+		tris.resize(count);
+		numTris = count / 3;
+	}
+
+	// Keep the vertices still in use, in order of first use
+	std::vector<uint> newIndex(numVerts, ~0u);
+	std::vector<uint> used;
+	result.indices.clear();
+	result.indices.reserve(tris.size());
+	for (uint v : tris) {
+		if (newIndex[v] == ~0u) {
+			newIndex[v] = used.size();
+			used.push_back(sources[v]);
+		}
+		result.indices.push_back(newIndex[v]);
+	}
+	gather(result.positions, source.positions, used);
+	gather(result.texcoords, source.texcoords, used);
+	gather(result.normals, source.normals, used);
+	gather(result.tangents, source.tangents, used);
+	gather(result.colors, source.colors, used);
+	gather(result.boneindices, source.boneindices, used);
+	gather(result.boneweights, source.boneweights, used);
+	result.materialIndex = source.materialIndex;
+	result.name = source.name;
+	result.setupAttributes();
+	return numTris;
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include "common.hpp"
+
+struct Batch;
+
+// Quadric error metric simplification (Garland & Heckbert) by half-edge collapses, so the
+// result only uses vertices of the source and keeps their attributes as they are. Vertices
+// are welded by all attributes first. Vertices on a UV or normal seam only collapse along
+// the seam, together with their twin on the other side, and open borders are locked so
+// batches of different materials still meet. Ratio is the wanted fraction of triangles,
+// returns the number of triangles in the result.
+uint simplifyBatch(const Batch& source, Batch& result, float ratio);
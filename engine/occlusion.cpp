@@ -0,0 +1,248 @@
+#include "occlusion.hpp"
+#include "geometry.hpp"
+#include "threadpool.hpp"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+	const float s_minW = 1e-5f;
+
+	inline vec3 toScreen(const vec4& clip) {
+		float invW = 1.f / clip.w;
+		return vec3(
+			(clip.x * invW * 0.5f + 0.5f) * OcclusionBuffer::WIDTH,
+			(clip.y * invW * 0.5f + 0.5f) * OcclusionBuffer::HEIGHT,
+			clip.z * invW * 0.5f + 0.5f);
+	}
+
+	// Edge function e(x, y) = a * x + b * y + c, positive on the left of p -> q.
+	// Computed in a canonical vertex order so that an edge shared by two
+	// triangles gives exactly negated values and leaves no cracks.
+	struct Edge { float a, b, c; };
+
+	inline Edge makeEdge(const vec3& p, const vec3& q) {
+		bool swap = q.y < p.y || (q.y == p.y && q.x < p.x);
+		const vec3& u = swap ? q : p;
+		const vec3& v = swap ? p : q;
+		Edge e = { u.y - v.y, v.x - u.x, u.x * v.y - v.x * u.y };
+		if (swap) {
+			e.a = -e.a; e.b = -e.b; e.c = -e.c;
+		}
+		return e;
+	}
+}
+
+OcclusionBuffer::OcclusionBuffer()
+{
+	int w = WIDTH, h = HEIGHT;
+	while (true) {
+		m_levels.emplace_back(w * h, 1.f);
+		if (w == 1 && h == 1)
+			break;
+		w = glm::max(w / 2, 1);
+		h = glm::max(h / 2, 1);
+	}
+}
+
+void OcclusionBuffer::clear(const mat4& viewProj)
+{
+	m_viewProj = viewProj;
+	m_triangles.clear();
+}
+
+void OcclusionBuffer::addOccluder(const Geometry& geometry, const mat4& modelMatrix)
+{
+	mat4 mvp = m_viewProj * modelMatrix;
+	std::vector<vec4> clipPos;
+	for (auto& batch : geometry.batches) {
+		clipPos.resize(batch.positions.size());
+		for (uint i = 0; i < batch.positions.size(); ++i)
+			clipPos[i] = mvp * vec4(batch.positions[i], 1.f);
+		if (batch.indices.empty()) {
+			for (uint i = 0; i + 2 < clipPos.size(); i += 3)
+				addTriangle(clipPos[i], clipPos[i+1], clipPos[i+2]);
+		} else {
+			for (uint i = 0; i + 2 < batch.indices.size(); i += 3)
+				addTriangle(clipPos[batch.indices[i]], clipPos[batch.indices[i+1]], clipPos[batch.indices[i+2]]);
+		}
+	}
+}
+
+void OcclusionBuffer::addTriangle(vec4 a, vec4 b, vec4 c)
+{
+	// Clip against the near plane (z = -w), which can produce a quad
+	vec4 in[3] = { a, b, c };
+	vec4 out[4];
+	int count = 0;
+	for (int i = 0; i < 3; ++i) {
+		const vec4& p = in[i];
+		const vec4& q = in[(i + 1) % 3];
+		float dp = p.z + p.w;
+		float dq = q.z + q.w;
+		if (dp >= 0.f)
+			out[count++] = p;
+		if ((dp >= 0.f) != (dq >= 0.f))
+			out[count++] = glm::mix(p, q, dp / (dp - dq));
+	}
+	if (count < 3)
+		return;
+
+	vec3 screen[4];
+	for (int i = 0; i < count; ++i) {
+		if (out[i].w < s_minW)
+			return;
+		screen[i] = toScreen(out[i]);
+	}
+	for (int i = 1; i + 1 < count; ++i) {
+		const vec3& p0 = screen[0];
+		const vec3& p1 = screen[i];
+		const vec3& p2 = screen[i+1];
+		// Back face culling (front faces are counter-clockwise)
+		float area = (p1.x - p0.x) * (p2.y - p0.y) - (p2.x - p0.x) * (p1.y - p0.y);
+		if (area <= 0.f)
+			continue;
+		// Trivial rejection
+		if (glm::max(p0.x, glm::max(p1.x, p2.x)) < 0.f || glm::min(p0.x, glm::min(p1.x, p2.x)) > WIDTH ||
+			glm::max(p0.y, glm::max(p1.y, p2.y)) < 0.f || glm::min(p0.y, glm::min(p1.y, p2.y)) > HEIGHT)
+			continue;
+		m_triangles.push_back(p0);
+		m_triangles.push_back(p1);
+		m_triangles.push_back(p2);
+	}
+}
+
+void OcclusionBuffer::rasterize(thread_pool* threadpool)
+{
+	std::vector<float>& depth = m_levels[0];
+	std::fill(depth.begin(), depth.end(), 1.f);
+	for (int y = 0; y < HEIGHT; y += BAND_HEIGHT) {
+		int y1 = glm::min(y + BAND_HEIGHT, (int)HEIGHT);
+		if (threadpool)
+			threadpool->enqueue([this, y, y1]() { rasterizeBand(y, y1); });
+		else rasterizeBand(y, y1);
+	}
+	if (threadpool)
+		threadpool->sync();
+	buildHierarchy();
+}
+
+void OcclusionBuffer::rasterizeBand(int y0, int y1)
+{
+	float* depth = &m_levels[0][0];
+	for (uint t = 0; t < m_triangles.size(); t += 3) {
+		const vec3& p0 = m_triangles[t];
+		const vec3& p1 = m_triangles[t+1];
+		const vec3& p2 = m_triangles[t+2];
+
+		int minY = glm::max(y0, (int)glm::floor(glm::min(p0.y, glm::min(p1.y, p2.y))));
+		int maxY = glm::min(y1 - 1, (int)glm::floor(glm::max(p0.y, glm::max(p1.y, p2.y))));
+		if (minY > maxY)
+			continue;
+		int minX = glm::max(0, (int)glm::floor(glm::min(p0.x, glm::min(p1.x, p2.x))));
+		int maxX = glm::min(WIDTH - 1, (int)glm::floor(glm::max(p0.x, glm::max(p1.x, p2.x))));
+		if (minX > maxX)
+			continue;
+		minX &= ~3; // Align to SIMD width
+
+		// Edge functions, positive inside
+		Edge e0 = makeEdge(p1, p2), e1 = makeEdge(p2, p0), e2 = makeEdge(p0, p1);
+		float a0 = e0.a, b0 = e0.b, c0 = e0.c;
+		float a1 = e1.a, b1 = e1.b, c1 = e1.c;
+		float a2 = e2.a, b2 = e2.b, c2 = e2.c;
+		float invArea = 1.f / (c0 + c1 + c2);
+		// Depth plane z(x, y) = zx * x + zy * y + zc
+		float zx = (a0 * p0.z + a1 * p1.z + a2 * p2.z) * invArea;
+		float zy = (b0 * p0.z + b1 * p1.z + b2 * p2.z) * invArea;
+		float zc = (c0 * p0.z + c1 * p1.z + c2 * p2.z) * invArea;
+
+		for (int y = minY; y <= maxY; ++y) {
+			float py = y + 0.5f;
+			float* row = depth + y * WIDTH;
+#ifdef __SSE2__
+			const __m128 xOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+			const __m128 zero = _mm_setzero_ps();
+			for (int x = minX; x <= maxX; x += 4) {
+				__m128 px = _mm_add_ps(_mm_set1_ps((float)x), xOffsets);
+				__m128 w0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a0), px), _mm_set1_ps(b0 * py + c0));
+				__m128 w1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a1), px), _mm_set1_ps(b1 * py + c1));
+				__m128 w2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a2), px), _mm_set1_ps(b2 * py + c2));
+				__m128 inside = _mm_and_ps(_mm_cmpge_ps(w0, zero), _mm_and_ps(_mm_cmpge_ps(w1, zero), _mm_cmpge_ps(w2, zero)));
+				if (_mm_movemask_ps(inside) == 0)
+					continue;
+				__m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(zx), px), _mm_set1_ps(zy * py + zc));
+				__m128 old = _mm_loadu_ps(row + x);
+				__m128 closer = _mm_min_ps(old, z);
+				_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, closer), _mm_andnot_ps(inside, old)));
+			}
+#else
+			for (int x = minX; x <= maxX; ++x) {
+				float px = x + 0.5f;
+				if (a0 * px + (b0 * py + c0) < 0.f || a1 * px + (b1 * py + c1) < 0.f || a2 * px + (b2 * py + c2) < 0.f)
+					continue;
+				float z = zx * px + zy * py + zc;
+				if (z < row[x])
+					row[x] = z;
+			}
+#endif
+		}
+	}
+}
+
+void OcclusionBuffer::buildHierarchy()
+{
+	int w = WIDTH, h = HEIGHT;
+	for (uint level = 1; level < m_levels.size(); ++level) {
+		const std::vector<float>& src = m_levels[level - 1];
+		std::vector<float>& dst = m_levels[level];
+		int dw = glm::max(w / 2, 1), dh = glm::max(h / 2, 1);
+		for (int y = 0; y < dh; ++y) {
+			int sy0 = glm::min(y * 2, h - 1), sy1 = glm::min(y * 2 + 1, h - 1);
+			for (int x = 0; x < dw; ++x) {
+				int sx0 = glm::min(x * 2, w - 1), sx1 = glm::min(x * 2 + 1, w - 1);
+				dst[y * dw + x] = glm::max(
+					glm::max(src[sy0 * w + sx0], src[sy0 * w + sx1]),
+					glm::max(src[sy1 * w + sx0], src[sy1 * w + sx1]));
+			}
+		}
+		w = dw; h = dh;
+	}
+}
+
+bool OcclusionBuffer::visible(const Bounds& bounds, const mat4& modelMatrix) const
+{
+	mat4 mvp = m_viewProj * modelMatrix;
+	vec2 rectMin(FLT_MAX), rectMax(-FLT_MAX);
+	float nearestZ = FLT_MAX;
+	for (int i = 0; i < 8; ++i) {
+		vec3 corner(
+			(i & 1) ? bounds.max.x : bounds.min.x,
+			(i & 2) ? bounds.max.y : bounds.min.y,
+			(i & 4) ? bounds.max.z : bounds.min.z);
+		vec4 clip = mvp * vec4(corner, 1.f);
+		if (clip.w < s_minW || clip.z < -clip.w)
+			return true; // Intersects near plane
+		vec3 p = toScreen(clip);
+		rectMin = glm::min(rectMin, vec2(p));
+		rectMax = glm::max(rectMax, vec2(p));
+		nearestZ = glm::min(nearestZ, p.z);
+	}
+	int x0 = glm::max(0, (int)glm::floor(rectMin.x));
+	int y0 = glm::max(0, (int)glm::floor(rectMin.y));
+	int x1 = glm::min(WIDTH - 1, (int)glm::floor(rectMax.x));
+	int y1 = glm::min(HEIGHT - 1, (int)glm::floor(rectMax.y));
+	if (x0 > x1 || y0 > y1)
+		return true; // Off screen, leave it to frustum culling
+
+	// Choose a level where the rectangle covers at most 3x3 texels
+	uint level = 0;
+	while (level + 1 < m_levels.size() && (glm::max(x1 - x0, y1 - y0) >> level) > 1)
+		++level;
+	int levelWidth = glm::max(WIDTH >> level, 1);
+	const std::vector<float>& hiz = m_levels[level];
+	for (int y = y0 >> level; y <= (y1 >> level); ++y)
+		for (int x = x0 >> level; x <= (x1 >> level); ++x)
+			if (nearestZ <= hiz[y * levelWidth + x])
+				return true;
+	return false;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include "common.hpp"
+
+struct Geometry;
+struct Bounds;
+class thread_pool;
+
+// Low resolution software depth buffer for CPU occlusion culling.
+// Occluder triangles are rasterized into it (in horizontal bands that can
+// run on worker threads) and a max-depth pyramid is built on top, which
+// is then used to conservatively test object bounding boxes.
+class OcclusionBuffer
+{
+public:
+	static const int WIDTH = 256;
+	static const int HEIGHT = 128;
+	static const int BAND_HEIGHT = 16;
+
+	OcclusionBuffer();
+
+	void clear(const mat4& viewProj);
+	void addOccluder(const Geometry& geometry, const mat4& modelMatrix);
+	void rasterize(thread_pool* threadpool = nullptr);
+	bool visible(const Bounds& bounds, const mat4& modelMatrix) const;
+
+	uint numTriangles() const { return m_triangles.size() / 3; }
+	const std::vector<float>& depth() const { return m_levels[0]; }
+
+private:
+	void addTriangle(vec4 a, vec4 b, vec4 c);
+	void rasterizeBand(int y0, int y1);
+	void buildHierarchy();
+
+	mat4 m_viewProj;
+	std::vector<vec3> m_triangles; // Screen space x, y in pixels and z in [0, 1]
+	std::vector<std::vector<float>> m_levels; // Level 0 is the full resolution buffer
+};
@@ -5,6 +5,7 @@
 #include "camera.hpp"
 #include "scene.hpp"
 #include "image.hpp"
+#include "engine.hpp"
 #include <algorithm>
 
 
@@ -29,10 +30,37 @@ private:
 
 
 
+const float RenderSystem::LOD_HYSTERESIS = 0.1f;
+const float RenderSystem::LOD_FULL_DETAIL_PIXELS = 256.f;
+const float RenderSystem::LOD_REFERENCE_SCALE = 1.732f * 1080.f; // 60 degree field of view at 1080p
+
 RenderSystem::RenderSystem(Resources& resources)
 {
 	m_device.reset(new RenderDevice(resources));
 	m_device->setEnvironment(&m_env);
+	settings.occlusionCulling = Engine::settings["renderer"]["occlusionCulling"].bool_value();
+	settings.gpuCulling = Engine::settings["renderer"]["gpuCulling"].bool_value();
+	settings.hizCulling = Engine::settings["renderer"]["hizCulling"].bool_value();
+	if (Engine::settings["renderer"]["shadowCaching"].is_bool())
+		settings.shadowCaching = Engine::settings["renderer"]["shadowCaching"].bool_value();
+	if (Engine::settings["renderer"]["lodBias"].is_number())
+		settings.lodBias = Engine::settings["renderer"]["lodBias"].number_value();
+	if (Engine::settings["renderer"]["shadowLodBias"].is_number())
+		settings.shadowLodBias = Engine::settings["renderer"]["shadowLodBias"].int_value();
+	if (Engine::settings["renderer"]["lodCrossFade"].is_bool())
+		settings.lodCrossFade = Engine::settings["renderer"]["lodCrossFade"].bool_value();
+	if (Engine::settings["renderer"]["impostorDistance"].is_number())
+		settings.impostorDistance = Engine::settings["renderer"]["impostorDistance"].number_value();
+	if (Engine::settings["renderer"]["reflectionFacesPerFrame"].is_number())
+		settings.reflectionFacesPerFrame = Engine::settings["renderer"]["reflectionFacesPerFrame"].int_value();
+	settings.temporalAA = Engine::settings["renderer"]["temporalAA"].bool_value();
+	settings.dynamicResolution = Engine::settings["renderer"]["dynamicResolution"].bool_value();
+	if (Engine::settings["renderer"]["targetFrameMs"].is_number())
+		settings.targetFrameMs = Engine::settings["renderer"]["targetFrameMs"].number_value();
+	if (Engine::settings["renderer"]["minResolutionScale"].is_number())
+		settings.minResolutionScale = Engine::settings["renderer"]["minResolutionScale"].number_value();
+	if (Engine::settings["renderer"]["detailQuality"].is_number())
+		settings.detailQuality = Engine::settings["renderer"]["detailQuality"].number_value();
 }
 
 RenderSystem::~RenderSystem()
@@ -47,6 +75,9 @@ void RenderSystem::reset(Entities& entities)
 		for (int i = 0; i < Model::MAX_LODS && model.lods[i].geometry; ++i)
 			m_device->destroyGeometry(*model.lods[i].geometry);
 	});
+	// Baked probes belong to the old scene, the next one bakes its own from scratch
+	m_device->createProbeArray(0);
+	m_probeValid = false;
 }
 
 void RenderSystem::toggleWireframe()
@@ -54,12 +85,174 @@ void RenderSystem::toggleWireframe()
 	m_device->toggleWireframe();
 }
 
+float RenderSystem::screenSize(const Model& model, const Transform& transform, vec3 eye, const mat4& projection, float viewHeight)
+{
+	float radius = model.bounds.radius;
+	if (projection[3][3] == 1.f)
+		return radius * projection[1][1] * viewHeight;
+	float distance = glm::max(glm::distance(eye, transform.position), radius);
+	return radius / distance * projection[1][1] * viewHeight;
+}
+
+int RenderSystem::selectLod(const Model& model, float pixels, int current) const
+{
+	int count = model.numLods();
+	pixels *= glm::exp2(-settings.lodBias);
+	int lod = 0;
+	for (; lod < count; ++lod) {
+		const Model::Lod& level = model.lods[lod];
+		// Only an authored distance on the last LOD culls
+		if (lod + 1 == count && level.distance <= 0.f)
+			break;
+		float threshold = level.distance > 0.f ? model.bounds.radius / level.distance * LOD_REFERENCE_SCALE
+			: LOD_FULL_DETAIL_PIXELS / (1 << lod);
+		threshold *= lod < current ? 1.f + LOD_HYSTERESIS : 1.f - LOD_HYSTERESIS;
+		if (pixels >= threshold)
+			break;
+	}
+	return lod;
+}
+
+Geometry* RenderSystem::lodGeometry(const Model& model, int lod)
+{
+	int count = model.numLods();
+	if (!count)
+		return model.geometry;
+	return model.lods[glm::clamp(lod, 0, count - 1)].geometry;
+}
+
+template<typename Filter>
+void RenderSystem::renderShadowCasters(Entities& entities, Filter filter)
+{
+	m_staticCasters.clear();
+	m_dynamicCasters.clear();
+	uint64 hash = 0;
+	if (settings.shadows) {
+		entities.for_each<Model, Transform>([&](Entity e, Model& model, Transform& transform) {
+			if (model.materials.empty() || !model.geometry || !filter(model, transform))
+				return;
+			BoneAnimation* animation = e.has<BoneAnimation>() ? &e.get<BoneAnimation>() : nullptr;
+			Geometry* geometry = animation ? model.geometry : lodGeometry(model, model.lod + settings.shadowLodBias);
+			if (!animation && model.staticFrames >= STATIC_CASTER_FRAMES) {
+				hash = id::hash64(&geometry, sizeof(geometry), hash);
+				hash = id::hash64(&transform.matrix, sizeof(transform.matrix), hash);
+				m_staticCasters.push_back({ &model, &transform, nullptr, geometry });
+			} else m_dynamicCasters.push_back({ &model, &transform, animation, geometry });
+		});
+	}
+	if (m_device->beginShadowCache(hash)) {
+		for (auto& caster : m_staticCasters)
+			m_device->renderShadow(*caster.model, *caster.transform, nullptr, caster.geometry);
+		m_device->flush();
+	}
+	m_device->endShadowCache(!m_dynamicCasters.empty());
+	for (auto& caster : m_dynamicCasters)
+		m_device->renderShadow(*caster.model, *caster.transform, caster.animation, caster.geometry);
+	m_device->flush();
+}
+
+void RenderSystem::renderReflection(Entities& entities, const std::vector<Light>& lights, vec3 position, int lodBias)
+{
+	Camera reflCam;
+	reflCam.makePerspective(glm::radians(90.0f), 1.f, 0.25f, 50.f);
+	reflCam.updateViewMatrix(position, quat());
+	m_device->setupRenderPass(reflCam, lights, TECH_REFLECTION);
+	entities.for_each<Model, Transform>([&](Entity e, Model& model, Transform& transform) {
+		float maxDist = model.bounds.radius + reflCam.far;
+		float distSq = glm::distance2(position, transform.position);
+		if (model.materials.empty() || !model.geometry || distSq >= maxDist * maxDist)
+			return;
+		if (e.has<BoneAnimation>()) {
+			m_device->render(model, transform, &e.get<BoneAnimation>());
+			return;
+		}
+		// Sized for the cube face, then coarser still
+		float pixels = screenSize(model, transform, position, reflCam.projection, m_device->reflectionSize());
+		int lod = selectLod(model, pixels, 0);
+		if (lod >= model.numLods())
+			return;
+		m_device->render(model, transform, nullptr, lodGeometry(model, lod + lodBias));
+	});
+	m_device->flush();
+	m_device->renderSkybox();
+}
+
+void RenderSystem::bakeReflectionProbes(Entities& entities, const std::vector<Light>& lights)
+{
+	uint count = 0;
+	bool pending = false;
+	entities.for_each<ReflectionProbe>([&](Entity, ReflectionProbe& probe) {
+		pending |= probe.index < 0;
+		++count;
+	});
+	if (!pending)
+		return;
+	if (count > MAX_PROBES) {
+		logError("Scene has %d reflection probes, only %d are used", count, MAX_PROBES);
+		count = MAX_PROBES;
+	}
+	m_device->createProbeArray(count);
+	m_device->reflectionFaces = RenderDevice::ALL_CUBE_FACES;
+	int index = 0;
+	entities.for_each<ReflectionProbe>([&](Entity, ReflectionProbe& probe) {
+		probe.index = index++;
+		if (probe.index >= MAX_PROBES)
+			return;
+		renderReflection(entities, lights, probe.position, 0);
+		m_device->storeProbe(probe.index, probe.position);
+	});
+	// The dynamic cube was used for capturing
+	m_probeValid = false;
+	logDebug("Baked %d reflection probes", count);
+}
+
+uint RenderSystem::scheduleReflectionFaces(vec3 probePosition)
+{
+	int facesPerFrame = glm::clamp(settings.reflectionFacesPerFrame, 1, 6);
+	float threshold = settings.reflectionMoveThreshold;
+	if (!m_probeValid || facesPerFrame == 6 || glm::distance2(probePosition, m_probePosition) > threshold * threshold) {
+		m_probePosition = probePosition;
+		m_probeValid = true;
+		return RenderDevice::ALL_CUBE_FACES;
+	}
+	uint faces = 0;
+	for (int i = 0; i < facesPerFrame; ++i) {
+		faces |= 1 << m_nextProbeFace;
+		m_nextProbeFace = (m_nextProbeFace + 1) % 6;
+	}
+	return faces;
+}
+
+// Pixel cost goes with area, so the scale follows the square root of the time ratio. Small
+// errors are ignored and steps are damped since the measurement lags a couple of frames.
+float RenderSystem::updateResolutionScale() const
+{
+	float scale = m_device->resolutionScale;
+	float gpuMs = m_device->gpuFrameMs();
+	if (gpuMs <= 0.f)
+		return scale;
+	float ratio = settings.targetFrameMs / gpuMs;
+	if (glm::abs(ratio - 1.f) < 0.05f)
+		return scale;
+	float target = scale * glm::sqrt(ratio);
+	return glm::clamp(glm::mix(scale, target, 0.2f), glm::clamp(settings.minResolutionScale, 0.1f, 1.f), 1.f);
+}
+
 void RenderSystem::render(Entities& entities, Camera& camera, const Transform& camTransform)
 {
 	m_device->stats = RenderDevice::Stats();
+	m_device->beginFrame();
+	m_device->instancing = settings.instancing;
+	m_device->shadowCaching = settings.shadowCaching;
+	m_device->layeredCubes = settings.layeredCubes;
+	m_device->temporalAA = settings.temporalAA;
+	m_device->detailQuality = glm::max(settings.detailQuality, 0.f);
+	m_device->resolutionScale = settings.dynamicResolution ? updateResolutionScale() : 1.f;
 
-	struct ReflectionProbe { float priority; vec3 pos; };
-	std::vector<ReflectionProbe> reflectionProbes;
+	struct ProbeCandidate { float priority; vec3 pos; float radius; };
+	std::vector<ProbeCandidate> reflectionProbes;
+	// With baked probes around only moving objects need the dynamic cube
+	bool bakedProbes = m_device->numProbes() > 0;
 	std::vector<Light> lights;
 
 	START_MEASURE(prerenderMs)
@@ -70,35 +263,53 @@ void RenderSystem::render(Entities& entities, Camera& camera, const Transform& c
 
 	entities.for_each<Model, Transform>([&](Entity, Model& model, Transform& transform) {
 		// Update transform
+		mat4 oldMatrix = transform.matrix;
 		transform.updateMatrix();
+		model.staticFrames = transform.matrix == oldMatrix ? glm::min(model.staticFrames + 1, STATIC_CASTER_FRAMES) : 0;
 		// Update LOD
-		#ifdef SHIPPING_BUILD
-		model.geometry = model.getLod2(glm::distance2(camTransform.position, transform.position));
-		#else
-		model.geometry = settings.forceLod >= 0 ? model.lods[settings.forceLod].geometry
-			: model.getLod2(glm::distance2(camPos, transform.position));
-		#endif
+		int numLods = model.numLods();
+		if (numLods) {
+			int lod = selectLod(model, screenSize(model, transform, camPos, camera.projection, Engine::height()), model.lod);
+			#ifndef SHIPPING_BUILD
+			if (settings.forceLod >= 0)
+				lod = glm::min(settings.forceLod, numLods - 1);
+			#endif
+			if (lod != model.lod && settings.lodCrossFade && lod < numLods && model.lod < numLods) {
+				model.prevLod = model.lod;
+				model.lodFade = 0.f;
+			}
+			model.lod = lod;
+			if (model.prevLod >= 0) {
+				model.lodFade += 1.f / LOD_FADE_FRAMES;
+				if (model.lodFade >= 1.f || !settings.lodCrossFade) {
+					model.prevLod = -1;
+					model.lodFade = 0.f;
+				}
+			}
+			model.geometry = lod < numLods ? model.lods[lod].geometry : nullptr;
+		}
 		// Figure out candidates for reflection location
 		if (frustum.visible(transform, model)) {
 			float reflectivity = 0.f;
 			for (auto& mat : model.materials)
 				if (mat.reflectivity > reflectivity)
 					reflectivity = mat.reflectivity;
-			if (reflectivity > 0.01f) {
+			if (reflectivity > 0.01f && (!bakedProbes || model.staticFrames < STATIC_CASTER_FRAMES)) {
 				float priority = glm::distance2(camPos, transform.position);
 				priority *= 1.1f - reflectivity;
-				reflectionProbes.push_back({ priority, transform.position });
+				reflectionProbes.push_back({ priority, transform.position, model.bounds.radius });
 			}
 		}
 	});
-	std::sort(reflectionProbes.begin(), reflectionProbes.end(), [](const ReflectionProbe& a, const ReflectionProbe& b) {
+	std::sort(reflectionProbes.begin(), reflectionProbes.end(), [](const ProbeCandidate& a, const ProbeCandidate& b) {
 		return a.priority < b.priority;
 	});
 
 	// TODO: Better prioritizing
 	vec3 lightTarget = camPos + camRot * vec3(0, 0, -2);
-	entities.for_each<Light>([&](Entity, Light& light) {
+	entities.for_each<Light>([&](Entity e, Light& light) {
 		light.priority = glm::distance2(lightTarget, light.position);
+		light.id = e.get_id();
 		lights.push_back(light);
 	});
 	std::sort(lights.begin(), lights.end(), [](const Light& a, const Light& b) {
@@ -107,10 +318,24 @@ void RenderSystem::render(Entities& entities, Camera& camera, const Transform& c
 
 	END_MEASURE(prerenderMs)
 
+	// Rasterize occluders for the scene pass
+	START_MEASURE(occlusionMs)
+	if (settings.occlusionCulling) {
+		m_occlusion.clear(camera.projection * camera.view);
+		entities.for_each<Model, Transform>([&](Entity, Model& model, Transform& transform) {
+			if (model.occluder && frustum.visible(transform, model)) {
+				m_occlusion.addOccluder(*model.occluder, transform.matrix);
+				m_device->stats.occluders++;
+			}
+		});
+		m_occlusion.rasterize(&Engine::threadpool());
+	}
+	END_MEASURE(occlusionMs)
+
 	// Fixed amount of time for uploading each frame?
 	START_MEASURE(uploadMs)
 	BEGIN_GPU_SAMPLE(Upload)
-	entities.for_each<Model>([&](Entity, Model& model) {
+	entities.for_each<Model>([&](Entity e, Model& model) {
 		// Upload geometries
 		for (int i = 0; i < Model::MAX_LODS && model.lods[i].geometry; ++i) {
 			Geometry& geom = *model.lods[i].geometry;
@@ -118,9 +343,13 @@ void RenderSystem::render(Entities& entities, Camera& camera, const Transform& c
 				m_device->uploadGeometry(geom);
 		}
 		// Upload materials
-		for (auto& mat : model.materials)
+		for (auto& mat : model.materials) {
 			if (mat.shaderId[0] < 0 || (mat.flags & Material::DIRTY_MAPS))
 				m_device->uploadMaterial(mat);
+			m_device->updateMaterialBlock(mat);
+		}
+		if (settings.impostorDistance > 0.f && !e.has<BoneAnimation>() && !model.materials.empty())
+			m_device->bakeImpostor(model);
 	});
 	END_GPU_SAMPLE()
 	END_MEASURE(uploadMs)
@@ -131,47 +360,40 @@ void RenderSystem::render(Entities& entities, Camera& camera, const Transform& c
 	sun.type = Light::DIRECTIONAL_LIGHT;
 	sun.position = camPos + normalize(m_env.sunPosition) * 10.f;
 	sun.target = camPos;
-	m_device->setupShadowPass(sun, 0);
-	if (settings.shadows) {
-		entities.for_each<Model, Transform>([&](Entity, Model& model, Transform& transform) {
-			// TODO: Shadow frustum culling
-			if (!model.materials.empty() && model.geometry /* && frustum.visible(transform, model) */)
-				m_device->renderShadow(model, transform);
+	m_device->setupCascades(sun, camera);
+	for (uint i = 0; i < m_device->numCascades(); ++i) {
+		m_device->setupCascadePass(i);
+		renderShadowCasters(entities, [&](const Model& model, const Transform& transform) {
+			return m_device->cascadeVisible(i, transform.position, model.bounds.radius);
 		});
 	}
 
-	// TODO: Account for non-point lights
-	uint numCubeShadows = std::min((uint)lights.size(), (uint)MAX_SHADOW_CUBES);
-	for (uint i = 0; i < numCubeShadows; ++i) {
+	// Point light shadows go to atlas tiles, only some of them are redrawn each frame
+	m_device->updateShadowAtlas(lights, camPos);
+	for (uint i : m_device->shadowRenderList()) {
 		Light& light = lights[i];
-		m_device->setupShadowPass(light, 1+i);
-		if (settings.shadows) {
-			entities.for_each<Model, Transform>([&](Entity e, Model& model, Transform& transform) {
-				if (model.materials.empty() || !model.geometry)
-					return;
-				float maxDist = model.bounds.radius + light.distance;
-				if (glm::distance2(light.position, transform.position) < maxDist * maxDist)
-					m_device->renderShadow(model, transform, e.has<BoneAnimation>() ? &e.get<BoneAnimation>() : nullptr);
-			});
-		}
+		m_device->setupShadowPass(light, i);
+		renderShadowCasters(entities, [&](const Model& model, const Transform& transform) {
+			float maxDist = model.bounds.radius + light.distance;
+			return glm::distance2(light.position, transform.position) < maxDist * maxDist;
+		});
 	}
 	END_GPU_SAMPLE()
 	END_MEASURE(shadowMs)
 
-	// Reflection pass
+	// Reflection pass, only when something reflective is in view and spread over several frames
 	START_MEASURE(reflectionMs)
 	BEGIN_GPU_SAMPLE(ReflectionPass)
-	Camera reflCam;
-	reflCam.makePerspective(glm::radians(90.0f), 1.f, 0.25f, 50.f);
-	vec3 reflCamPos = reflectionProbes.empty() ? camPos : reflectionProbes.front().pos;
-	reflCam.updateViewMatrix(reflCamPos, quat());
-	m_device->setupRenderPass(reflCam, lights, TECH_REFLECTION);
-	entities.for_each<Model, Transform>([&](Entity e, Model& model, Transform& transform) {
-		float maxDist = model.bounds.radius + reflCam.far;
-		if (!model.materials.empty() && model.geometry && glm::distance2(reflCamPos, transform.position) < maxDist * maxDist)
-			m_device->render(model, transform, e.has<BoneAnimation>() ? &e.get<BoneAnimation>() : nullptr);
-	});
-	m_device->renderSkybox();
+	bakeReflectionProbes(entities, lights);
+	if (reflectionProbes.empty()) {
+		m_probeValid = false;
+		m_device->dynamicProbe = vec4(0.f);
+	} else {
+		const ProbeCandidate& probe = reflectionProbes.front();
+		m_device->dynamicProbe = vec4(probe.pos, bakedProbes ? probe.radius : FLT_MAX);
+		m_device->reflectionFaces = scheduleReflectionFaces(probe.pos);
+		renderReflection(entities, lights, m_probePosition, settings.reflectionLodBias);
+	}
 	END_GPU_SAMPLE()
 	END_MEASURE(reflectionMs)
 
@@ -179,10 +401,54 @@ void RenderSystem::render(Entities& entities, Camera& camera, const Transform& c
 	START_MEASURE(sceneMs)
 	BEGIN_GPU_SAMPLE(ScenePass)
 	m_device->setupRenderPass(camera, lights, TECH_COLOR);
+	m_visibleModels.clear();
 	entities.for_each<Model, Transform>([&](Entity e, Model& model, Transform& transform) {
-		if (!model.materials.empty() && model.geometry && frustum.visible(transform, model))
-			m_device->render(model, transform, e.has<BoneAnimation>() ? &e.get<BoneAnimation>() : nullptr);
+		if (model.materials.empty() || !model.geometry)
+			return;
+		// Far static models collapse into one instanced billboard draw per baked model
+		if (settings.impostorDistance > 0.f && !e.has<BoneAnimation>() && frustum.visible(transform, model)
+			&& glm::distance(camPos, transform.position) - model.bounds.radius > settings.impostorDistance
+			&& m_device->addImpostor(model, transform))
+			return;
+		// Static meshes can be culled and drawn on the GPU, unless cross-fading
+		if (settings.gpuCulling && !e.has<BoneAnimation>() && model.prevLod < 0 && m_device->addCulledInstance(model, transform))
+			return;
+		if (!frustum.visible(transform, model))
+			return;
+		if (settings.occlusionCulling) {
+			m_device->stats.occlusionTested++;
+			if (!m_occlusion.visible(model.geometry->bounds, transform.matrix)) {
+				m_device->stats.occlusionCulled++;
+				return;
+			}
+		}
+		m_visibleModels.push_back({ &model, &transform, e.has<BoneAnimation>() ? &e.get<BoneAnimation>() : nullptr, nullptr });
 	});
+	// Cross-fading models draw both LODs with complementary dither patterns
+	auto renderVisible = [&]() {
+		for (auto& entry : m_visibleModels) {
+			Model& model = *entry.model;
+			if (model.prevLod >= 0) {
+				m_device->render(model, *entry.transform, entry.animation, model.lods[model.prevLod].geometry, model.lodFade);
+				m_device->render(model, *entry.transform, entry.animation, model.geometry, -model.lodFade);
+			} else m_device->render(model, *entry.transform, entry.animation);
+		}
+		m_device->flush();
+	};
+	if (m_env.deferred) {
+		m_device->beginDeferred();
+		renderVisible();
+		m_device->renderImpostors();
+		m_device->endDeferred();
+	} else if (m_env.depthPrepass) {
+		m_device->beginDepthPrepass();
+		renderVisible();
+		m_device->endDepthPrepass();
+	}
+	renderVisible();
+	m_device->renderImpostors();
+	if (settings.gpuCulling)
+		m_device->renderCulledInstances(settings.hizCulling);
 	m_device->renderSkybox();
 	END_GPU_SAMPLE()
 	END_MEASURE(sceneMs)
@@ -195,6 +461,7 @@ void RenderSystem::render(Entities& entities, Camera& camera, const Transform& c
 
 	RenderDevice::Stats& stats = m_device->stats;
 	stats.times.prerender = prerenderMs;
+	stats.times.occlusion = occlusionMs;
 	stats.times.upload = uploadMs;
 	stats.times.shadow = shadowMs;
 	stats.times.reflection = reflectionMs;
@@ -1,12 +1,16 @@
 #pragma once
 #include "common.hpp"
 #include "environment.hpp"
+#include "occlusion.hpp"
 
 class RenderDevice;
 class Resources;
 struct Camera;
 struct Transform;
 struct Model;
+struct Geometry;
+struct BoneAnimation;
+struct Light;
 
 class RenderSystem : public System
 {
@@ -26,10 +30,63 @@ public:
 	struct Settings {
 		bool shadows = true;
 		int forceLod = -1;
+		bool occlusionCulling = false;
+		bool gpuCulling = false;
+		bool hizCulling = false;
+		bool instancing = true;
+		bool shadowCaching = true;
+		bool layeredCubes = true;
+		int reflectionFacesPerFrame = 2; // Reflection cube faces refreshed each frame while the probe stays put
+		float reflectionMoveThreshold = 1.f; // Probe movement that triggers a full refresh
+		float lodBias = 0.f; // Halvings of screen size, positive picks coarser LODs
+		int shadowLodBias = 1; // Extra LOD steps for shadow casters
+		int reflectionLodBias = 1; // Extra LOD steps for geometry in the reflection pass
+		bool lodCrossFade = true; // Dither between LODs for a few frames instead of popping
+		float impostorDistance = 0.f; // Static models further than this are drawn as billboards, 0 disables
+		bool temporalAA = false;
+		bool dynamicResolution = false; // Scales the scene resolution to hold targetFrameMs on the GPU
+		float targetFrameMs = 16.6f;
+		float minResolutionScale = 0.5f;
+		float detailQuality = 1.f; // Tessellation, parallax and shadow filtering detail
 	} settings;
 
 private:
+	// Renders casters accepted by the filter into the current shadow pass, static ones through the cache
+	template<typename Filter> void renderShadowCasters(Entities& entities, Filter filter);
+	// Faces of the reflection cube to redraw this frame, moves the probe if needed
+	uint scheduleReflectionFaces(vec3 probePosition);
+	// Next frame's resolution scale from the measured GPU time
+	float updateResolutionScale() const;
+	// Renders the reflection cube from position with the faces set in the device
+	void renderReflection(Entities& entities, const std::vector<Light>& lights, vec3 position, int lodBias);
+	// Renders scene probes that haven't been baked yet into the probe array
+	void bakeReflectionProbes(Entities& entities, const std::vector<Light>& lights);
+	// Projected diameter of the bounds in pixels of a viewHeight tall target
+	static float screenSize(const Model& model, const Transform& transform, vec3 eye, const mat4& projection, float viewHeight);
+	// LOD for the screen size, numLods() if the model is too small to draw. Sticks to current near thresholds.
+	int selectLod(const Model& model, float pixels, int current) const;
+	static Geometry* lodGeometry(const Model& model, int lod);
+
+	static const uint STATIC_CASTER_FRAMES = 30; // Unmoved frames before a caster is cached
+	static const uint LOD_FADE_FRAMES = 20;
+	static const float LOD_HYSTERESIS; // Fraction of a threshold to pass before leaving the current LOD
+	static const float LOD_FULL_DETAIL_PIXELS; // Screen size below which LOD 1 is used, halves per LOD
+	static const float LOD_REFERENCE_SCALE; // Authored LOD distances are for this projection scale
+	struct DrawEntity
+	{
+		Model* model;
+		Transform* transform;
+		BoneAnimation* animation;
+		Geometry* geometry; // LOD to draw, null for the model's current one
+	};
+	std::vector<DrawEntity> m_staticCasters;
+	std::vector<DrawEntity> m_dynamicCasters;
+	std::vector<DrawEntity> m_visibleModels; // Scene pass, kept for the depth pre-pass
+	vec3 m_probePosition; // Where the reflection cube was rendered from
+	bool m_probeValid = false;
+	uint m_nextProbeFace = 0;
 	std::unique_ptr<RenderDevice> m_device;
 	std::vector<Model*> m_models;
 	Environment m_env;
+	OcclusionBuffer m_occlusion;
 };
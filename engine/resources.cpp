@@ -1,6 +1,7 @@
 #include "resources.hpp"
 #include "image.hpp"
 #include "geometry.hpp"
+#include "engine.hpp"
 #include <fstream>
 #include <sstream>
 #include <algorithm>
@@ -195,20 +196,65 @@ Image*Resources::getImageAsync(const std::string& path)
 	return ptr.get();
 }
 
+// Loaded geometry is never edited afterwards, so it is optimized for the GPU unless disabled
+void Resources::optimizeGeometry(Geometry& geometry)
+{
+	const Json& optimize = Engine::settings["renderer"]["optimizeMeshes"];
+	if (!optimize.is_bool() || optimize.bool_value())
+		geometry.optimize();
+}
+
 Geometry* Resources::getGeometry(const string& path)
 {
 	auto& ptr = m_geoms[path];
-	if (!ptr) ptr.reset(new Geometry(findPath(path)));
+	if (!ptr) {
+		ptr.reset(new Geometry(findPath(path)));
+		optimizeGeometry(*ptr);
+	}
 	return ptr.get();
 }
 
 Geometry* Resources::getHeightmap(const string& path)
 {
 	auto& ptr = m_geoms[path];
-	if (!ptr) ptr.reset(new Geometry(*getImage(findPath(path))));
+	if (!ptr) {
+		ptr.reset(new Geometry(*getImage(findPath(path))));
+		optimizeGeometry(*ptr);
+	}
+	return ptr.get();
+}
+
+Geometry* Resources::getSimplifiedGeometry(const string& path, float ratio)
+{
+	auto& ptr = m_geoms[path + "#" + std::to_string(ratio)];
+	if (!ptr) {
+		ptr.reset(new Geometry(*getGeometry(path), ratio));
+		optimizeGeometry(*ptr);
+	}
 	return ptr.get();
 }
 
+const Resources::Stats& Resources::updateStats()
+{
+	stats.texts = m_texts.size();
+	stats.binaries = m_binaries.size();
+	stats.images = m_images.size();
+	stats.geometries = m_geoms.size();
+	float missesBefore = 0.f, missesAfter = 0.f;
+	uint triangles = 0;
+	for (auto& it : m_geoms) {
+		if (!it.second)
+			continue;
+		const Geometry& geom = *it.second;
+		missesBefore += geom.acmrBefore * geom.numTriangles;
+		missesAfter += geom.acmrAfter * geom.numTriangles;
+		triangles += geom.numTriangles;
+	}
+	stats.acmrBefore = triangles ? missesBefore / triangles : 0.f;
+	stats.acmrAfter = triangles ? missesAfter / triangles : 0.f;
+	return stats;
+}
+
 void Resources::startAsyncLoading()
 {
 	if (m_loadQueue.empty())
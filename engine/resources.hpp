@@ -29,6 +29,8 @@ public:
 	Image* getImageAsync(const string& path);
 	Geometry* getGeometry(const string& path);
 	Geometry* getHeightmap(const string& path);
+	// Generated LOD of an already loaded geometry
+	Geometry* getSimplifiedGeometry(const string& path, float ratio);
 
 	void startAsyncLoading();
 
@@ -37,15 +39,11 @@ public:
 		uint binaries = 0;
 		uint images = 0;
 		uint geometries = 0;
+		float acmrBefore = 0.f; // Vertex cache misses per triangle of the loaded geometry, as loaded
+		float acmrAfter = 0.f; // and after optimizing
 	} stats;
 
-	const Stats& updateStats() {
-		stats.texts = m_texts.size();
-		stats.binaries = m_binaries.size();
-		stats.images = m_images.size();
-		stats.geometries = m_geoms.size();
-		return stats;
-	}
+	const Stats& updateStats();
 
 private:
 	std::vector<string> m_paths;
@@ -53,6 +51,7 @@ private:
 	std::map<string, std::unique_ptr<std::vector<char>>> m_binaries;
 	std::map<string, std::unique_ptr<Image>> m_images;
 	std::map<string, std::unique_ptr<Geometry>> m_geoms;
+	void optimizeGeometry(Geometry& geometry);
 
 	volatile bool m_loadingActive = false;
 	std::vector<Image*> m_loadQueue;
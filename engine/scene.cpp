@@ -160,29 +160,63 @@ namespace {
 
 	void parseModel(Model& model, const Json& def, Resources& resources, const string& pathContext) {
 		// Parse geometry
+		int authoredLods = Model::MAX_LODS; // Simplified LODs can bulge past the surface, unfit as occluders
 		if (!def["geometry"].is_null()) {
 			const Json& defGeom = def["geometry"];
+			string lodSource; // Mesh to generate missing LODs from
+			const Json* lodRatios = &def["lodRatios"];
 			if (defGeom.is_string()) {
 				const string geomPath = resolvePath(pathContext, defGeom.string_value());
 				if (endsWith(geomPath, ".png") || endsWith(geomPath, ".jpg") || endsWith(geomPath, ".jpeg") || endsWith(geomPath, ".tga"))
 					model.lods[0].geometry = resources.getHeightmap(geomPath);
-				else model.lods[0].geometry = resources.getGeometry(geomPath);
+				else {
+					model.lods[0].geometry = resources.getGeometry(geomPath);
+					// Heightmaps only get LODs when asked for, meshes by default
+					if (lodRatios->is_null())
+						lodRatios = &Engine::settings["renderer"]["lodRatios"];
+				}
+				lodSource = geomPath;
 			} else if (defGeom.is_array()) {
 				const Json::array& lods = defGeom.array_items();
 				ASSERT(lods.size() <= Model::MAX_LODS);
 				int i = 0;
 				for (auto& lodDef : lods) {
-					ASSERT(lodDef.is_object());
-					const string geomPath = resolvePath(pathContext, lodDef.object_items().begin()->first);
-					model.lods[i].geometry = resources.getGeometry(geomPath);
-					model.lods[i].distSq = lodDef.object_items().begin()->second.number_value();
-					model.lods[i].distSq *= model.lods[i].distSq;
+					if (lodDef.is_string()) {
+						model.lods[i].geometry = resources.getGeometry(resolvePath(pathContext, lodDef.string_value()));
+					} else {
+						ASSERT(lodDef.is_object());
+						const string geomPath = resolvePath(pathContext, lodDef.object_items().begin()->first);
+						model.lods[i].geometry = resources.getGeometry(geomPath);
+						model.lods[i].distance = lodDef.object_items().begin()->second.number_value();
+					}
 					++i;
 				}
 			} else ASSERT(!"Unknown geometry definition");
+			// Simplified from the single authored LOD
+			if (!lodSource.empty() && lodRatios->is_array()) {
+				authoredLods = 1;
+				int i = 1;
+				for (auto& ratio : lodRatios->array_items()) {
+					if (i >= Model::MAX_LODS)
+						break;
+					if (ratio.is_number() && ratio.number_value() > 0.0 && ratio.number_value() < 1.0)
+						model.lods[i++].geometry = resources.getSimplifiedGeometry(lodSource, ratio.number_value());
+					else logError("Invalid LOD ratio %s", ratio.dump().c_str());
+				}
+			}
 			model.geometry = model.lods[0].geometry;
 		}
 
+		// Parse occluder
+		const Json& occluderDef = def["occluder"];
+		if (occluderDef.is_string()) {
+			model.occluder = resources.getGeometry(resolvePath(pathContext, occluderDef.string_value()));
+		} else if (occluderDef.bool_value()) {
+			// Use the lowest detail authored LOD
+			for (int i = 0; i < authoredLods && model.lods[i].geometry; ++i)
+				model.occluder = model.lods[i].geometry;
+		}
+
 		// Parse material
 		const Json& materialDef = def["material"];
 		if (materialDef.is_object()) {
@@ -245,6 +279,10 @@ namespace {
 		setColor(env.sunColor, def["sunColor"]);
 		setColor(env.fogColor, def["fogColor"]);
 		setNumber(env.fogDensity, def["fogDensity"]);
+		if (def["depthPrepass"].is_bool())
+			env.depthPrepass = def["depthPrepass"].bool_value();
+		if (def["deferred"].is_bool())
+			env.deferred = def["deferred"].bool_value();
 		return env;
 	}
 }
@@ -439,6 +477,13 @@ Entity SceneLoader::instantiate(Json def, Resources& resources, const string& pa
 		numLights++;
 	}
 
+	if (!def["reflectionProbe"].is_null()) {
+		ReflectionProbe probe;
+		if (!def["position"].is_null())
+			probe.position = toVec3(def["position"]);
+		entity.add(probe);
+	}
+
 	if (!def["geometry"].is_null()) {
 		Model model;
 		parseModel(model, def, resources, pathContext);
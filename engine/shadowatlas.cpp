@@ -0,0 +1,126 @@
+#include "shadowatlas.hpp"
+#include "components.hpp"
+#include <algorithm>
+
+namespace {
+	// Tile size is atlas size >> (3 + class), rows of blocks per class fill the atlas exactly
+	const uint s_classRows[ShadowAtlas::NUM_CLASSES] = { 2, 2, 2, 4 };
+	// Light radius divided by distance to camera needed for each class
+	const float s_classCoverage[ShadowAtlas::NUM_CLASSES] = { 1.f, 0.5f, 0.25f, 0.f };
+	const float s_minCoverage = 0.05f;
+}
+
+void ShadowAtlas::create(uint size)
+{
+	ASSERT(size >= 64);
+	m_size = size;
+	m_slots.clear();
+	uint y = 0;
+	for (uint c = 0; c < NUM_CLASSES; ++c) {
+		uint tileSize = size >> (3 + c);
+		uint blocksPerRow = size / (tileSize * 3);
+		for (uint row = 0; row < s_classRows[c]; ++row) {
+			for (uint i = 0; i < blocksPerRow; ++i) {
+				Slot slot;
+				slot.x = i * tileSize * 3;
+				slot.y = y;
+				slot.tileSize = tileSize;
+				slot.sizeClass = c;
+				m_slots.push_back(slot);
+			}
+			y += tileSize * 2;
+		}
+	}
+	ASSERT(y == size);
+}
+
+void ShadowAtlas::update(const Light* lights, uint numLights, vec3 cameraPosition, uint frame, uint budget)
+{
+	m_lightSlots.assign(numLights, -1);
+	m_candidates.clear();
+	for (uint i = 0; i < numLights; ++i) {
+		const Light& light = lights[i];
+		if (light.type != Light::POINT_LIGHT)
+			continue;
+		float dist = glm::max(glm::distance(cameraPosition, light.position), 0.001f);
+		float coverage = light.distance / dist;
+		if (coverage < s_minCoverage)
+			continue;
+		uint sizeClass = 0;
+		while (coverage < s_classCoverage[sizeClass])
+			++sizeClass;
+		m_candidates.push_back({ i, coverage, sizeClass });
+	}
+	std::sort(m_candidates.begin(), m_candidates.end(), [](const Candidate& a, const Candidate& b) {
+		return a.coverage > b.coverage;
+	});
+
+	// Lights keep their slot while it is at most one class off, so tiles don't get reshuffled constantly
+	std::vector<bool> owned(m_slots.size());
+	for (uint s = 0; s < m_slots.size(); ++s) {
+		owned[s] = m_slots[s].claimed;
+		m_slots[s].claimed = false;
+	}
+	for (auto& c : m_candidates) {
+		uint id = lights[c.light].id;
+		for (uint s = 0; s < m_slots.size(); ++s) {
+			Slot& slot = m_slots[s];
+			if (owned[s] && !slot.claimed && slot.lightId == id
+				&& (int)glm::abs((int)slot.sizeClass - (int)c.sizeClass) <= 1) {
+				slot.claimed = true;
+				m_lightSlots[c.light] = s;
+				break;
+			}
+		}
+	}
+	// The rest take the first free slot of their class or smaller
+	for (auto& c : m_candidates) {
+		if (m_lightSlots[c.light] >= 0)
+			continue;
+		for (uint s = 0; s < m_slots.size(); ++s) {
+			Slot& slot = m_slots[s];
+			if (slot.claimed || slot.sizeClass < c.sizeClass)
+				continue;
+			slot.claimed = true;
+			slot.lightId = lights[c.light].id;
+			slot.rendered = false;
+			m_lightSlots[c.light] = s;
+			break;
+		}
+	}
+
+	// New slots first, then the ones most overdue for their class' refresh interval
+	struct Due { uint light; float urgency; };
+	std::vector<Due> due;
+	for (auto& c : m_candidates) {
+		int s = m_lightSlots[c.light];
+		if (s < 0)
+			continue;
+		const Slot& slot = m_slots[s];
+		if (!slot.rendered) {
+			due.push_back({ c.light, FLT_MAX });
+			continue;
+		}
+		uint interval = 1 << slot.sizeClass;
+		uint age = frame - slot.lastRender;
+		if (age >= interval)
+			due.push_back({ c.light, (float)age / interval + c.coverage });
+	}
+	std::stable_sort(due.begin(), due.end(), [](const Due& a, const Due& b) {
+		return a.urgency > b.urgency;
+	});
+	m_renderList.clear();
+	for (uint i = 0; i < due.size() && i < budget; ++i)
+		m_renderList.push_back(due[i].light);
+}
+
+void ShadowAtlas::rendered(uint light, const Light& data, uint frame)
+{
+	int s = lightSlot(light);
+	ASSERT(s >= 0);
+	Slot& slot = m_slots[s];
+	slot.lastRender = frame;
+	slot.origin = data.position;
+	slot.far = data.distance;
+	slot.rendered = true;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include "common.hpp"
+
+struct Light;
+
+// Tile allocation for point light shadows packed into one depth texture.
+// Each light gets a block of 3x2 tiles (one per cube face). Block sizes come
+// in a few classes and are handed out by estimated screen coverage; smaller
+// classes also refresh less often, within a per frame budget.
+class ShadowAtlas
+{
+public:
+	static const uint NUM_CLASSES = 4;
+
+	struct Slot
+	{
+		uint x = 0, y = 0; // Texels
+		uint tileSize = 0;
+		uint sizeClass = 0;
+		uint lightId = 0;
+		uint lastRender = 0; // Frame
+		vec3 origin; // Light position when rendered
+		float far = 0.f;
+		bool claimed = false;
+		bool rendered = false;
+	};
+
+	void create(uint size);
+	// Assigns slots for this frame and picks the lights to render, at most budget of them
+	void update(const Light* lights, uint numLights, vec3 cameraPosition, uint frame, uint budget);
+	// Marks the light's shadow as rendered from its current position
+	void rendered(uint light, const Light& data, uint frame);
+
+	uint size() const { return m_size; }
+	int lightSlot(uint light) const { return light < m_lightSlots.size() ? m_lightSlots[light] : -1; }
+	const Slot& slot(int index) const { return m_slots[index]; }
+	// Light indices to render this frame
+	const std::vector<uint>& renderList() const { return m_renderList; }
+	uint numSlots() const { return m_slots.size(); }
+
+private:
+	struct Candidate
+	{
+		uint light;
+		float coverage;
+		uint sizeClass;
+	};
+
+	uint m_size = 0;
+	std::vector<Slot> m_slots; // Sorted by class, largest first
+	std::vector<int> m_lightSlots;
+	std::vector<Candidate> m_candidates;
+	std::vector<uint> m_renderList;
+};
@@ -77,17 +77,59 @@ EXPORT void ModuleFunc(uint msg, void* param)
 					ImGui::Text("CPU Render:   %.3fms", renderTimeMs);*/
 					if (ImGui::TreeNode("Render times")) {
 						ImGui::Text("Prerender:    %.3fms", stats.times.prerender);
+						ImGui::Text("Occlusion:    %.3fms", stats.times.occlusion);
 						ImGui::Text("Upload:       %.3fms", stats.times.upload);
 						ImGui::Text("Shadow:       %.3fms", stats.times.shadow);
 						ImGui::Text("Reflection:   %.3fms", stats.times.reflection);
 						ImGui::Text("Scene:        %.3fms", stats.times.scene);
 						ImGui::Text("Postprocess:  %.3fms", stats.times.postprocess);
+						ImGui::Text("GPU frame:    %.3fms", stats.gpuFrameMs);
 						ImGui::TreePop();
 					}
 					ImGui::Text("Lights:       %d", stats.lights);
+					ImGui::Text("Cluster refs: %d", stats.lightAssignments);
 					ImGui::Text("Triangles:    %d", stats.triangles);
+					ImGui::Text("Overdraw:     %.2f", stats.overdraw);
+					ImGui::Text("Resolution:   %d%%", (int)(stats.resolutionScale * 100.f + 0.5f));
+					ImGui::Text("Pre-pass:     %d", stats.prepassItems);
+					ImGui::Text("Deferred:     %d", stats.deferredItems);
 					ImGui::Text("Programs:     %d", stats.programs);
 					ImGui::Text("Draw calls:   %d", stats.drawCalls);
+					if (ImGui::TreeNode("Avoided state changes")) {
+						ImGui::Text("Programs:     %d", stats.avoided.programs);
+						ImGui::Text("Materials:    %d", stats.avoided.materials);
+						ImGui::Text("Textures:     %d", stats.avoided.textures);
+						ImGui::Text("VAOs:         %d", stats.avoided.vaos);
+						ImGui::TreePop();
+					}
+					ImGui::Text("Occluders:    %d", stats.occluders);
+					ImGui::Text("Occl. culled: %d/%d (%.0f%%)", stats.occlusionCulled, stats.occlusionTested,
+						stats.occlusionTested ? 100.f * stats.occlusionCulled / stats.occlusionTested : 0.f);
+					ImGui::Text("Instances:    %d", stats.instances);
+					ImGui::Text("GPU instances: %d", stats.gpuInstances);
+					ImGui::Text("Impostors:    %d", stats.impostors);
+					ImGui::Text("Indirect cmds: %d", stats.indirectCommands);
+					ImGui::Text("Streamed:     %.1f KB", stats.bytesStreamed / 1024.f);
+					ImGui::Text("Shadow cache: %d/%d", stats.shadowCacheHits, stats.shadowMaps);
+					ImGui::Text("Shadowed lights: %d", stats.shadowedLights);
+					ImGui::Text("Culled faces: %d", stats.culledCubeFaces);
+					ImGui::Text("Culled passes: %d", stats.culledPasses);
+					if (ImGui::TreeNode("Render targets")) {
+						const FrameGraph& graph = renderer.device().frameGraph();
+						uint total = graph.poolBytes();
+						for (auto& res : graph.resources()) {
+							if (res.transient && !res.used)
+								ImGui::Text("%-18s culled", res.name);
+							else if (res.transient)
+								ImGui::Text("%-18s %6.2f MB  pool %d", res.name, res.bytes / 1048576.f, res.physical);
+							else if (res.bytes)
+								ImGui::Text("%-18s %6.2f MB", res.name, res.bytes / 1048576.f);
+							if (!res.transient)
+								total += res.bytes;
+						}
+						ImGui::Text("Total:             %6.2f MB", total / 1048576.f);
+						ImGui::TreePop();
+					}
 					ImGui::Separator();
 					ImGui::Text("Voices:       %d/%d (%d)",
 						audio.soloud->getActiveVoiceCount(),
@@ -98,6 +140,7 @@ EXPORT void ModuleFunc(uint msg, void* param)
 						const Resources::Stats& res = game.resources.updateStats();
 						ImGui::Text("Images:        %5u  (textures, heightmaps...)", res.images);
 						ImGui::Text("Geometries:    %5u  (includes different lods)", res.geometries);
+						ImGui::Text("Vertex cache:  %5.2f  (ACMR, %.2f as loaded)", res.acmrAfter, res.acmrBefore);
 						ImGui::Text("Text files:    %5u  (e.g. shader files)", res.texts);
 						ImGui::Text("Misc binaries: %5u  (e.g. audio samples)", res.binaries);
 						ImGui::TreePop();
@@ -127,7 +170,7 @@ EXPORT void ModuleFunc(uint msg, void* param)
 					ImGui::SliderInt("Tonemap", (int*)&env.tonemap, 0, Environment::TONEMAP_COUNT-1);
 					ImGui::SliderFloat("Exposure", &env.exposure, 0.0f, 10.0f);
 					ImGui::SliderFloat("Bloom Threshold", &env.bloomThreshold, 0.0f, 2.0f);
-					ImGui::SliderFloat("Bloom Intensity", &env.bloomIntensity, 1.0f, 10.0f);
+					ImGui::SliderFloat("Bloom Intensity", &env.bloomIntensity, 0.0f, 4.0f);
 					ImGui::SliderFloat("Shadow Darkness", &env.shadowDarkness, 0.0f, 1.0f);
 					ImGui::ColorEdit3("Ambient", (float*)&env.ambient);
 					ImGui::ColorEdit3("Sun Color", (float*)&env.sunColor);
@@ -136,6 +179,9 @@ EXPORT void ModuleFunc(uint msg, void* param)
 					ImGui::SliderFloat("Fog Density", &env.fogDensity, 0.0f, 1.0f);
 					ImGui::SliderInt("Sky Type", (int*)&env.skyType, 0, Environment::SKY_COUNT-1);
 					Tooltip("Skybox, Procedural");
+					ImGui::Checkbox("Depth pre-pass", &env.depthPrepass);
+					ImGui::Checkbox("Deferred shading", &env.deferred);
+					Tooltip("Replaces the depth pre-pass");
 				}
 				if (ImGui::CollapsingHeader("Post Effects")) {
 					Environment& env = renderer.env();
@@ -226,6 +272,30 @@ EXPORT void ModuleFunc(uint msg, void* param)
 						}
 					}
 					ImGui::SliderInt("Force LOD", &renderer.settings.forceLod, -1, Model::MAX_LODS - 1);
+					ImGui::SliderFloat("LOD bias", &renderer.settings.lodBias, -2.f, 4.f);
+					Tooltip("Halvings of screen size, positive is coarser");
+					ImGui::SliderInt("Shadow LOD bias", &renderer.settings.shadowLodBias, 0, Model::MAX_LODS - 1);
+					ImGui::Checkbox("LOD cross-fade", &renderer.settings.lodCrossFade);
+					ImGui::SliderFloat("Impostor distance", &renderer.settings.impostorDistance, 0.f, 500.f);
+					Tooltip("Static models beyond this are billboards, 0 is off");
+					ImGui::Checkbox("Instancing", &renderer.settings.instancing);
+					ImGui::Checkbox("Shadow caching", &renderer.settings.shadowCaching);
+					if (renderer.device().caps.vertexLayer)
+						ImGui::Checkbox("Layered cubes", &renderer.settings.layeredCubes);
+					ImGui::SliderInt("Reflection faces/frame", &renderer.settings.reflectionFacesPerFrame, 1, 6);
+					ImGui::Checkbox("Occlusion culling", &renderer.settings.occlusionCulling);
+					ImGui::Checkbox("GPU culling", &renderer.settings.gpuCulling);
+					ImGui::SameLine();
+					ImGui::Checkbox("Hi-Z", &renderer.settings.hizCulling);
+					ImGui::SliderFloat("Detail quality", &renderer.settings.detailQuality, 0.f, 2.f);
+					Tooltip("Tessellation, parallax and shadow filtering, on top of their distance falloff");
+					ImGui::Checkbox("Temporal AA", &renderer.settings.temporalAA);
+					ImGui::Checkbox("Dynamic resolution", &renderer.settings.dynamicResolution);
+					Tooltip("Upscaled by temporal AA when it is on");
+					if (renderer.settings.dynamicResolution) {
+						ImGui::SliderFloat("Target GPU ms", &renderer.settings.targetFrameMs, 4.f, 50.f);
+						ImGui::SliderFloat("Min scale", &renderer.settings.minResolutionScale, 0.25f, 1.f);
+					}
 				}
 				if (ImGui::CollapsingHeader("Entities")) {
 					game.entities.for_each<Transform>([](Entity e, Transform& trans) {
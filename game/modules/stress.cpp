@@ -0,0 +1,99 @@
+// Spawns a large amount of identical objects to stress test the renderer (instancing, culling...).
+// Load with stressscene.json.
+
+#include "common.hpp"
+#include "components.hpp"
+#include "geometry.hpp"
+#include "engine.hpp"
+#include "../game.hpp"
+#include <glm/gtx/component_wise.hpp>
+#include <glm/gtc/random.hpp>
+
+static const int s_gridSize = 224; // 224^2 ~= 50k objects
+static const float s_spacing = 1.5f;
+static const int s_numLights = 256;
+static const vec3 s_colors[] = {
+	vec3(0.8f, 0.2f, 0.2f),
+	vec3(0.2f, 0.8f, 0.2f),
+	vec3(0.2f, 0.2f, 0.8f),
+	vec3(0.8f, 0.8f, 0.8f)
+};
+
+struct Spinner {
+	float speed = 1.f;
+};
+
+struct Orbiter {
+	vec3 center;
+	float radius = 1.f;
+	float angle = 0.f;
+	float speed = 1.f;
+};
+
+static void spawnObjects(Game& game)
+{
+	Geometry* geometry = game.resources.getGeometry("debug/cube.obj");
+	float offset = (s_gridSize - 1) * s_spacing * 0.5f;
+	for (int z = 0; z < s_gridSize; ++z) {
+		for (int x = 0; x < s_gridSize; ++x) {
+			Entity e = game.entities.create();
+			Transform& trans = e.add<Transform>();
+			trans.position = vec3(x * s_spacing - offset, 0.f, z * s_spacing - offset);
+			trans.scale = vec3(0.5f);
+			e.add<Spinner>().speed = 0.5f + (x + z) % 5 * 0.25f;
+			Model& model = e.add<Model>();
+			model.lods[0].geometry = model.geometry = geometry;
+			model.bounds.min = geometry->bounds.min * trans.scale;
+			model.bounds.max = geometry->bounds.max * trans.scale;
+			model.bounds.radius = geometry->bounds.radius * glm::compMax(trans.scale);
+			Material material;
+			material.diffuse = s_colors[(x * 7 + z * 3) % ::countof(s_colors)];
+			model.materials.emplace_back(material);
+		}
+	}
+	logInfo("Stress test: spawned %d objects", s_gridSize * s_gridSize);
+}
+
+static void spawnLights(Game& game)
+{
+	float extent = s_gridSize * s_spacing * 0.5f;
+	for (int i = 0; i < s_numLights; ++i) {
+		Entity e = game.entities.create();
+		Orbiter& orbiter = e.add<Orbiter>();
+		orbiter.center = vec3(glm::linearRand(-extent, extent), 1.f, glm::linearRand(-extent, extent));
+		orbiter.radius = glm::linearRand(1.f, 6.f);
+		orbiter.angle = glm::linearRand(0.f, glm::two_pi<float>());
+		orbiter.speed = glm::linearRand(-1.f, 1.f);
+		Light& light = e.add<Light>();
+		light.type = Light::POINT_LIGHT;
+		light.color = s_colors[i % ::countof(s_colors)] * 2.f;
+		light.distance = glm::linearRand(4.f, 6.f);
+	}
+	logInfo("Stress test: spawned %d lights", s_numLights);
+}
+
+EXPORT void ModuleFunc(uint msg, void* param)
+{
+	Game& game = *static_cast<Game*>(param);
+	switch (msg) {
+		case $id(INIT):
+		{
+			game.engine.moduleInit();
+			spawnObjects(game);
+			spawnLights(game);
+			break;
+		}
+		case $id(UPDATE):
+		{
+			float dt = game.engine.dt;
+			game.entities.for_each<Spinner, Transform>([dt](Entity, Spinner& spinner, Transform& trans) {
+				trans.rotation = glm::angleAxis(spinner.speed * dt, vec3(0, 1, 0)) * trans.rotation;
+			});
+			game.entities.for_each<Orbiter, Light>([dt](Entity, Orbiter& orbiter, Light& light) {
+				orbiter.angle += orbiter.speed * dt;
+				light.position = orbiter.center + vec3(glm::cos(orbiter.angle), 0.f, glm::sin(orbiter.angle)) * orbiter.radius;
+			});
+			break;
+		}
+	}
+}